@@ -0,0 +1,394 @@
+/* Benchmark tbmate on synthetic cohorts
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+/* Each case runs tbmate as a child process. Wall time comes from the
+   monotonic clock and peak RSS from wait4. One TSV line is written per
+   case:
+
+   case  dtype  samples  threads  rows  cells  bytes  seconds
+   rows_per_s  cells_per_s  MB_per_s  max_rss_kb
+*/
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "wzio.h"
+#include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/tbx.h"
+#include "htslib/htslib/kstring.h"
+#include "htslib/htslib/ksort.h"
+
+KSORT_INIT(bench64, int64_t, ks_lt_generic)
+
+typedef struct bench_conf_t {
+  char *dir;
+  char *exe;
+  char *dtype;
+  int64_t n_rows;
+  int n_regions;
+  int *samples; int n_samples;  /* sample counts */
+  int *threads; int n_threads;  /* thread counts */
+  int repeats;
+  FILE *out;
+  int n_failed;                 /* cases whose command failed */
+} bench_conf_t;
+
+static int usage() {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate bench [options]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -d        working directory for the synthetic cohort [bench_tmp]\n");
+  fprintf(stderr, "    -r        number of rows [1000000]\n");
+  fprintf(stderr, "    -s        comma-separated sample counts [1,10]\n");
+  fprintf(stderr, "    -t        comma-separated thread counts [1,4]\n");
+  fprintf(stderr, "    -T        data type passed to pack -s [ones]\n");
+  fprintf(stderr, "    -R        number of random regions for view -R [1000]\n");
+  fprintf(stderr, "    -n        repeats per case [1]\n");
+  fprintf(stderr, "    -x        tbmate executable [/proc/self/exe]\n");
+  fprintf(stderr, "    -o        output, TSV [stdout]\n");
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, the synthetic cohort in the working directory is reused when rows,\n");
+  fprintf(stderr, "samples, data type and regions are unchanged. A case whose command fails\n");
+  fprintf(stderr, "is reported with status failed and bench exits non-zero.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+static int *parse_int_list(char *s, int *n) {
+  char **fields; int nfields, i;
+  line_get_fields(s, ",", &fields, &nfields);
+  int *a = calloc(nfields, sizeof(int));
+  for (i=0, *n=0; i<nfields; ++i) if (fields[i]) a[(*n)++] = atoi(fields[i]);
+  free_fields(fields, nfields);
+  return a;
+}
+
+static int64_t file_size(const char *fname) {
+  struct stat st;
+  if (stat(fname, &st)) return 0;
+  return st.st_size;
+}
+
+/* deterministic generator so runs are comparable */
+static uint64_t bench_rand_state = 88172645463325252ULL;
+static inline uint64_t bench_rand() {
+  bench_rand_state ^= bench_rand_state << 13;
+  bench_rand_state ^= bench_rand_state >> 7;
+  bench_rand_state ^= bench_rand_state << 17;
+  return bench_rand_state;
+}
+
+#define BENCH_N_CHROM 4
+
+static void bench_write_value(kstring_t *ks, const char *dtype) {
+  int na = bench_rand() % 10 == 0;
+  if (strcmp(dtype, "int1") == 0) { kputw(bench_rand() & 1, ks); return; }
+  if (strcmp(dtype, "int2") == 0) { kputw(bench_rand() & 3, ks); return; }
+  if (na) kputc('.', ks);
+  else if (strcmp(dtype, "int") == 0 || strcmp(dtype, "int32") == 0) kputw(bench_rand() % 100, ks);
+  else ksprintf(ks, "%.3f", (bench_rand() % 1001) / 1000.0);
+  if (strcmp(dtype, "float.int") == 0) { kputc('\t', ks); kputw(bench_rand() % 60, ks); }
+  if (strcmp(dtype, "float.float") == 0) ksprintf(ks, "\t%.4f", (bench_rand() % 10001) / 10000.0);
+}
+
+/* idx.gz, its tabix index, one bed per sample and a region file */
+static void bench_generate(bench_conf_t *conf, int max_samples) {
+
+  kstring_t fn = {0}, ks = {0};
+  int64_t i, *beg = malloc(sizeof(int64_t) * conf->n_rows);
+  int64_t per_chrom = (conf->n_rows + BENCH_N_CHROM - 1) / BENCH_N_CHROM;
+  for (i=0; i<conf->n_rows; ++i) {
+    if (i % per_chrom == 0) beg[i] = 10000;
+    else beg[i] = beg[i-1] + 2 + bench_rand() % 200;
+  }
+
+  ksprintf(&fn, "%s/idx.gz", conf->dir);
+  BGZF *fp = bgzf_open(fn.s, "w");
+  if (!fp) wzfatal("Cannot write %s.\n", fn.s);
+  for (i=0; i<conf->n_rows; ++i) {
+    ks.l = 0;
+    ksprintf(&ks, "chr%"PRId64"\t%"PRId64"\t%"PRId64"\t%"PRId64"\n", i/per_chrom+1, beg[i], beg[i]+2, i);
+    if (bgzf_write(fp, ks.s, ks.l) < 0) wzfatal("Cannot write %s.\n", fn.s);
+  }
+  bgzf_close(fp);
+  if (tbx_index_build(fn.s, 0, &tbx_conf_bed)) wzfatal("Cannot index %s.\n", fn.s);
+
+  int k;
+  for (k=0; k<max_samples; ++k) {
+    fn.l = 0; ksprintf(&fn, "%s/s%d.bed", conf->dir, k);
+    FILE *out = fopen(fn.s, "w");
+    if (!out) wzfatal("Cannot write %s.\n", fn.s);
+    for (i=0; i<conf->n_rows; ++i) {
+      ks.l = 0;
+      ksprintf(&ks, "chr%"PRId64"\t%"PRId64"\t%"PRId64"\t", i/per_chrom+1, beg[i], beg[i]+2);
+      bench_write_value(&ks, conf->dtype);
+      kputc('\n', &ks);
+      fwrite(ks.s, 1, ks.l, out);
+    }
+    fclose(out);
+  }
+
+  /* view -R wants sorted regions */
+  int64_t *picks = malloc(sizeof(int64_t) * conf->n_regions);
+  for (i=0; i<conf->n_regions; ++i) picks[i] = bench_rand() % conf->n_rows;
+  ks_introsort(bench64, conf->n_regions, picks);
+  fn.l = 0; ksprintf(&fn, "%s/regions.bed", conf->dir);
+  FILE *out = fopen(fn.s, "w");
+  if (!out) wzfatal("Cannot write %s.\n", fn.s);
+  for (i=0; i<conf->n_regions; ++i) {
+    int64_t r = picks[i];
+    fprintf(out, "chr%"PRId64"\t%"PRId64"\t%"PRId64"\n", r/per_chrom+1, beg[r], beg[r] + 1000);
+  }
+  fclose(out);
+  free(picks);
+
+  free(beg); free(fn.s); free(ks.s);
+}
+
+typedef struct bench_result_t {
+  double seconds;
+  long max_rss_kb;
+  int failed;                   /* non-zero exit or killed */
+} bench_result_t;
+
+/* run tbmate with argv, stdout to /dev/null */
+static bench_result_t bench_run(bench_conf_t *conf, char **argv) {
+  struct timespec t0, t1;
+  struct rusage ru;
+  int status;
+  bench_result_t res = {0};
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pid_t pid = fork();
+  if (pid < 0) wzfatal("Cannot fork.\n");
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    execv(conf->exe, argv);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, &ru) < 0) wzfatal("wait4 failed.\n");
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    int i;
+    res.failed = 1; conf->n_failed++;
+    fputs("[bench] command failed:", stderr);
+    for (i=0; argv[i]; ++i) fprintf(stderr, " %s", argv[i]);
+    fputc('\n', stderr);
+  }
+  res.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  res.max_rss_kb = ru.ru_maxrss;
+#ifdef __APPLE__
+  res.max_rss_kb /= 1024;       /* bytes on macOS */
+#endif
+  return res;
+}
+
+/* number of lines tbmate writes to stdout */
+static int64_t bench_count_lines(bench_conf_t *conf, char **argv) {
+  int pfd[2];
+  int64_t n = 0;
+  if (pipe(pfd)) wzfatal("Cannot create pipe.\n");
+  pid_t pid = fork();
+  if (pid < 0) wzfatal("Cannot fork.\n");
+  if (pid == 0) {
+    close(pfd[0]);
+    dup2(pfd[1], STDOUT_FILENO);
+    execv(conf->exe, argv);
+    _exit(127);
+  }
+  close(pfd[1]);
+  char buf[65536]; ssize_t r, i;
+  while ((r = read(pfd[0], buf, sizeof(buf))) > 0)
+    for (i=0; i<r; ++i) n += buf[i] == '\n';
+  close(pfd[0]);
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "[bench] counting rows failed: %s %s\n", argv[0], argv[1]);
+    conf->n_failed++;
+  }
+  return n;
+}
+
+static void bench_report(bench_conf_t *conf, const char *name, int n_samples, int n_threads,
+                         int64_t rows, int64_t cells, int64_t bytes, bench_result_t *res) {
+  double s = res->seconds > 0 ? res->seconds : 1e-9;
+  fprintf(conf->out, "%s\t%s\t%d\t%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%.4f\t%.0f\t%.0f\t%.2f\t%ld\t%s\n",
+          name, conf->dtype, n_samples, n_threads, rows, cells, bytes, res->seconds,
+          rows / s, cells / s, bytes / s / (1<<20), res->max_rss_kb, res->failed ? "failed" : "ok");
+  fflush(conf->out);
+}
+
+/* argv is built from a NULL-terminated list of pieces, tbk names appended */
+static char **bench_argv(const char *cmd, char **opts, char **tbks, int n_tbks) {
+  int n = 0, i;
+  while (opts[n]) n++;
+  char **argv = calloc(n + n_tbks + 3, sizeof(char*));
+  argv[0] = "tbmate"; argv[1] = (char*) cmd;
+  for (i=0; i<n; ++i) argv[i+2] = opts[i];
+  for (i=0; i<n_tbks; ++i) argv[n+2+i] = tbks[i];
+  return argv;
+}
+
+static void bench_case(bench_conf_t *conf, const char *name, const char *cmd, char **opts,
+                       char **tbks, int n_tbks, int n_threads, int64_t rows, int64_t bytes) {
+  char **argv = bench_argv(cmd, opts, tbks, n_tbks);
+  int r;
+  for (r=0; r<conf->repeats; ++r) {
+    bench_result_t res = bench_run(conf, argv);
+    bench_report(conf, name, max(n_tbks, 1), n_threads, rows, rows * max(n_tbks, 1), bytes, &res);
+  }
+  free(argv);
+}
+
+int main_bench(int argc, char *argv[]) {
+
+  bench_conf_t conf = {0};
+  conf.dir = "bench_tmp";
+  conf.exe = "/proc/self/exe";
+  conf.dtype = "ones";
+  conf.n_rows = 1000000;
+  conf.n_regions = 1000;
+  conf.repeats = 1;
+  conf.out = stdout;
+  char *samples = "1,10", *threads = "1,4";
+
+  int c;
+  while ((c = getopt(argc, argv, "d:r:s:t:T:R:n:x:o:h"))>=0) {
+    switch (c) {
+    case 'd': conf.dir = optarg; break;
+    case 'r': conf.n_rows = atol(optarg); break;
+    case 's': samples = optarg; break;
+    case 't': threads = optarg; break;
+    case 'T': conf.dtype = optarg; break;
+    case 'R': conf.n_regions = atoi(optarg); break;
+    case 'n': conf.repeats = atoi(optarg); break;
+    case 'x': conf.exe = optarg; break;
+    case 'o': conf.out = fopen(optarg, "w"); break;
+    case 'h': return usage(); break;
+    default: usage(); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+  if (!conf.out) wzfatal("Cannot open output file.\n");
+  if (conf.n_rows <= 0) wzfatal("Number of rows must be positive.\n");
+  if (access(conf.exe, X_OK)) wzfatal("Cannot execute %s, please set -x.\n", conf.exe);
+  conf.samples = parse_int_list(samples, &conf.n_samples);
+  conf.threads = parse_int_list(threads, &conf.n_threads);
+
+  int i, j, max_samples = 0;
+  for (i=0; i<conf.n_samples; ++i) max_samples = max(max_samples, conf.samples[i]);
+  if (max_samples <= 0) wzfatal("Please give at least one sample count.\n");
+
+  mkdir(conf.dir, 0755);
+  kstring_t fn = {0};
+  ksprintf(&fn, "%s/cohort.txt", conf.dir);
+  char stamp[1024], old[1024] = {0};
+  snprintf(stamp, sizeof(stamp), "rows=%"PRId64" samples=%d dtype=%s regions=%d\n",
+           conf.n_rows, max_samples, conf.dtype, conf.n_regions);
+  FILE *fh = fopen(fn.s, "r");
+  if (fh) { if (!fgets(old, sizeof(old), fh)) old[0] = 0; fclose(fh); }
+  if (strcmp(old, stamp) != 0) {
+    fprintf(stderr, "[%s] generating %"PRId64" rows x %d samples in %s\n", __func__, conf.n_rows, max_samples, conf.dir);
+    bench_generate(&conf, max_samples);
+    fh = fopen(fn.s, "w");
+    if (!fh) wzfatal("Cannot write %s.\n", fn.s);
+    fputs(stamp, fh); fclose(fh);
+  }
+
+  fprintf(conf.out, "case\tdtype\tsamples\tthreads\trows\tcells\tbytes\tseconds\trows_per_s\tcells_per_s\tMB_per_s\tmax_rss_kb\tstatus\n");
+
+  /* pack every sample */
+  char **tbks = calloc(max_samples, sizeof(char*));
+  char **beds = calloc(max_samples, sizeof(char*));
+  fn.l = 0; ksprintf(&fn, "%s/idx.gz", conf.dir);
+  char *idx = strdup(fn.s);
+  for (i=0; i<max_samples; ++i) {
+    fn.l = 0; ksprintf(&fn, "%s/s%d.bed", conf.dir, i); beds[i] = strdup(fn.s);
+    fn.l = 0; ksprintf(&fn, "%s/s%d.tbk", conf.dir, i); tbks[i] = strdup(fn.s);
+    char *opts[] = {"-s", conf.dtype, "-m", idx, beds[i], tbks[i], NULL};
+    bench_case(&conf, "pack", "pack", opts, NULL, 0, 1, conf.n_rows, file_size(beds[i]));
+  }
+  int unit = file_size(tbks[0]) > HDR_TOTALBYTES ?
+    (file_size(tbks[0]) - HDR_TOTALBYTES) / conf.n_rows : 0;
+
+  fn.l = 0; ksprintf(&fn, "%s/regions.bed", conf.dir);
+  char *regions = strdup(fn.s);
+  fn.l = 0; ksprintf(&fn, "%s/bundle.tbk", conf.dir);
+  char *bundle = strdup(fn.s);
+
+  for (i=0; i<conf.n_samples; ++i) {
+    int ns = conf.samples[i];
+    int64_t bytes = (int64_t) unit * conf.n_rows * ns;
+    char *view_opts[] = {"-i", idx, NULL};
+    bench_case(&conf, "view", "view", view_opts, tbks, ns, 1, conf.n_rows, bytes);
+    char *chunk_opts[] = {"-k", "-i", idx, NULL};
+    bench_case(&conf, "view_k", "view", chunk_opts, tbks, ns, 1, conf.n_rows, bytes);
+    char *mem_opts[] = {"--mem", "256M", "-i", idx, NULL};
+    bench_case(&conf, "view_mem", "view", mem_opts, tbks, ns, 1, conf.n_rows, bytes);
+
+    /* the regions cover an unknown number of rows, count them once */
+    char *count_argv[] = {"tbmate", "view", "-i", idx, "-R", regions, tbks[0], NULL};
+    int64_t reg_rows = bench_count_lines(&conf, count_argv);
+    for (j=0; j<conf.n_threads; ++j) {
+      char nt[16]; snprintf(nt, sizeof(nt), "%d", conf.threads[j]);
+      char *reg_opts[] = {"-@", nt, "-i", idx, "-R", regions, NULL};
+      bench_case(&conf, "view_R", "view", reg_opts, tbks, ns, conf.threads[j], reg_rows, (int64_t) unit * reg_rows * ns);
+    }
+    char *reg_k_opts[] = {"-k", "-i", idx, "-R", regions, NULL};
+    bench_case(&conf, "view_R_k", "view", reg_k_opts, tbks, ns, 1, reg_rows, (int64_t) unit * reg_rows * ns);
+
+    for (j=0; j<conf.n_threads; ++j) {
+      char nt[16]; snprintf(nt, sizeof(nt), "%d", conf.threads[j]);
+      char *stats_opts[] = {"-@", nt, NULL};
+      bench_case(&conf, "stats", "stats", stats_opts, tbks, ns, conf.threads[j], conf.n_rows, bytes);
+    }
+
+    char *bundle_opts[] = {bundle, NULL};
+    bench_case(&conf, "bundle", "bundle", bundle_opts, tbks, ns, 1, conf.n_rows, bytes);
+    char *header_opts[] = {NULL};
+    bench_case(&conf, "header", "header", header_opts, tbks, ns, 1, 0, 0);
+  }
+
+  for (i=0; i<max_samples; ++i) { free(tbks[i]); free(beds[i]); }
+  free(tbks); free(beds); free(idx); free(regions); free(bundle); free(fn.s);
+  free(conf.samples); free(conf.threads);
+  if (conf.out != stdout) fclose(conf.out);
+  if (conf.n_failed) {
+    fprintf(stderr, "[%s] %d cases failed.\n", __func__, conf.n_failed);
+    return 1;
+  }
+  return 0;
+}
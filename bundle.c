@@ -76,8 +76,8 @@ int main_bundle(int argc, char *argv[]) {
       strcpy(tbk.extra + strlen(tbk.extra) + 2, tbk.sname);
       tbk_write_hdr(tbk.version, tbk.dtype, tbk.nmax, tbk.extra, out);
     
-      char data; unsigned j;
-      for (j=0; j<tbk.nmax * unit_size(tbk.dtype); ++j) {
+      char data; int64_t j, size = tbk_data_size(&tbk);
+      for (j=0; j<size; ++j) {
         tbf_read(tbk.tbf, &data, 1, 1);
         fwrite(&data, 1, 1, out);
       }
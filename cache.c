@@ -0,0 +1,483 @@
+/* Coordinate-to-offset cache of an index file
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+/* Cache file layout, <idx.gz>.tbc, little-endian, sections 8-byte aligned:
+ *
+ *   4 bytes   "tbc\0"
+ *   4 bytes   version
+ *   8 bytes   size of idx.gz
+ *   8 bytes   mtime of idx.gz
+ *   4 bytes   crc32 of the first and last 64KB of idx.gz
+ *   4 bytes   number of sequences
+ *   8 bytes   number of rows
+ *   8 bytes x CACHE_N_SECTIONS   byte offset of each section
+ *
+ * Sections: sequence names ('\0'-terminated), the first row of each tid
+ * (int64, n_seqs+1), the longest row of each tid (int32), then per row
+ * beg (int32), end (int32) and tbk offset (int64). Rows are in index
+ * order, i.e., sorted by tid then beg, and tid follows the tabix index.
+ * Everything is used in place through mmap, or from memory when the
+ * file cannot be written.
+ *
+ * The name index, <idx.gz>.tbn, maps a name column of the index (e.g.,
+ * probe IDs) to rows. It has the same stamp and 8-byte alignment:
+ *
+ *   4 bytes   "tbn\0"
+ *   4 bytes   version
+ *   8 bytes   size of idx.gz
+ *   8 bytes   mtime of idx.gz
+ *   4 bytes   crc32 of the first and last 64KB of idx.gz
+ *   4 bytes   name column, 1-based
+ *   8 bytes   number of rows
+ *   8 bytes   number of hash buckets, a power of 2
+ *   8 bytes x NAMES_N_SECTIONS   byte offset of each section
+ *
+ * Sections: a string pool holding the name of each row ('\0'-terminated,
+ * one after the other), the pool position (int64), tbk offset (int64) and
+ * BGZF virtual offset of the line in idx.gz (int64) of each row, and the
+ * open-addressing hash table (uint32, row+1, 0 if empty, linear probing
+ * on FNV-1a). The index text itself is read back from idx.gz. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "wzio.h"
+#include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/kstring.h"
+#include "htslib/htslib/kseq.h"
+
+#define CACHE_VERSION 1
+#define CACHE_HDR_BYTES 40
+#define CACHE_CRC_SPAN 65536
+
+#define NAMES_VERSION 2
+#define NAMES_HDR_BYTES 48
+
+enum { SEC_SEQNAMES, SEC_SEQ_BEG, SEC_MAXLEN, SEC_BEG, SEC_END, SEC_OFF, CACHE_N_SECTIONS };
+enum { SEC_POOL, SEC_ENTRY, SEC_NAME_OFF, SEC_VOFF, SEC_BUCKETS, NAMES_N_SECTIONS };
+
+typedef struct cache_stamp_t {
+  int64_t size;
+  int64_t mtime;
+  uint32_t crc;
+} cache_stamp_t;
+
+static int cache_stamp(const char *idx_fname, cache_stamp_t *st) {
+  struct stat s;
+  if (stat(idx_fname, &s)) return -1;
+  st->size = s.st_size;
+  st->mtime = s.st_mtime;
+
+  FILE *fh = fopen(idx_fname, "rb");
+  if (!fh) return -1;
+  unsigned char *buf = malloc(CACHE_CRC_SPAN);
+  size_t n = fread(buf, 1, CACHE_CRC_SPAN, fh);
+  uLong crc = crc32(0L, buf, n);
+  if (st->size > CACHE_CRC_SPAN) {
+    fseek(fh, max(CACHE_CRC_SPAN, st->size - CACHE_CRC_SPAN), SEEK_SET);
+    n = fread(buf, 1, CACHE_CRC_SPAN, fh);
+    crc = crc32(crc, buf, n);
+  }
+  free(buf); fclose(fh);
+  st->crc = crc;
+  return 0;
+}
+
+static char *cache_fname(const char *idx_fname, const char *suffix) {
+  char *s = malloc(strlen(idx_fname) + strlen(suffix) + 1);
+  strcpy(s, idx_fname); strcat(s, suffix);
+  return s;
+}
+
+static void kput_padded(const void *p, size_t n, kstring_t *ks) {
+  static const char zeros[8] = {0};
+  if (n) kputsn(p, n, ks);
+  if (ks->l % 8) kputsn(zeros, 8 - ks->l % 8, ks);
+}
+
+/* mmap fname whole, NULL if it is missing or empty */
+static char *cache_mmap(const char *fname, size_t *size) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat s;
+  char *map = NULL;
+  if (fstat(fd, &s) == 0 && s.st_size > 0) {
+    map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) map = NULL;
+    else *size = s.st_size;
+  }
+  close(fd);
+  return map;
+}
+
+/* write to a temporary file and rename, so readers never see a partial file */
+static int cache_write(const char *fname, const char *data, size_t size) {
+  char *tmp = malloc(strlen(fname) + 16);
+  sprintf(tmp, "%s.%d", fname, (int) getpid());
+  FILE *fh = fopen(tmp, "wb");
+  int ret = 0;
+  if (!fh || fwrite(data, 1, size, fh) != size || fclose(fh) || rename(tmp, fname)) {
+    if (fh) unlink(tmp);
+    ret = -1;
+  }
+  free(tmp);
+  return ret;
+}
+
+/* one sequential pass over idx.gz, the image is returned in *data */
+static int tbk_cache_build(const char *idx_fname, tbx_t *tbx, cache_stamp_t *stamp, char **data, size_t *size) {
+
+  htsFile *fp = hts_open(idx_fname, "r");
+  if (!fp) return -1;
+
+  int nseq, prev_tid = -1, tid;
+  const char **seqs = tbx_seqnames(tbx, &nseq);
+  int64_t *seq_beg = calloc(nseq + 1, sizeof(int64_t));
+  int32_t *maxlen = calloc(nseq, sizeof(int32_t));
+  int64_t n = 0, m = 1<<16;
+  int32_t *beg = malloc(sizeof(int32_t) * m), *end = malloc(sizeof(int32_t) * m);
+  int64_t *off = malloc(sizeof(int64_t) * m);
+
+  kstring_t str = {0,0,0};
+  char **fields = NULL; int nfields = -1; char *aux = NULL;
+  while (hts_getline(fp, KS_SEP_LINE, &str) >= 0) {
+    if (!str.l || str.s[0] == '#') continue;
+    line_get_fields2(str.s, "\t", &fields, &nfields, &aux);
+    if (nfields < 4) wzfatal("[%s] %s has fewer than 4 columns.\n", __func__, idx_fname);
+    tid = tbx_name2id(tbx, fields[0]);
+    if (tid < prev_tid || tid < 0) wzfatal("[%s] %s is not sorted as its index.\n", __func__, idx_fname);
+    for (; prev_tid < tid; ++prev_tid) seq_beg[prev_tid+1] = n;
+    if (n == m) {
+      m <<= 1;
+      beg = realloc(beg, sizeof(int32_t) * m);
+      end = realloc(end, sizeof(int32_t) * m);
+      off = realloc(off, sizeof(int64_t) * m);
+    }
+    ensure_number2(fields[3]);
+    beg[n] = atol(fields[1]);
+    end[n] = atol(fields[2]);
+    off[n] = atol(fields[3]);
+    if (end[n] - beg[n] > maxlen[tid]) maxlen[tid] = end[n] - beg[n];
+    n++;
+  }
+  for (; prev_tid < nseq; ++prev_tid) seq_beg[prev_tid+1] = n;
+  free_fields(fields, nfields); free(aux); free(str.s);
+  hts_close(fp);
+
+  int64_t sec[CACHE_N_SECTIONS];
+  int32_t version = CACHE_VERSION, n_seqs = nseq;
+  int i;
+  kstring_t img = {0,0,0};
+  ks_resize(&img, CACHE_HDR_BYTES + sizeof(sec) + 16 * n + 12 * nseq + 64);
+  kputsn("tbc", 4, &img);
+  kputsn((char*) &version, 4, &img);
+  kputsn((char*) &stamp->size, 8, &img);
+  kputsn((char*) &stamp->mtime, 8, &img);
+  kputsn((char*) &stamp->crc, 4, &img);
+  kputsn((char*) &n_seqs, 4, &img);
+  kputsn((char*) &n, 8, &img);
+  kputsn((char*) sec, sizeof(sec), &img);     /* filled below */
+  sec[SEC_SEQNAMES] = img.l;
+  for (i=0; i<nseq; ++i) kputsn(seqs[i], strlen(seqs[i]) + 1, &img);
+  kput_padded(NULL, 0, &img);         /* pads the names */
+  sec[SEC_SEQ_BEG] = img.l; kput_padded(seq_beg, sizeof(int64_t) * (nseq+1), &img);
+  sec[SEC_MAXLEN] = img.l;  kput_padded(maxlen, sizeof(int32_t) * nseq, &img);
+  sec[SEC_BEG] = img.l;     kput_padded(beg, sizeof(int32_t) * n, &img);
+  sec[SEC_END] = img.l;     kput_padded(end, sizeof(int32_t) * n, &img);
+  sec[SEC_OFF] = img.l;     kput_padded(off, sizeof(int64_t) * n, &img);
+  memcpy(img.s + CACHE_HDR_BYTES, sec, sizeof(sec));
+
+  free(seqs); free(seq_beg); free(maxlen); free(beg); free(end); free(off);
+  *data = img.s; *size = img.l;
+  return 0;
+}
+
+/* point the sections into the file image, NULL unless it matches the stamp */
+static tbk_cache_t *tbk_cache_attach(char *data, size_t size, cache_stamp_t *stamp) {
+
+  if (size < CACHE_HDR_BYTES + 8 * CACHE_N_SECTIONS) return NULL;
+  int32_t version, n_seqs; int64_t fsize, mtime, n_rows; uint32_t crc;
+  memcpy(&version, data+4, 4);
+  memcpy(&fsize, data+8, 8);
+  memcpy(&mtime, data+16, 8);
+  memcpy(&crc, data+24, 4);
+  memcpy(&n_seqs, data+28, 4);
+  memcpy(&n_rows, data+32, 8);
+  if (memcmp(data, "tbc", 4) || version != CACHE_VERSION || fsize != stamp->size ||
+      mtime != stamp->mtime || crc != stamp->crc) return NULL;
+
+  int64_t sec[CACHE_N_SECTIONS];
+  memcpy(sec, data + CACHE_HDR_BYTES, sizeof(sec));
+  tbk_cache_t *c = calloc(1, sizeof(tbk_cache_t));
+  c->map = data; c->map_size = size;
+  c->n_seqs = n_seqs; c->n_rows = n_rows;
+  c->seqnames = malloc(sizeof(char*) * max(n_seqs, 1));
+  char *p = data + sec[SEC_SEQNAMES];
+  int i;
+  for (i=0; i<n_seqs; ++i) { c->seqnames[i] = p; p += strlen(p) + 1; }
+  c->seq_beg = (int64_t*) (data + sec[SEC_SEQ_BEG]);
+  c->maxlen = (int32_t*) (data + sec[SEC_MAXLEN]);
+  c->beg = (int32_t*) (data + sec[SEC_BEG]);
+  c->end = (int32_t*) (data + sec[SEC_END]);
+  c->off = (int64_t*) (data + sec[SEC_OFF]);
+  return c;
+}
+
+/* Open the cache of idx_fname if it matches the file. With build set, a
+   missing or stale cache is (re)built first, and when it cannot be
+   written the cache built in memory is used for this run. NULL if there
+   is none. */
+tbk_cache_t *tbk_cache_open(const char *idx_fname, tbx_t *tbx, int build) {
+
+  cache_stamp_t stamp;
+  if (cache_stamp(idx_fname, &stamp)) return NULL;
+  char *fname = cache_fname(idx_fname, ".tbc");
+  tbk_cache_t *c = NULL;
+
+  size_t size;
+  char *data = cache_mmap(fname, &size);
+  if (data) {
+    c = tbk_cache_attach(data, size, &stamp);
+    if (c) c->mapped = 1;
+    else munmap(data, size);
+  }
+
+  if (!c && build && tbk_cache_build(idx_fname, tbx, &stamp, &data, &size) == 0) {
+    if (cache_write(fname, data, size))
+      fprintf(stderr, "[%s] Warning: cannot write %s, the cache is not kept.\n", __func__, fname);
+    c = tbk_cache_attach(data, size, &stamp);
+  }
+  free(fname);
+  return c;
+}
+
+void tbk_cache_close(tbk_cache_t *c) {
+  if (!c) return;
+  if (c->mapped) munmap(c->map, c->map_size);
+  else free(c->map);
+  free(c->seqnames);
+  free(c);
+}
+
+/* rows [*lo, *hi) may overlap the region, check with tbk_cache_overlap */
+void tbk_cache_range(tbk_cache_t *c, tbk_region_t *r, int64_t *lo, int64_t *hi) {
+  if (r->tid == HTS_IDX_START) { *lo = 0; *hi = c->n_rows; return; }
+  if (r->tid < 0 || r->tid >= c->n_seqs) { *lo = *hi = 0; return; }
+
+  int64_t a = c->seq_beg[r->tid], b = c->seq_beg[r->tid+1];
+  int64_t from = (int64_t) r->beg - c->maxlen[r->tid] - 1, x, y, mid;
+  for (x = a, y = b; x < y; ) {       /* first row with beg >= from */
+    mid = x + (y - x) / 2;
+    if (c->beg[mid] < from) x = mid + 1; else y = mid;
+  }
+  *lo = x;
+  for (y = b; x < y; ) {              /* first row with beg >= region end */
+    mid = x + (y - x) / 2;
+    if (c->beg[mid] < r->end) x = mid + 1; else y = mid;
+  }
+  *hi = x;
+}
+
+/* tid of a row */
+int tbk_cache_tid(tbk_cache_t *c, int64_t row) {
+  int x = 0, y = c->n_seqs, mid;
+  while (x < y) {               /* first tid starting after row */
+    mid = x + (y - x) / 2;
+    if (c->seq_beg[mid+1] <= row) x = mid + 1; else y = mid;
+  }
+  return x;
+}
+
+/* tbk offset of the row from beg to end on tid. -1 if no row starts at
+   beg, -2 if rows start there but none ends at end. */
+int64_t tbk_cache_find(tbk_cache_t *c, int tid, int32_t beg, int32_t end) {
+  if (tid < 0 || tid >= c->n_seqs) return -1;
+  int64_t x = c->seq_beg[tid], y = c->seq_beg[tid+1], mid, i;
+  while (x < y) {
+    mid = x + (y - x) / 2;
+    if (c->beg[mid] < beg) x = mid + 1; else y = mid;
+  }
+  if (x == c->seq_beg[tid+1] || c->beg[x] != beg) return -1;
+  for (i = x; i < c->seq_beg[tid+1] && c->beg[i] == beg; ++i)
+    if (c->end[i] == end) return c->off[i];
+  return -2;
+}
+
+static inline uint64_t names_hash(const char *s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s; ++s) { h ^= (unsigned char) *s; h *= 1099511628211ULL; }
+  return h;
+}
+
+static int64_t names_lookup(const char *pool, const int64_t *entry,
+                            const uint32_t *buckets, uint64_t n_buckets, const char *name) {
+  uint64_t b = names_hash(name) & (n_buckets - 1);
+  for (; buckets[b]; b = (b + 1) & (n_buckets - 1))
+    if (strcmp(pool + entry[buckets[b]-1], name) == 0) return buckets[b] - 1;
+  return -1;
+}
+
+/* point the sections into the file image, NULL unless it matches the
+   stamp and names come from name_col */
+static tbk_names_t *tbk_names_attach(char *data, size_t size, cache_stamp_t *stamp, int name_col) {
+  if (size < NAMES_HDR_BYTES + 8 * NAMES_N_SECTIONS) return NULL;
+  int32_t version, col; int64_t fsize, mtime, n_rows; uint64_t n_buckets; uint32_t crc;
+  memcpy(&version, data+4, 4);
+  memcpy(&fsize, data+8, 8);
+  memcpy(&mtime, data+16, 8);
+  memcpy(&crc, data+24, 4);
+  memcpy(&col, data+28, 4);
+  memcpy(&n_rows, data+32, 8);
+  memcpy(&n_buckets, data+40, 8);
+  if (memcmp(data, "tbn", 4) || version != NAMES_VERSION || fsize != stamp->size ||
+      mtime != stamp->mtime || crc != stamp->crc || col != name_col) return NULL;
+
+  int64_t sec[NAMES_N_SECTIONS];
+  memcpy(sec, data + NAMES_HDR_BYTES, sizeof(sec));
+  tbk_names_t *nm = calloc(1, sizeof(tbk_names_t));
+  nm->data = data; nm->size = size;
+  nm->name_col = name_col; nm->n_rows = n_rows; nm->n_buckets = n_buckets;
+  nm->pool = data + sec[SEC_POOL];
+  nm->entry = (int64_t*) (data + sec[SEC_ENTRY]);
+  nm->off = (int64_t*) (data + sec[SEC_NAME_OFF]);
+  nm->voff = (int64_t*) (data + sec[SEC_VOFF]);
+  nm->buckets = (uint32_t*) (data + sec[SEC_BUCKETS]);
+  return nm;
+}
+
+/* one sequential pass over idx.gz, the image is returned in *data */
+static int tbk_names_build(const char *idx_fname, int32_t name_col, cache_stamp_t *stamp,
+                           char **data, size_t *size) {
+
+  BGZF *fp = bgzf_open(idx_fname, "r");
+  if (!fp) return -1;
+
+  int64_t n = 0, m = 1<<16, v = bgzf_tell(fp);
+  int64_t *entry = malloc(sizeof(int64_t) * m), *off = malloc(sizeof(int64_t) * m);
+  int64_t *voff = malloc(sizeof(int64_t) * m);
+  kstring_t pool = {0,0,0}, str = {0,0,0};
+  char **fields = NULL; int nfields = -1; char *aux = NULL;
+  for (; bgzf_getline(fp, '\n', &str) >= 0; v = bgzf_tell(fp)) {
+    if (!str.l || str.s[0] == '#') continue;
+    line_get_fields2(str.s, "\t", &fields, &nfields, &aux);
+    if (nfields < 4) wzfatal("[%s] %s has fewer than 4 columns.\n", __func__, idx_fname);
+    if (nfields < name_col)
+      wzfatal("[%s] %s has no column %d to take names from.\n", __func__, idx_fname, name_col);
+    if (n == m) {
+      m <<= 1;
+      entry = realloc(entry, sizeof(int64_t) * m);
+      off = realloc(off, sizeof(int64_t) * m);
+      voff = realloc(voff, sizeof(int64_t) * m);
+    }
+    ensure_number2(fields[3]);
+    off[n] = atol(fields[3]);
+    voff[n] = v;
+    entry[n] = pool.l;
+    kputs(fields[name_col-1], &pool); kputc('\0', &pool);
+    n++;
+  }
+  free_fields(fields, nfields); free(aux); free(str.s);
+  bgzf_close(fp);
+  if (n >= UINT32_MAX) wzfatal("[%s] %s has too many rows to index.\n", __func__, idx_fname);
+
+  uint64_t n_buckets = 16, b;
+  while (n_buckets < (uint64_t) n * 2) n_buckets <<= 1;
+  uint32_t *buckets = calloc(n_buckets, sizeof(uint32_t));
+  int64_t i;
+  for (i=0; i<n; ++i) {         /* the first row of a duplicated name wins */
+    if (names_lookup(pool.s, entry, buckets, n_buckets, pool.s + entry[i]) >= 0) continue;
+    for (b = names_hash(pool.s + entry[i]) & (n_buckets-1); buckets[b]; b = (b+1) & (n_buckets-1));
+    buckets[b] = i + 1;
+  }
+
+  int64_t sec[NAMES_N_SECTIONS];
+  int32_t version = NAMES_VERSION;
+  kstring_t img = {0,0,0};
+  ks_resize(&img, NAMES_HDR_BYTES + sizeof(sec) + pool.l + 24 * n + 4 * n_buckets + 32);
+  kputsn("tbn", 4, &img);
+  kputsn((char*) &version, 4, &img);
+  kputsn((char*) &stamp->size, 8, &img);
+  kputsn((char*) &stamp->mtime, 8, &img);
+  kputsn((char*) &stamp->crc, 4, &img);
+  kputsn((char*) &name_col, 4, &img);
+  kputsn((char*) &n, 8, &img);
+  kputsn((char*) &n_buckets, 8, &img);
+  kputsn((char*) sec, sizeof(sec), &img);     /* filled below */
+  sec[SEC_POOL] = img.l;     kput_padded(pool.s, pool.l, &img);
+  sec[SEC_ENTRY] = img.l;    kput_padded(entry, sizeof(int64_t) * n, &img);
+  sec[SEC_NAME_OFF] = img.l; kput_padded(off, sizeof(int64_t) * n, &img);
+  sec[SEC_VOFF] = img.l;     kput_padded(voff, sizeof(int64_t) * n, &img);
+  sec[SEC_BUCKETS] = img.l;  kput_padded(buckets, sizeof(uint32_t) * n_buckets, &img);
+  memcpy(img.s + NAMES_HDR_BYTES, sec, sizeof(sec));
+
+  free(pool.s); free(entry); free(off); free(voff); free(buckets);
+  *data = img.s; *size = img.l;
+  return 0;
+}
+
+/* Open the index of the names in column name_col (1-based) of
+   idx_fname, building <idx.gz>.tbn if it is missing, stale or of
+   another column. When it cannot be written, the index built in memory
+   is used for this run. NULL if idx_fname cannot be read. */
+tbk_names_t *tbk_names_open(const char *idx_fname, int name_col) {
+
+  cache_stamp_t stamp;
+  if (cache_stamp(idx_fname, &stamp)) return NULL;
+  char *fname = cache_fname(idx_fname, ".tbn");
+  tbk_names_t *nm = NULL;
+
+  size_t size;
+  char *data = cache_mmap(fname, &size);
+  if (data) {
+    nm = tbk_names_attach(data, size, &stamp, name_col);
+    if (nm) nm->mapped = 1;
+    else munmap(data, size);
+  }
+
+  if (!nm && tbk_names_build(idx_fname, name_col, &stamp, &data, &size) == 0) {
+    if (cache_write(fname, data, size))
+      fprintf(stderr, "[%s] Warning: cannot write %s, the name index is not kept.\n", __func__, fname);
+    nm = tbk_names_attach(data, size, &stamp, name_col);
+  }
+  free(fname);
+  return nm;
+}
+
+void tbk_names_close(tbk_names_t *nm) {
+  if (!nm) return;
+  if (nm->mapped) munmap(nm->data, nm->size);
+  else free(nm->data);
+  free(nm);
+}
+
+/* row of the name, -1 if absent */
+int64_t tbk_names_get(tbk_names_t *nm, const char *name) {
+  return names_lookup(nm->pool, nm->entry, nm->buckets, nm->n_buckets, name);
+}
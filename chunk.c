@@ -34,6 +34,11 @@
 #include "htslib/htslib/hts.h"
 #include "htslib/htslib/regidx.h"
 #include "htslib/htslib/kstring.h"
+#include "htslib/htslib/ksort.h"
+
+typedef struct pair64_t { int64_t u, v; } pair64_t;
+#define pair64_lt(a, b) ((a).u < (b).u || ((a).u == (b).u && (a).v < (b).v))
+KSORT_INIT(pair64, pair64_t, pair64_lt)
 
 static void error(const char *format, ...) {
   va_list ap;
@@ -90,6 +95,18 @@ void tbk_print1(tbk_data_t *d, int i, view_conf_t *conf, kstring_t *ks) {
     else ksprintf(ks, "\t%.*f", conf->precision, data);
     break;
   }
+  case DT_BETA8: {
+    float data = ((float*) (d->data))[i];
+    if (data != data) { kputc('\t', ks); kputs(conf->na_token, ks); }
+    else ksprintf(ks, "\t%.*f", conf->precision, data);
+    break;
+  }
+  case DT_HALF: {
+    float data = ((float*) (d->data))[i];
+    if (conf->na_for_negative && data < 0) { kputc('\t', ks); kputs(conf->na_token, ks); }
+    else ksprintf(ks, "\t%f", data);
+    break;
+  }
   case DT_FLOAT_INT: {
     float data = ((float*) (d->data))[i*2];
     int data2 = ((int32_t*) (d->data))[i*2+1];
@@ -124,6 +141,91 @@ void tbk_print1(tbk_data_t *d, int i, view_conf_t *conf, kstring_t *ks) {
   }
 }
 
+/* unpacking tables, byte -> one byte per unit in the order of the units,
+   assuming a little-endian host like the rest of the format */
+#define INT1_SPREAD(b) ((uint64_t) ((b)&1)                   | \
+                        (uint64_t) ((b)>>1&1) << 8  | (uint64_t) ((b)>>2&1) << 16 | \
+                        (uint64_t) ((b)>>3&1) << 24 | (uint64_t) ((b)>>4&1) << 32 | \
+                        (uint64_t) ((b)>>5&1) << 40 | (uint64_t) ((b)>>6&1) << 48 | \
+                        (uint64_t) ((b)>>7&1) << 56)
+#define INT2_SPREAD(b) ((uint32_t) ((b)&3)         | (uint32_t) ((b)>>2&3) << 8 | \
+                        (uint32_t) ((b)>>4&3) << 16 | (uint32_t) ((b)>>6&3) << 24)
+#define LUT4(f, b)   f(b), f((b)+1), f((b)+2), f((b)+3)
+#define LUT16(f, b)  LUT4(f, b), LUT4(f, (b)+4), LUT4(f, (b)+8), LUT4(f, (b)+12)
+#define LUT64(f, b)  LUT16(f, b), LUT16(f, (b)+16), LUT16(f, (b)+32), LUT16(f, (b)+48)
+#define LUT256(f)    LUT64(f, 0), LUT64(f, 64), LUT64(f, 128), LUT64(f, 192)
+static const uint64_t int1_lut[256] = { LUT256(INT1_SPREAD) };
+static const uint32_t int2_lut[256] = { LUT256(INT2_SPREAD) };
+
+/* n fixed-width units in raw to the entries of data, as read below */
+void tbk_decode_n(const uint8_t *raw, int n, tbk_data_t *data) {
+  int us = unit_size(data->dtype);
+  switch(DATA_TYPE(data->dtype)) {
+  case DT_ONES: {
+    data->data = realloc(data->data, sizeof(float)*n);
+    int ii; uint16_t d;
+    for (ii=0; ii<n; ++ii) {
+      memcpy(&d, raw + ii*2, 2);
+      ((float*)data->data)[ii] = uint16_to_float(d);
+    }
+    break;
+  }
+  case DT_BETA8:
+    data->data = realloc(data->data, sizeof(float)*n);
+    beta8_to_float_n(raw, data->data, n);
+    break;
+  case DT_HALF:
+    data->data = realloc(data->data, sizeof(float)*n);
+    half_to_float_n((const uint16_t*) raw, data->data, n);
+    break;
+  default:
+    data->data = realloc(data->data, (size_t) us*n);
+    memcpy(data->data, raw, (size_t) us*n);
+  }
+}
+
+/* the present units of the chunk are one contiguous read, located by
+   rank, absent rows get the fill unit */
+static void tbk_query_n_sparse(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
+  tbk_sparse_t *sp = tbk->sparse;
+  int us = unit_size(tbk->dtype);
+  int64_t r0 = tbk_sparse_count(sp, chunk_beg);
+  int64_t np = tbk_sparse_count(sp, chunk_beg + n) - r0, i, k = 0;
+  uint8_t *vals = malloc(max(np, 1) * us), *raw = malloc((size_t) n * us);
+  if (np > 0) {
+    tbk_seek_offset(tbk, sp->values + r0 * us);
+    tbf_read(tbk->tbf, vals, us, np);
+  }
+  for (i=0; i<n; ++i) {
+    if (k < np && tbk_sparse_present(sp, chunk_beg + i))
+      memcpy(raw + i*us, vals + (k++)*us, us);
+    else
+      memcpy(raw + i*us, sp->fill, us);
+  }
+  int p = prof_enter(PROF_DECODE);
+  tbk_decode_n(raw, n, data);
+  prof_leave(p);
+  free(vals); free(raw);
+}
+
+/* first values are read from the file, second values from the map into
+   the interleaved pairs, or left 0 under skip_second */
+static void tbk_query_n_split(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
+  uint32_t *first = malloc(4*n);
+  tbk_seek_offset(tbk, chunk_beg*4);
+  tbf_read(tbk->tbf, first, 4, n);
+  data->data = realloc(data->data, 8*n);
+  uint32_t *out = data->data;
+  int i, p = prof_enter(PROF_DECODE);
+  for (i=0; i<n; ++i) {
+    out[i*2] = first[i];
+    if (tbk->skip_second) out[i*2+1] = 0;
+    else tbk_split_second(tbk->split, chunk_beg + i, &out[i*2+1]);
+  }
+  prof_leave(p);
+  free(first);
+}
+
 void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
   if (chunk_beg >= tbk->nmax) {wzfatal("Error: query %d out of range. Wrong idx file?", chunk_beg);}
   if (chunk_beg + n >= tbk->nmax) {
@@ -133,36 +235,27 @@ void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
   
   data->n = n;
   data->dtype = tbk->dtype;
+  if (tbk->sparse) { tbk_query_n_sparse(tbk, chunk_beg, n, data); return; }
+  if (tbk->split) { tbk_query_n_split(tbk, chunk_beg, n, data); return; }
 
   switch(DATA_TYPE(tbk->dtype)) {
-  /* case DT_INT1: { */
-  /*   tbk->offset = offset/8;                           /\* always seek *\/ */
-  /*   if(fseek(tbk->fh, offset/8+HDR_TOTALBYTES, SEEK_SET)) wzfatal("File %s cannot be seeked.\n", tbk->fname); */
-    
-  /*   int nb = (offset + n) / 8 - offset / 8 + 1; */
-  /*   uint8_t *tmp = calloc(nb, 1); */
-  /*   fread(tmp, 1, nb, tbk->fh); tbk->offset += n; */
-  /*   data->data = realloc(data->data, n); */
-  /*   int i; */
-  /*   for (i=0; i<n; ++i) { */
-  /*     ((uint8_t*)data->data)[i] = (tmp[(offset+i)/8 - offset/8] >> (offset+i)%8) & 0x1; */
-  /*   } */
-  /*   break; */
-  /* } */
-  /* case DT_INT2: { */
-  /*   tbk->offset = offset/4;                           /\* always seek *\/ */
-  /*   if(fseek(tbk->fh, offset/4+HDR_TOTALBYTES, SEEK_SET)) wzfatal("File %s cannot be seeked.\n", tbk->fname); */
-    
-  /*   int nb = (offset + n) / 4 - offset / 4; */
-  /*   uint8_t *tmp = calloc(nb, 1); */
-  /*   fread(tmp, 1, nb, tbk->fh); tbk->offset += n; */
-  /*   data->data = realloc(data->data, n); */
-  /*   int i; */
-  /*   for (i=0; i<n; ++i) { */
-  /*     ((uint8_t*)data->data)[i] = (tmp[(offset+i)/4 - offset/4] >> (((offset+i)%4)*2)) & 0x3; */
-  /*   } */
-  /*   break; */
-  /* } */
+  case DT_INT1: case DT_INT2: {
+    /* whole bytes are unpacked through the tables, then the units before
+       chunk_beg in the first byte are dropped */
+    int per = DATA_TYPE(tbk->dtype) == DT_INT1 ? 8 : 4;
+    int64_t b0 = chunk_beg / per, nb = (chunk_beg + n - 1) / per - b0 + 1, j;
+    int skip = chunk_beg - b0 * per;
+    uint8_t *tmp = malloc(nb);
+    tbk_seek_n(tbk, chunk_beg);
+    tbf_read(tbk->tbf, tmp, 1, nb);
+    data->data = realloc(data->data, nb * per);
+    uint8_t *out = data->data;
+    if (per == 8) for (j=0; j<nb; ++j) memcpy(out + j*8, &int1_lut[tmp[j]], 8);
+    else for (j=0; j<nb; ++j) memcpy(out + j*4, &int2_lut[tmp[j]], 4);
+    if (skip) memmove(out, out + skip, n);
+    free(tmp);
+    break;
+  }
   case DT_INT32: {
     tbk_seek_n(tbk, chunk_beg);
     data->data = realloc(data->data, 4*n);
@@ -211,7 +304,7 @@ void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
   }
   case DT_ONES: {
     tbk_seek_n(tbk, chunk_beg);
-    data->data = realloc(data->data, 2*n);
+    data->data = realloc(data->data, sizeof(float)*n);
     uint16_t *tmp = calloc(n, 2);
     tbf_read(tbk->tbf, tmp, 2, n);
     int ii;
@@ -219,6 +312,24 @@ void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
     free(tmp);
     break;
   }
+  case DT_BETA8: {
+    tbk_seek_n(tbk, chunk_beg);
+    data->data = realloc(data->data, sizeof(float)*n);
+    uint8_t *tmp = malloc(n);
+    tbf_read(tbk->tbf, tmp, 1, n);
+    beta8_to_float_n(tmp, data->data, n);
+    free(tmp);
+    break;
+  }
+  case DT_HALF: {
+    tbk_seek_n(tbk, chunk_beg);
+    data->data = realloc(data->data, sizeof(float)*n);
+    uint16_t *tmp = malloc(2*n);
+    tbf_read(tbk->tbf, tmp, 2, n);
+    half_to_float_n(tmp, data->data, n);
+    free(tmp);
+    break;
+  }
   case DT_FLOAT_INT: {
     tbk_seek_n(tbk, chunk_beg);
     data->data = realloc(data->data, 8*n);
@@ -235,129 +346,304 @@ void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data) {
   }
 }
 
-/* process one chunk */
-static void query_one_chunk(int *offsets, int n_offsets, tbk_t *tbks, int n_tbks, view_conf_t *conf, kstring_t *ks_out, FILE*out_fh) {
+/* size of one decoded entry in tbk_data_t */
+static int tbk_data_unit(uint64_t dtype) {
+  switch(DATA_TYPE(dtype)) {
+  case DT_ONES: case DT_BETA8: case DT_HALF: return sizeof(float);
+  case DT_STRINGD: return sizeof(char*);
+  case DT_STRINGF: return STRING_MAX(dtype);
+  default: return unit_size(dtype);
+  }
+}
+
+/* Rows of one index chunk. The index text of all rows lives in one
+   buffer, and the values are decoded sample by sample into a columnar
+   buffer (samples x rows) before the rows are formatted in one pass. */
+typedef struct chunk_rows_t {
+  int n, m;
+  int64_t *offsets;             /* tbk offset of each row */
+  pair64_t *order;              /* (offset, row) sorted by offset */
+  size_t *pfx;                  /* start of each row in text */
+  kstring_t text;               /* seqname, start, end [, other columns] */
+  uint8_t *keep;                /* rows passing --where */
+  tbk_data_t *cols;             /* one per sample, n entries each */
+  kstring_t out;                /* formatted output */
+} chunk_rows_t;
 
-  if (n_offsets == 0) return;
-  
+/* bytes per index row, used to size the chunk from a memory budget */
+static int64_t chunk_row_bytes(tbk_t *tbks, int n_tbks) {
+  int64_t b = sizeof(int64_t) + sizeof(pair64_t) + sizeof(size_t) + 64; /* 64 for index text */
   int k;
-  tbk_data_t data = {0};
-  for(k=0; k<n_tbks; ++k) {     /* iterate through samples */
-    int chunk_beg = 0;
-    for (chunk_beg = 0; chunk_beg < tbks[k].nmax; chunk_beg += conf->n_chunk_data) { /* iterate data chunk */
-      int chunk_end = (chunk_beg + conf->n_chunk_data > tbks[k].nmax) ? tbks[k].nmax : (chunk_beg + conf->n_chunk_data);
-      tbk_query_n(&tbks[k], chunk_beg, conf->n_chunk_data, &data);
-      if (chunk_end - chunk_beg != data.n) {
-        wzfatal("Unequal number of records read %d, expecting %d\n", data.n, chunk_end-chunk_beg);
-      }
+  for (k=0; k<n_tbks; ++k) b += tbk_data_unit(tbks[k].dtype);
+  return b;
+}
 
-      /* save to output */
-      int i;
-      for(i=0; i<n_offsets; ++i) {
-        if (offsets[i] >= chunk_beg && offsets[i] < chunk_end) {
-          tbk_print1(&data, offsets[i]-chunk_beg, conf, &ks_out[i]);
-        }
-      }
+/* Choose between random access (query_regions) and chunk reading, and
+   size the chunks from the memory budget, the number of samples, their
+   unit sizes and the number of queried rows. Random access wins when few
+   cells are queried or the rows are so sparse in the tbk that a chunk
+   read would mostly fetch unused data. Sizes set on the command line are
+   kept. */
+#define PLAN_MIN_CELLS   100000
+#define PLAN_MIN_DENSITY (1.0/256)
+#define PLAN_MIN_CHUNK_DATA (1<<12)
+#define PLAN_MAX_CHUNK_DATA (1<<24)
+void view_plan(tbk_t *tbks, int n_tbks, int64_t n_rows, view_conf_t *conf,
+               int chunk_read_set, int n_chunk_index_set, int n_chunk_data_set) {
+
+  int64_t nmax = 1; int max_unit = 1; int k;
+  for (k=0; k<n_tbks; ++k) {
+    nmax = max(nmax, tbks[k].nmax);
+    max_unit = max(max_unit, tbk_data_unit(tbks[k].dtype));
+  }
+  double density = (double) n_rows / nmax;
+  int64_t cells = n_rows * n_tbks;
+
+  if (!chunk_read_set)
+    conf->chunk_read = (cells >= PLAN_MIN_CELLS && density >= PLAN_MIN_DENSITY);
+
+  /* one eighth of the budget goes to the data chunk of one sample and
+     at most another eighth to the output buffer */
+  int64_t row_bytes = chunk_row_bytes(tbks, n_tbks);
+  if (!n_chunk_data_set) {
+    int64_t n = conf->mem_budget / 8 / max_unit;
+    n = min(n, nmax);
+    n = max(n, (int64_t) PLAN_MIN_CHUNK_DATA);
+    conf->n_chunk_data = min(n, (int64_t) PLAN_MAX_CHUNK_DATA);
+  }
+  if (!n_chunk_index_set) {
+    int64_t out_bytes = min(conf->mem_budget / 8, (int64_t) 1<<20);
+    int64_t n = (conf->mem_budget - (int64_t) conf->n_chunk_data * max_unit - out_bytes) / row_bytes;
+    n = min(n, max(n_rows, (int64_t) 1));
+    conf->n_chunk_index = min(max(n, (int64_t) 1), (int64_t) INT_MAX / 2);
+  }
+
+  if (conf->verbose) {
+    fprintf(stderr, "[%s] %d samples, %"PRId64" rows queried of %"PRId64" (density %.4f), %"PRId64" cells.\n",
+            __func__, n_tbks, n_rows, nmax, density, cells);
+    fprintf(stderr, "[%s] memory budget %"PRId64" bytes, %"PRId64" bytes per row.\n",
+            __func__, conf->mem_budget, row_bytes);
+    if (conf->chunk_read)
+      fprintf(stderr, "[%s] strategy: chunk read, index chunk %d rows, data chunk %d units.\n",
+              __func__, conf->n_chunk_index, conf->n_chunk_data);
+    else
+      fprintf(stderr, "[%s] strategy: random access.\n", __func__);
+  }
+}
+
+#define CHUNK_MAX_GAP (1<<16)
+
+/* decode sample k of all rows into rows->cols[k] */
+static void chunk_decode_sample(chunk_rows_t *rows, tbk_t *tbk, tbk_data_t *col,
+                                view_conf_t *conf, tbk_data_t *data) {
+
+  int ds = tbk_data_unit(tbk->dtype);
+  col->dtype = tbk->dtype;
+  col->n = rows->n;
+  col->data = realloc(col->data, (size_t) ds * max(rows->n, 1));
+
+  /* order is sorted by offset, unaddressed rows first */
+  pair64_t *order = rows->order;
+  int j = 0;
+  while (j < rows->n && order[j].u < 0) j++;
+  if (j == rows->n) return;
+  if (order[rows->n-1].u >= tbk->nmax)
+    wzfatal("Error: query %"PRId64" out of range. Wrong idx file?", order[rows->n-1].u);
+
+  /* only the data chunks spanned by the rows are read, each up to its
+     last row, and a gap of over CHUNK_MAX_GAP units starts another */
+  int64_t chunk_beg = order[j].u;
+  while (j < rows->n) {
+    int64_t last = chunk_beg;
+    int jj;
+    for (jj = j+1; jj < rows->n && order[jj].u < chunk_beg + conf->n_chunk_data &&
+           order[jj].u - last <= CHUNK_MAX_GAP; ++jj) last = order[jj].u;
+    tbk_query_n(tbk, chunk_beg, last - chunk_beg + 1, data);
+    int64_t chunk_end = chunk_beg + data->n;
+    for (; j < rows->n && order[j].u < chunk_end; ++j) {
+      int64_t i = order[j].v;
+      char *src = (char*) data->data + (order[j].u - chunk_beg) * ds;
+      if (DATA_TYPE(tbk->dtype) == DT_STRINGD)
+        ((char**) col->data)[i] = strdup(*(char**) src);
+      else
+        memcpy((char*) col->data + (size_t) i * ds, src, ds);
+    }
+    if (DATA_TYPE(tbk->dtype) == DT_STRINGD) {
+      int ii;
+      for (ii=0; ii<data->n; ++ii) free(((char**) data->data)[ii]);
+    }
+    if (j < rows->n) chunk_beg = order[j].u;
+  }
+}
+
+/* strings are freed as printed, those of rows decoded then dropped by
+   --where are freed here */
+static void chunk_free_dropped(chunk_rows_t *rows, tbk_t *tbks, int n_tbks) {
+  int j, k;
+  for (k=0; k<n_tbks; ++k) {
+    if (DATA_TYPE(tbks[k].dtype) != DT_STRINGD) continue;
+    for (j=0; j<rows->n; ++j) {
+      int64_t i = rows->order[j].v;
+      if (rows->order[j].u >= 0 && !rows->keep[i]) free(((char**) rows->cols[k].data)[i]);
     }
   }
+}
 
-  /* output and reset */
-  int i;
-  for (i=0; i < n_offsets; ++i) {
-    if (ks_out[i].s) {
-      if (offsets[i] >= 0) {
-        fputs(ks_out[i].s, out_fh); fputc('\n', out_fh);
-      } else if (conf->show_unaddressed) {
-        fputs(ks_out[i].s, out_fh);
-        for (k=0; k<n_tbks; ++k) fputs("\t-1", out_fh);
-        fputc('\n', out_fh);
+/* decode and output one chunk of rows, then reset */
+static void query_one_chunk(chunk_rows_t *rows, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+
+  if (rows->n == 0) return;
+
+  int i, k;
+  uint8_t *keep = rows->keep;
+  if (conf->where) {
+    /* rows in blocks the zone maps rule out are not read */
+    int64_t block = -1;
+    int may = 0;
+    for (i=0; i<rows->n; ++i) {
+      if (rows->offsets[i] < 0) { keep[i] = 0; continue; }
+      if (rows->offsets[i] >> ZONE_BLOCK_SHIFT != block) {
+        block = rows->offsets[i] >> ZONE_BLOCK_SHIFT;
+        may = where_block_may_match(conf->where, tbks, n_tbks, block, conf);
       }
-      free(ks_out[i].s); memset(&ks_out[i], 0 , sizeof(kstring_t));
+      keep[i] = may;
+    }
+  }
+  for (i=0; i<rows->n; ++i) {
+    rows->order[i].u = (keep && !keep[i]) ? -1 : rows->offsets[i];
+    rows->order[i].v = i;
+  }
+  ks_introsort(pair64, rows->n, rows->order);
+
+  int p = prof_enter(PROF_DECODE);
+  tbk_data_t data = {0};
+  for (k=0; k<n_tbks; ++k)
+    chunk_decode_sample(rows, &tbks[k], &rows->cols[k], conf, &data);
+  free(data.data);
+  if (conf->where) {
+    where_filter_rows(conf->where, tbks, rows->cols, n_tbks, rows->n, conf, keep);
+    chunk_free_dropped(rows, tbks, n_tbks);
+  }
+
+  /* format all rows in one pass */
+  prof_enter(PROF_FORMAT);
+  kstring_t *out = &rows->out;
+  for (i=0; i<rows->n; ++i) {
+    if (keep && !keep[i]) continue;
+    size_t end = (i+1 < rows->n) ? rows->pfx[i+1] : rows->text.l;
+    kputsn(rows->text.s + rows->pfx[i], end - rows->pfx[i], out);
+    if (rows->offsets[i] >= 0) {
+      for (k=0; k<n_tbks; ++k) tbk_print1(&rows->cols[k], i, conf, out);
+    } else {
+      for (k=0; k<n_tbks; ++k) kputs("\t-1", out);
+    }
+    kputc('\n', out);
+    if (out->l >= (1<<20)) {
+      prof_enter(PROF_WRITE);
+      fwrite(out->s, 1, out->l, out_fh); out->l = 0;
+      prof_enter(PROF_FORMAT);
     }
   }
-  memset(offsets, 0, sizeof(int) * conf->n_chunk_index);
+  prof_enter(PROF_WRITE);
+  if (out->l) { fwrite(out->s, 1, out->l, out_fh); out->l = 0; }
+  prof_leave(p);
+  PROF_COUNT(n_rows, rows->n);
+  PROF_COUNT(n_cells, (int64_t) rows->n * n_tbks);
+
+  rows->n = 0;
+  rows->text.l = 0;
 }
 
-int chunk_query_region(char *fname, char **regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+/* rows of one region from the coordinate cache */
+static void chunk_add_cached(chunk_rows_t *rows, tbk_region_t *r, int *linenum,
+                             tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+  tbk_cache_t *c = conf->cache;
+  int64_t lo, hi, j;
+  int tid = -1;
+  int p = prof_enter(PROF_INDEX);
+  tbk_cache_range(c, r, &lo, &hi);
+  for (j=lo; j<hi; ++j) {
+    if (!tbk_cache_overlap(c, r, j)) continue;
+    if (!(*linenum)++ && conf->column_name)
+      tbk_print_columnnames(tbks, n_tbks, 4, out_fh, conf);
+    if (c->off[j] < 0 && !conf->show_unaddressed) continue;
 
-  int i;
-  htsFile *fp = hts_open(fname,"r");
-  if(!fp) error("Could not read %s\n", fname);
-  
-  tbx_t *tbx = tbx_index_load(fname);
-  if(!tbx) error("Could not load .tbi/.csi index of %s\n", fname);
-  kstring_t str = {0,0,0};
-  const char **seq = NULL;
-
-  /* line reading and splitting */
-  char **fields = NULL;
-  int nfields = -1;
-  char *aux = NULL;
-  
-  int n, ii;
-  int linenum=0;
+    if (r->tid == HTS_IDX_START) {
+      while (tid < 0 || j >= c->seq_beg[tid+1]) tid++;
+    } else tid = r->tid;
+    kstring_t *ks = &rows->text;
+    rows->pfx[rows->n] = ks->l;
+    kputs(c->seqnames[tid], ks); kputc('\t', ks);
+    kputw(c->beg[j], ks); kputc('\t', ks);
+    kputw(c->end[j], ks);
+    rows->offsets[rows->n++] = c->off[j];
+    if (rows->n == rows->m) {
+      query_one_chunk(rows, tbks, n_tbks, conf, out_fh);
+      prof_enter(PROF_INDEX);
+    }
+  }
+  prof_leave(p);
+}
 
-  int index_chunk_beg = 0;
-  int index_chunk_end = 1;
+int chunk_query_region(char *fname, tbx_t *tbx, tbk_region_t *regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
 
-  /* offsets in the current chunk */
-  int *ns = calloc(conf->n_chunk_index, sizeof(int));
-  /* output */
-  kstring_t *ks_out = calloc(conf->n_chunk_index, sizeof(kstring_t));
-  
-  for(i=0; i<nregs; i++) {
-    hts_itr_t *itr = tbx_itr_querys(tbx, regs[i]);
-    if(!itr) continue;
-    while (tbx_itr_next(fp, tbx, itr, &str) >= 0) {
+  int i, j;
+  htsFile *fp = hts_open(fname,"r");
+  if(!fp) error("Could not read %s\n", fname);
 
-      line_get_fields2(str.s, "\t", &fields, &nfields, &aux);
+  int linenum=0;
 
-      if (nfields < 3)
-        wzfatal("[%s:%d] Bed file has fewer than 3 columns.\n", __func__, __LINE__);
+  chunk_rows_t rows = {0};
+  rows.m = conf->n_chunk_index;
+  rows.offsets = malloc(sizeof(int64_t) * rows.m);
+  rows.order = malloc(sizeof(pair64_t) * rows.m);
+  rows.pfx = malloc(sizeof(size_t) * rows.m);
+  rows.cols = calloc(n_tbks, sizeof(tbk_data_t));
+  if (conf->where) rows.keep = malloc(rows.m);
 
-      if (!linenum && conf->column_name) { /* header */
-        tbk_print_columnnames(tbks, n_tbks, nfields, out_fh, conf);
-      }
-      
-      ensure_number2(fields[3]);
-      n = atoi(fields[3]);
-
-      if (n >= 0 || conf->show_unaddressed) {
-        kstring_t *ks = &ks_out[index_chunk_end - index_chunk_beg - 1];
-        kputs(fields[0], ks); kputc('\t', ks);
-        kputs(fields[1], ks); kputc('\t', ks);
-        kputs(fields[2], ks);
-        if (conf->print_all) {
-          for (ii=3; ii<nfields; ++ii)
-            ksprintf(ks, "\t%s", fields[ii]);
+  if (conf->cache) {
+    for(i=0; i<nregs; i++)
+      chunk_add_cached(&rows, &regs[i], &linenum, tbks, n_tbks, conf, out_fh);
+  } else {
+    /* the index is read ahead on its own thread */
+    int p = prof_enter(PROF_INDEX);
+    idx_reader_t *r = idx_reader_open(fp, tbx, regs, nregs, 1);
+    idx_batch_t *b;
+    while ((b = idx_reader_next(r))) {
+      prof_enter(PROF_PARSE);
+      for (j=0; j<b->n; ++j) {
+        char *line = b->text.s + b->pos[j];
+        if (!linenum++ && conf->column_name) { /* header */
+          int nfields = 1; char *l;
+          for (l = line; *l; ++l) if (*l == '\t') nfields++;
+          tbk_print_columnnames(tbks, n_tbks, nfields, out_fh, conf);
         }
-        ns[index_chunk_end - index_chunk_beg - 1] = n;
-      
-        if (index_chunk_end % conf->n_chunk_index == 0) {
-          query_one_chunk(ns, index_chunk_end-index_chunk_beg, tbks, n_tbks, conf, ks_out, out_fh);
-          index_chunk_beg = index_chunk_end;
+
+        int64_t n = b->off[j];
+        if (n >= 0 || conf->show_unaddressed) {
+          kstring_t *ks = &rows.text;
+          rows.pfx[rows.n] = ks->l;
+          if (conf->print_all) kputs(line, ks);
+          else kputsn(line, b->len3[j], ks);
+          rows.offsets[rows.n++] = n;
+          if (rows.n == rows.m) {
+            query_one_chunk(&rows, tbks, n_tbks, conf, out_fh);
+            prof_enter(PROF_PARSE);
+          }
         }
-                
-        index_chunk_end++;
       }
-      
-      linenum++;
+      prof_enter(PROF_INDEX);
     }
-    tbx_itr_destroy(itr);
+    idx_reader_close(r);
+    prof_leave(p);
   }
 
-  query_one_chunk(ns, index_chunk_end-index_chunk_beg-1, tbks, n_tbks, conf, ks_out, out_fh);
+  query_one_chunk(&rows, tbks, n_tbks, conf, out_fh);
 
-  free_fields(fields, nfields);
-  free(aux);
-  free(ns);
-  free(seq);
-  free(str.s);
-  tbx_destroy(tbx);
+  for (i=0; i<n_tbks; ++i) free(rows.cols[i].data);
+  free(rows.cols); free(rows.offsets); free(rows.order); free(rows.pfx); free(rows.keep);
+  free(rows.text.s); free(rows.out.s);
 
   if(hts_close(fp)) error("hts_close returned non-zero status: %s\n", fname);
-  
-  for(i=0; i<nregs; i++) free(regs[i]);
-  free(regs);
   return 0;
 }
@@ -59,6 +59,8 @@ int main_header(int argc, char *argv[]) {
         fprintf(stdout, "  Sample %d: %s\n", j++, tbk.sname);
         fprintf(stdout, "  TBK Version: %d\n", tbk.version);
         fputs("  Data type: ", stdout);
+        if (tbk.dtype & DT_SPARSE) fputs("SPARSE ", stdout);
+        if (tbk.dtype & DT_SPLIT) fputs("SPLIT ", stdout);
         switch(DATA_TYPE(tbk.dtype)) {
         case DT_INT1:        fputs("INT1\n", stdout);        break;
         case DT_INT2:        fputs("INT2\n", stdout);        break;
@@ -70,6 +72,8 @@ int main_header(int argc, char *argv[]) {
         case DT_ONES:        fputs("ONES\n", stdout);        break;
         case DT_FLOAT_INT:   fputs("FLOAT.INT\n", stdout);   break;
         case DT_FLOAT_FLOAT: fputs("FLOAT.FLOAT\n", stdout); break;
+        case DT_BETA8:       fputs("BETA8\n", stdout);       break;
+        case DT_HALF:        fputs("HALF\n", stdout);        break;
         default: wzfatal("  Data type %"PRIu64" unrecognized.\n", tbk.dtype);
         }
         fprintf(stdout, "  Number of data: %"PRId64"\n", tbk.nmax);
@@ -0,0 +1,191 @@
+/* Index rows read ahead on a producer thread
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* The tabix iterator decompresses and splits idx.gz on a producer thread
+ * and hands the rows over in batches through a ring of IDX_RING batches,
+ * so reading the index overlaps with the tbk reads and formatting done by
+ * the consumer. A row is kept as its line, the length of its first three
+ * columns and its parsed tbk offset. Unthreaded, as in the view -@
+ * workers which already run in parallel, batches are filled on demand. */
+
+#include <pthread.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "htslib/htslib/kstring.h"
+
+#define IDX_RING        4
+#define IDX_BATCH_ROWS  4096
+#define IDX_BATCH_TEXT  (1<<20)
+
+struct idx_reader_t {
+  htsFile *fp;                  /* owned by the caller */
+  tbx_t *tbx;
+  tbk_region_t *regs;
+  int nregs;
+  int i;                        /* next region to iterate */
+  hts_itr_t *itr;               /* of the region being iterated */
+  kstring_t str;
+  int nfields;                  /* of the first row, -1 before it */
+
+  idx_batch_t ring[IDX_RING];
+  int head, tail;               /* next batch to fill and to consume */
+  int n_full;                   /* filled and not yet released */
+  int held;                     /* the consumer holds ring[tail] */
+  int done, stop;
+  int threaded;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void idx_batch_add(idx_reader_t *r, idx_batch_t *b, char *s, size_t l) {
+  int nf = 1, len3 = -1; char *f3 = NULL, *p;
+  for (p = s; (p = memchr(p, '\t', l - (p - s))); ++p)
+    if (++nf == 4) { len3 = p - s; f3 = p + 1; }
+
+  if (nf < 4)
+    wzfatal("[%s:%d] Bed file has fewer than 4 columns.\n", __func__, __LINE__);
+  if (r->nfields < 0) r->nfields = nf;
+  else if (nf != r->nfields)
+    wzfatal("Wrong field number %d (expecting %d).\n", nf, r->nfields);
+
+  if (b->n == b->m) {
+    b->m = b->m ? b->m<<1 : IDX_BATCH_ROWS;
+    b->off = realloc(b->off, sizeof(int64_t) * b->m);
+    b->pos = realloc(b->pos, sizeof(size_t) * b->m);
+    b->len3 = realloc(b->len3, sizeof(int) * b->m);
+  }
+
+  /* the tbk offset is column 4 */
+  char *e = memchr(f3, '\t', l - (f3 - s));
+  if (e) *e = '\0';
+  ensure_number2(f3);
+  b->off[b->n] = atoll(f3);
+  if (e) *e = '\t';
+
+  b->pos[b->n] = b->text.l;
+  b->len3[b->n] = len3;
+  kputsn(s, l, &b->text);
+  kputc('\0', &b->text);
+  b->n++;
+}
+
+/* the next rows in region order, 0 rows at the end */
+static void idx_batch_fill(idx_reader_t *r, idx_batch_t *b) {
+  b->n = 0; b->text.l = 0;
+  while (1) {
+    if (!r->itr) {
+      if (r->i == r->nregs) return;
+      tbk_region_t *reg = &r->regs[r->i++];
+      if (!(r->itr = tbx_itr_queryi(r->tbx, reg->tid, reg->beg, reg->end))) continue;
+    }
+    while (b->n < IDX_BATCH_ROWS && b->text.l < IDX_BATCH_TEXT) {
+      if (tbx_itr_next(r->fp, r->tbx, r->itr, &r->str) < 0) {
+        tbx_itr_destroy(r->itr); r->itr = NULL;
+        break;
+      }
+      idx_batch_add(r, b, r->str.s, r->str.l);
+    }
+    if (r->itr) return;         /* batch is full */
+  }
+}
+
+static void *idx_producer(void *arg) {
+  idx_reader_t *r = (idx_reader_t*) arg;
+  while (1) {
+    pthread_mutex_lock(&r->lock);
+    while (r->n_full == IDX_RING && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+    int stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    if (stop) break;
+
+    idx_batch_t *b = &r->ring[r->head];
+    idx_batch_fill(r, b);
+
+    pthread_mutex_lock(&r->lock);
+    if (b->n) { r->n_full++; r->head = (r->head + 1) % IDX_RING; }
+    else r->done = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (!b->n) break;
+  }
+  return NULL;
+}
+
+idx_reader_t *idx_reader_open(htsFile *fp, tbx_t *tbx, tbk_region_t *regs, int nregs, int threaded) {
+  idx_reader_t *r = calloc(1, sizeof(idx_reader_t));
+  r->fp = fp; r->tbx = tbx; r->regs = regs; r->nregs = nregs;
+  r->nfields = -1;
+  r->threaded = threaded;
+  if (threaded) {
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, idx_producer, r))
+      wzfatal("Cannot start the index reader thread.\n");
+  }
+  return r;
+}
+
+idx_batch_t *idx_reader_next(idx_reader_t *r) {
+  if (!r->threaded) {
+    idx_batch_fill(r, &r->ring[0]);
+    return r->ring[0].n ? &r->ring[0] : NULL;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (r->held) {                /* release the batch given out last */
+    r->held = 0;
+    r->n_full--;
+    r->tail = (r->tail + 1) % IDX_RING;
+    pthread_cond_broadcast(&r->cond);
+  }
+  while (!r->n_full && !r->done) pthread_cond_wait(&r->cond, &r->lock);
+  idx_batch_t *b = NULL;
+  if (r->n_full) { b = &r->ring[r->tail]; r->held = 1; }
+  pthread_mutex_unlock(&r->lock);
+  return b;
+}
+
+void idx_reader_close(idx_reader_t *r) {
+  int i;
+  if (r->threaded) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+  }
+  if (r->itr) tbx_itr_destroy(r->itr);
+  for (i=0; i<IDX_RING; ++i) {
+    idx_batch_t *b = &r->ring[i];
+    free(b->off); free(b->pos); free(b->len3); free(b->text.s);
+  }
+  free(r->str.s);
+  free(r);
+}
@@ -34,14 +34,20 @@ const int unit_base[40] = {
   0,  1,  1,  4,  4,  8,  8,  0,
   0,  0,  0,  0,  0,  0,  0,  0,
   0,  0,  0,  0,  0,  0,  0,  0,
-  0,  0,  0,  0,  0,  0,  0,  8,
-  8,  0,  0,  0,  0,  0,  0,  0
+  0,  0,  0,  0,  0,  0,  2,  8,
+  8,  1,  2,  0,  0,  0,  0,  0
 };
 
 int main_pack(int argc, char *argv[]);
 int main_view(int argc, char *argv[]);
 int main_header(int argc, char *argv[]);
 int main_bundle(int argc, char *argv[]);
+int main_stats(int argc, char *argv[]);
+int main_matrix(int argc, char *argv[]);
+int main_update(int argc, char *argv[]);
+int main_bench(int argc, char *argv[]);
+int main_zoom(int argc, char *argv[]);
+int main_remap(int argc, char *argv[]);
 
 static int usage()
 {
@@ -55,6 +61,12 @@ static int usage()
   fprintf(stderr, "     view         view data stored in tbk\n");
   fprintf(stderr, "     header       view and set tbk data header\n");
   fprintf(stderr, "     bundle       bundle tbk into a multi-tbk.\n");
+  fprintf(stderr, "     stats        summary statistics per sample or region\n");
+  fprintf(stderr, "     matrix       write tbks into a dense binary cohort matrix\n");
+  fprintf(stderr, "     update       update values of a tbk in place\n");
+  fprintf(stderr, "     zoom         build zoom levels for wide-window views\n");
+  fprintf(stderr, "     remap        reproject tbks onto another index\n");
+  fprintf(stderr, "     bench        benchmark on a synthetic cohort\n");
   fprintf(stderr, "\n");
 
   return 1;
@@ -67,6 +79,12 @@ int main(int argc, char *argv[]) {
   else if (strcmp(argv[1], "view") == 0) ret = main_view(argc-1, argv+1);
   else if (strcmp(argv[1], "header") == 0) ret = main_header(argc-1, argv+1);
   else if (strcmp(argv[1], "bundle") == 0) ret = main_bundle(argc-1, argv+1);
+  else if (strcmp(argv[1], "stats") == 0) ret = main_stats(argc-1, argv+1);
+  else if (strcmp(argv[1], "matrix") == 0) ret = main_matrix(argc-1, argv+1);
+  else if (strcmp(argv[1], "update") == 0) ret = main_update(argc-1, argv+1);
+  else if (strcmp(argv[1], "zoom") == 0) ret = main_zoom(argc-1, argv+1);
+  else if (strcmp(argv[1], "remap") == 0) ret = main_remap(argc-1, argv+1);
+  else if (strcmp(argv[1], "bench") == 0) ret = main_bench(argc-1, argv+1);
   else {
     fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]);
     return 1;
@@ -0,0 +1,208 @@
+/* Write tbk cohorts into a dense binary matrix
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+/* Matrix file layout (little-endian):
+ *
+ *   3 bytes   "tbm"
+ *   4 bytes   version, currently 1
+ *   8 bytes   number of rows (tbk offsets)
+ *   8 bytes   number of columns (samples)
+ *   4 bytes   tile rows
+ *   4 bytes   tile columns
+ *   8 bytes   byte offset of the first tile
+ *   sample names, each '\0'-terminated
+ *
+ * Tiles are float32, row-major inside a tile, and are ordered by row
+ * block then column block. Edge tiles are not padded, so tile (rb, cb)
+ * starts at  data_offset + 4*(rb*tile_rows*ncols + nrows_rb*cb*tile_cols)
+ * where nrows_rb is the number of rows in row block rb. Missing values
+ * are NAN. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "tbmate.h"
+
+#define MATRIX_ALIGN 4096
+
+typedef struct matrix_conf_t {
+  view_conf_t vconf;
+  int tile_rows;
+  int tile_cols;
+  int n_chunk_data;             /* rows read per sample at a time */
+} matrix_conf_t;
+
+static int usage(matrix_conf_t *conf) {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate matrix [options] -o <out.tbm> [.tbk [...]]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -o        output matrix file\n");
+  fprintf(stderr, "    -l        provide tbk file names in the list.\n");
+  fprintf(stderr, "    -r        rows per tile [%d]\n", conf->tile_rows);
+  fprintf(stderr, "    -c        columns (samples) per tile [%d]\n", conf->tile_cols);
+  fprintf(stderr, "    -n        rows read per sample at a time [%d], rounded to tile rows.\n", conf->n_chunk_data);
+  fprintf(stderr, "    -d        using NA for negative values\n");
+  fprintf(stderr, "    -s        min coverage for float.int (%d)\n", conf->vconf.min_coverage);
+  fprintf(stderr, "    -t        max p-value for float.float (%f)\n", conf->vconf.max_pval);
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, rows are tbk offsets and columns are samples, stored as float\n");
+  fprintf(stderr, "in cache-blocked tiles. Memory is bounded by n x c floats.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+static void pwrite_full(int fd, const void *buf, size_t n, off_t offset, const char *fname) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, offset);
+    if (w < 0) wzfatal("Cannot write to %s.\n", fname);
+    p += w; n -= w; offset += w;
+  }
+}
+
+static int64_t matrix_write_hdr(int fd, tbk_t *tbks, int n_tbks, int64_t nrows,
+                                matrix_conf_t *conf, const char *fname) {
+  int64_t i, hdr_size = 3+4+8+8+4+4+8;
+  for (i=0; i<n_tbks; ++i) hdr_size += strlen(tbks[i].sname) + 1;
+  int64_t data_offset = (hdr_size + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+
+  char *hdr = calloc(data_offset, 1), *p = hdr;
+  int32_t version = 1; int64_t ncols = n_tbks;
+  memcpy(p, "tbm", 3);                  p += 3;
+  memcpy(p, &version, 4);               p += 4;
+  memcpy(p, &nrows, 8);                 p += 8;
+  memcpy(p, &ncols, 8);                 p += 8;
+  memcpy(p, &conf->tile_rows, 4);       p += 4;
+  memcpy(p, &conf->tile_cols, 4);       p += 4;
+  memcpy(p, &data_offset, 8);           p += 8;
+  for (i=0; i<n_tbks; ++i) {
+    strcpy(p, tbks[i].sname); p += strlen(tbks[i].sname) + 1;
+  }
+  pwrite_full(fd, hdr, data_offset, 0, fname);
+  free(hdr);
+  return data_offset;
+}
+
+int main_matrix(int argc, char *argv[]) {
+
+  matrix_conf_t conf = {0};
+  conf.vconf.max_pval = -1.0;
+  conf.vconf.min_coverage = -1;
+  conf.tile_rows = 256;
+  conf.tile_cols = 256;
+  conf.n_chunk_data = 65536;
+
+  int c;
+  if (argc<2) return usage(&conf);
+
+  char *out_fname = NULL;
+  char *tbk_fname_list = NULL;
+  while ((c = getopt(argc, argv, "o:l:r:c:n:s:t:dh"))>=0) {
+    switch (c) {
+    case 'o': out_fname = strdup(optarg); break;
+    case 'l': tbk_fname_list = strdup(optarg); break;
+    case 'r': conf.tile_rows = atoi(optarg); break;
+    case 'c': conf.tile_cols = atoi(optarg); break;
+    case 'n': conf.n_chunk_data = atoi(optarg); break;
+    case 's': conf.vconf.min_coverage = atoi(optarg); break;
+    case 't': conf.vconf.max_pval = atof(optarg); break;
+    case 'd': conf.vconf.na_for_negative = 1; break;
+    case 'h': return usage(&conf); break;
+    default: usage(&conf); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+
+  if (!out_fname) { usage(&conf); wzfatal("Please supply output file with -o.\n"); }
+  if (conf.tile_rows <= 0 || conf.tile_cols <= 0) wzfatal("Tile size must be positive.\n");
+  if (conf.n_chunk_data < conf.tile_rows) conf.n_chunk_data = conf.tile_rows;
+  conf.n_chunk_data -= conf.n_chunk_data % conf.tile_rows;
+
+  int n_tbks = 0; tbk_t *tbks = NULL;
+  int n_tbfs = 0; tbf_t *tbfs = NULL;
+  parse_tbf_from_argument(argc, argv, optind, &tbfs, &n_tbfs);
+  parse_tbf_fname_list(tbk_fname_list, &tbfs, &n_tbfs);
+  int i, k;
+  for (i=0; i<n_tbfs; ++i) parse_tbk_from_tbf(&tbfs[i], &tbks, &n_tbks);
+  if (!n_tbks) { usage(&conf); wzfatal("Please supply tbk file.\n"); }
+
+  int64_t nrows = 0;
+  for (k=0; k<n_tbks; ++k) {
+    if (!dtype_is_numeric(tbks[k].dtype))
+      wzfatal("%s: data type %d cannot be put in a matrix.\n", tbks[k].sname, DATA_TYPE(tbks[k].dtype));
+    if (tbks[k].nmax > nrows) nrows = tbks[k].nmax;
+  }
+
+  int fd = open(out_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) wzfatal("Cannot open %s to write.\n", out_fname);
+  int64_t data_offset = matrix_write_hdr(fd, tbks, n_tbks, nrows, &conf, out_fname);
+
+  /* one chunk of rows for one column block, filled sample by sample */
+  int tr = conf.tile_rows, tc = conf.tile_cols;
+  float *block = malloc(sizeof(float) * conf.n_chunk_data * tc);
+  float *tile = malloc(sizeof(float) * tr * tc);
+  tbk_data_t data = {0};
+  float cov;
+  int64_t chunk_beg, r;
+  for (chunk_beg = 0; chunk_beg < nrows; chunk_beg += conf.n_chunk_data) {
+    int nr = min(conf.n_chunk_data, nrows - chunk_beg);
+    int cb;
+    for (cb = 0; cb * tc < n_tbks; ++cb) {
+      int nc = min(tc, n_tbks - cb * tc);
+
+      /* sequential read of each sample into a column of the block */
+      for (k=0; k<nc; ++k) {
+        tbk_t *tbk = &tbks[cb*tc+k];
+        int n_read = 0;
+        if (chunk_beg < tbk->nmax) {
+          tbk_query_n(tbk, chunk_beg, nr, &data);
+          n_read = data.n;
+        }
+        for (r=0; r<n_read; ++r) block[r*nc+k] = tbk_data_float(&data, r, &conf.vconf, &cov);
+        for (; r<nr; ++r) block[r*nc+k] = NAN;
+      }
+
+      /* cut the block into tiles */
+      int64_t rb_beg;
+      for (rb_beg = 0; rb_beg < nr; rb_beg += tr) {
+        int ntr = min(tr, nr - rb_beg);
+        for (r=0; r<ntr; ++r)
+          memcpy(tile + r*nc, block + (rb_beg+r)*nc, sizeof(float)*nc);
+        int64_t rb = (chunk_beg + rb_beg) / tr;
+        int64_t offset = data_offset + 4*(rb*tr*n_tbks + (int64_t) ntr*cb*tc);
+        pwrite_full(fd, tile, sizeof(float)*ntr*nc, offset, out_fname);
+      }
+    }
+  }
+  free(block); free(tile); free(data.data);
+  if (close(fd)) wzfatal("Cannot close %s.\n", out_fname);
+
+  if (n_tbfs > 0) {for (i=0; i<n_tbfs; ++i) tbf_close(&tbfs[i]); free(tbfs);}
+  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) free(tbks[i].sname); free(tbks);}
+  free(out_fname); free(tbk_fname_list);
+  return 0;
+}
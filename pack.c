@@ -27,6 +27,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tbmate.h"
 #include "wzbed.h"
 
@@ -56,48 +61,242 @@ void parse_data(bed1_t *b, char **fields, int nfields) {
 static int usage(conf_pack_t *conf) {
   fprintf(stderr, "\n");
   fprintf(stderr, "Usage: tbmate pack [options] <in.bed> <out.tbk>\n");
+  fprintf(stderr, "       tbmate pack [options] -C <columns> <in.bed> <out_dir | out.tbk>\n");
+  fprintf(stderr, "       tbmate pack [options] -i <idx.gz> <in.bed> <out.tbk> [<in.bed> <out.tbk> ...]\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "    -s        int1, int2, int32, int, float, double, stringf, stringd, ones ([-1,1] up to 3e-5 precision)\n");
+  fprintf(stderr, "              float.int, float.float, beta8 ([0,1] in steps of 1/254, negative is NA),\n");
+  fprintf(stderr, "              half (IEEE half float). If not given, inferred from all rows as the\n");
+  fprintf(stderr, "              narrowest of int32, beta8, ones, half, float, double and strings\n");
+  fprintf(stderr, "              keeping the values.\n");
+  fprintf(stderr, "    --tol     absolute error allowed in inference [half of the last printed decimal]\n");
+  fprintf(stderr, "    --sparse  store only the rows that are not NA (-n), for mostly missing data.\n");
+  fprintf(stderr, "              Not for int1, int2 and strings.\n");
+  fprintf(stderr, "    --split   float.int and float.float, store the first values of all rows, then\n");
+  fprintf(stderr, "              the second values (coverage bit-packed), so views not using them\n");
+  fprintf(stderr, "              read half the data.\n");
+  fprintf(stderr, "    --zonemap write <out.tbk>.tbz, the min, max and NA count of each block of\n");
+  fprintf(stderr, "              1024 rows, used by view --where to skip blocks. Not for --bundle.\n");
   fprintf(stderr, "    -x        optional output of an index file containing address for each record.\n");
   fprintf(stderr, "    -n        integer number for nan or '.' [%f]. \n", conf->nan),
   fprintf(stderr, "    -m        optional message, it will also be used to locate index file.\n");
+  fprintf(stderr, "    -C        columns to pack, e.g., 4-, 4,6,8-10, one tbk per column written\n");
+  fprintf(stderr, "              to out_dir in one pass. Names come from a '#' header line,\n");
+  fprintf(stderr, "              otherwise colN. float.int and float.float take 2 columns each.\n");
+  fprintf(stderr, "    --bundle  under -C, write the tbks into a single bundle out.tbk.\n");
+  fprintf(stderr, "    -i        index. Each row goes to the offset of its chromosome, start and\n");
+  fprintf(stderr, "              end in the index, in.bed needs no sorting and rows it lacks\n");
+  fprintf(stderr, "              are NA.\n");
+  fprintf(stderr, "              Pairs of in.bed and out.tbk share the loaded index. Fixed-width\n");
+  fprintf(stderr, "              types only. Builds <idx>.tbc if missing.\n");
+  fprintf(stderr, "    -@        threads encoding columns under -C, or pairs under -i [1]\n");
+  fprintf(stderr, "    --profile report time spent parsing and writing to stderr\n");
   fprintf(stderr, "    -h        This help\n");
   fprintf(stderr, "\n");
-  fprintf(stderr, "Note, in.bed is an index-ordered bed file. Column 4 will be made a .tbk file.\n");
+  fprintf(stderr, "Note, in.bed is an index-ordered bed file unless -i is given. Column 4 will be made a .tbk file.\n");
   fprintf(stderr, "\n");
 
   return 1;
 }
 
-static int is_integer(beddata_t *samples, int n_samples) {
-  int i, j;
-  for (j=0;j<n_samples;++j) {
-    for (i=0;samples[j].s[0][i];++i) {
-      if (!isdigit(samples[j].s[0][i]) &&
-          samples[j].s[0][i] != '-') return 0;
-    }
+/* Data type inference over all rows. A value is kept if it reads back
+   within tol, by default half a unit of its last printed decimal, so
+   "0.802" may be stored as ones and "12.5" as float. The narrowest type
+   keeping every value wins, "." is the nan and fits all numeric types
+   but int1 and int2, which take only the digits 0-1 and 0-3. Integer
+   columns are int32 otherwise, so they print as they were given. */
+typedef struct pack_infer_t {
+  int64_t n, n_na;
+  int numeric, integer;         /* all values so far */
+  int max_digit;                /* largest of single digit values, 9 if any is not */
+  int beta8_ok, ones_ok, half_ok, float_ok;
+  uint64_t max_len, sum_len;    /* for strings */
+} pack_infer_t;
+
+static void pack_infer_init(pack_infer_t *pi) {
+  memset(pi, 0, sizeof(pack_infer_t));
+  pi->numeric = pi->integer = pi->beta8_ok = pi->ones_ok = pi->half_ok = pi->float_ok = 1;
+}
+
+static void pack_infer_add(pack_infer_t *pi, const char *s, double tol) {
+  uint64_t len = strlen(s);
+  pi->n++;
+  pi->sum_len += len;
+  if (len > pi->max_len) pi->max_len = len;
+  if (s[0] == '.' && s[1] == '\0') { pi->n_na++; return; }
+  if (!pi->numeric) return;
+
+  char *end;
+  double v = strtod(s, &end);
+  if (end == s || *end || !isfinite(v)) { pi->numeric = 0; return; }
+
+  /* decimals as printed, 1.5e-3 has 4 */
+  int d = 0, integer = 1;
+  const char *q = s;
+  if (*q == '-' || *q == '+') q++;
+  for (; isdigit(*q); ++q);
+  if (*q == '.') { integer = 0; for (++q; isdigit(*q); ++q) d++; }
+  if (*q == 'e' || *q == 'E') { integer = 0; d -= atoi(q+1); }
+  if (d < 0) d = 0;
+  if (!integer || v < INT32_MIN || v > INT32_MAX) pi->integer = 0;
+  if (s[0] >= '0' && s[0] <= '9' && s[1] == '\0') pi->max_digit = max(pi->max_digit, s[0] - '0');
+  else pi->max_digit = 9;
+
+  double t = tol >= 0 ? tol : 0.5 * pow(10, -d);
+  if (v < 0 || v > 1 || fabs(v - beta8_to_float(float_to_beta8(v))) >= t) pi->beta8_ok = 0;
+  if (v < -1 || v > 1 || fabs(v - uint16_to_float(float_to_uint16(v))) >= t) pi->ones_ok = 0;
+  if (fabs(v - half_to_float(float_to_half(v))) >= t) pi->half_ok = 0;
+  if (fabs(v - (double) (float) v) >= t) pi->float_ok = 0;
+}
+
+/* sub_byte 0 where int1 and int2 cannot be written, e.g., sparse */
+static uint64_t pack_infer_dtype(pack_infer_t *pi, int sub_byte) {
+  if (pi->n == pi->n_na) return DT_FLOAT;
+  if (!pi->numeric) {           /* fixed width if no larger than offsets */
+    if (pi->max_len * pi->n <= 8 * pi->n + pi->sum_len + pi->n)
+      return DT_STRINGF | (max(pi->max_len, (uint64_t) 1) << 8);
+    return DT_STRINGD;
   }
-  return 1;
+  if (sub_byte && !pi->n_na && pi->max_digit <= 1) return DT_INT1;
+  if (sub_byte && !pi->n_na && pi->max_digit <= 3) return DT_INT2;
+  if (pi->integer) return DT_INT32;   /* prints as integers, unlike the float types */
+  if (pi->beta8_ok) return DT_BETA8;
+  if (pi->ones_ok) return DT_ONES;
+  if (pi->half_ok) return DT_HALF;
+  if (pi->float_ok) return DT_FLOAT;
+  return DT_DOUBLE;
 }
 
-/* only check the first unit */
-static int is_float(beddata_t *samples, int n_samples) {
-  int i, j;
-  for (j=0; j<n_samples; ++j) {
-    for (i=0;samples[j].s[0][i];++i) {
-      if (!isdigit(samples[j].s[0][i]) &&
-          samples[j].s[0][i] != '.' &&
-          samples[j].s[0][i] != '-') return 0;
-    }
+static const char *dtype_str(uint64_t dtype) {
+  switch(DATA_TYPE(dtype)) {
+  case DT_INT1:        return "int1";
+  case DT_INT2:        return "int2";
+  case DT_INT32:       return "int32";
+  case DT_FLOAT:       return "float";
+  case DT_DOUBLE:      return "double";
+  case DT_STRINGD:     return "stringd";
+  case DT_STRINGF:     return "stringf";
+  case DT_ONES:        return "ones";
+  case DT_FLOAT_INT:   return "float.int";
+  case DT_FLOAT_FLOAT: return "float.float";
+  case DT_BETA8:       return "beta8";
+  case DT_HALF:        return "half";
+  default: return "unknown";
   }
-  return 1;
 }
 
-static int data_type(beddata_t *samples, int n_samples) {
-  if (is_float(samples, n_samples)) return DT_DOUBLE;
-  if (is_integer(samples, n_samples)) return DT_INT32;
-  return -1;
+static int split_fields(char *line, char **fields, int nf);
+
+/* one pass over in_fname, the data type of each 0-based column */
+static void pack_infer(char *in_fname, int *cols, int n_cols, double tol, int sub_byte, uint64_t *dtypes) {
+  int k, nf = 0;
+  for (k=0; k<n_cols; ++k) nf = max(nf, cols[k] + 1);
+  pack_infer_t *pis = malloc(sizeof(pack_infer_t) * n_cols);
+  for (k=0; k<n_cols; ++k) pack_infer_init(&pis[k]);
+  char **f = malloc(sizeof(char*) * nf);
+  char *line; size_t len;
+  int64_t n = 0;
+  wzreader_t *r = wzreader_open(in_fname);
+  while ((line = wzreader_line(r, &len))) {
+    if (line[0] == '\0' || line[0] == '#') continue;
+    n++;
+    if (split_fields(line, f, nf) < nf)
+      wzfatal("Row %"PRId64" has fewer than %d columns.\n", n, nf);
+    for (k=0; k<n_cols; ++k) pack_infer_add(&pis[k], f[cols[k]], tol);
+  }
+  wzreader_close(r);
+  for (k=0; k<n_cols; ++k) dtypes[k] = pack_infer_dtype(&pis[k], sub_byte);
+  free(f); free(pis);
+}
+
+/* copy stdin to a file next to out_fname, inference reads the input twice */
+static char *pack_spool_stdin(const char *out_fname) {
+  char *fname = malloc(strlen(out_fname) + 16);
+  sprintf(fname, "%s_tmp_in_", out_fname);
+  FILE *out = fopen(fname, "wb");
+  if (!out) wzfatal("Cannot open %s to write.\n", fname);
+  char buf[65536];
+  size_t nb;
+  while ((nb = fread(buf, 1, sizeof(buf), stdin)) > 0) fwrite(buf, 1, nb, out);
+  if (fclose(out)) wzfatal("Cannot write to %s.\n", fname);
+  return fname;
+}
+
+/* encode one fixed-width record into buf, which holds unit_size(dtype)
+   bytes. Returns the number of bytes, or -1 for the sub-byte and
+   variable-length types. */
+int tbk_encode1(beddata_t *bd, uint64_t dtype, uint8_t *buf, conf_pack_t *conf) {
+
+  char *s = bd->s[0];
+  int is_na = (s[0] == '.' && s[1] == '\0');
+  switch(DATA_TYPE(dtype)) {
+  case DT_INT32: {
+    int32_t d;
+    if (is_na) d = conf->nan;
+    else d = atoi(s);
+    memcpy(buf, &d, sizeof(int32_t));
+    return sizeof(int32_t);
+  }
+  case DT_FLOAT: {
+    float d;
+    if (is_na) d = conf->nan;
+    else d = atof(s);
+    memcpy(buf, &d, sizeof(float));
+    return sizeof(float);
+  }
+  case DT_DOUBLE: {
+    double d;
+    if (is_na) d = conf->nan;
+    else d = atof(s);
+    memcpy(buf, &d, sizeof(double));
+    return sizeof(double);
+  }
+  case DT_STRINGF: {
+    uint64_t n = strlen(s);
+    if (n > STRING_MAX(dtype)) n = STRING_MAX(dtype);
+    memcpy(buf, s, n);
+    memset(buf + n, 0, STRING_MAX(dtype) - n);
+    return STRING_MAX(dtype);
+  }
+  case DT_ONES: {
+    uint16_t d;
+    if (is_na) d = float_to_uint16(conf->nan);
+    else d = float_to_uint16(atof(s));
+    memcpy(buf, &d, sizeof(uint16_t));
+    return sizeof(uint16_t);
+  }
+  case DT_BETA8: {
+    float f = is_na ? conf->nan : atof(s);
+    if (f > 1) wzfatal("Error, beta8 data over 1: %s\n", s);
+    buf[0] = float_to_beta8(f);
+    return 1;
+  }
+  case DT_HALF: {
+    uint16_t d = float_to_half(is_na ? conf->nan : atof(s));
+    memcpy(buf, &d, sizeof(uint16_t));
+    return sizeof(uint16_t);
+  }
+  case DT_FLOAT_INT: {
+    float d; int32_t d2;
+    if (is_na) d = conf->nan; else d = atof(s);
+    s = bd->s[1];
+    if (s[0] == '.' && s[1] == '\0') d2 = conf->nan; else d2 = atoi(s);
+    memcpy(buf, &d, sizeof(float));
+    memcpy(buf + 4, &d2, sizeof(int32_t));
+    return 8;
+  }
+  case DT_FLOAT_FLOAT: {
+    float d, d2;
+    if (is_na) d = conf->nan; else d = atof(s);
+    s = bd->s[1];
+    if (s[0] == '.' && s[1] == '\0') d2 = conf->nan; else d2 = atof(s);
+    memcpy(buf, &d, sizeof(float));
+    memcpy(buf + 4, &d2, sizeof(float));
+    return 8;
+  }
+  default: return -1;
+  }
 }
 
 void tbk_write(
@@ -119,40 +318,12 @@ void tbk_write(
     break;
   }
   case DT_INT2: {
-    uint8_t d = atoi(s);
+    int d = atoi(s);
+    if (d < 0 || d > 3) wzfatal("Error, int2 data out of [0,3]: %s\n", s);
     *aux |= d << ((n%4)*2);
     if(n%4==3) { fwrite(aux, 1, 1, out); *aux=0; }
     break;
   }
-  case DT_INT32: {
-    int32_t d;
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan;
-    else d = atoi(s);
-    fwrite(&d, sizeof(int32_t), 1, out);
-    break;
-  }
-  case DT_FLOAT: {
-    float d;
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan;
-    else d = atof(s);
-    fwrite(&d, sizeof(float), 1, out);
-    break;
-  }
-  case DT_DOUBLE: {
-    double d = atof(s);
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan;
-    else d = atof(s);
-    fwrite(&d, sizeof(double), 1, out);
-    break;
-  }
-  case DT_STRINGF: {
-    unsigned n = strlen(s);
-    if (n > STRING_MAX(dtype)) s[STRING_MAX(dtype)] = 0;
-    fwrite(s, 1, n, out);
-    char buf = '\0';
-    for (;n < STRING_MAX(dtype);++n) { fwrite(&buf, 1, 1, out); }
-    break;
-  }
   case DT_STRINGD: {
     int n = strlen(s) + 1;
     fwrite(s, 1, n, tmp_out);
@@ -160,29 +331,12 @@ void tbk_write(
     *tmp_out_offset += strlen(s) + 1;
     break;
   }
-  case DT_ONES: {
-    uint16_t d;
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan;
-    else d = float_to_uint16(atof(s));
-    fwrite(&d, sizeof(uint16_t), 1, out);
-    break;
-  }
-  case DT_FLOAT_INT: {
-    float d; int d2;
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan; else d = atof(s);
-    s = bd->s[1];
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan; else d2 = atoi(s);
-    fwrite(&d, sizeof(float), 1, out);
-    fwrite(&d2, sizeof(int32_t), 1, out);
-    break;
-  }
-  case DT_FLOAT_FLOAT: {
-    float d, d2;
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan; else d = atof(s);
-    s = bd->s[1];
-    if (s[0] == '.' && s[1] == '\0') d = conf->nan; else d2 = atof(s);
-    fwrite(&d, sizeof(float), 1, out);
-    fwrite(&d2, sizeof(float), 1, out);
+  case DT_INT32: case DT_FLOAT: case DT_DOUBLE: case DT_STRINGF:
+  case DT_ONES: case DT_FLOAT_INT: case DT_FLOAT_FLOAT: case DT_BETA8: case DT_HALF: {
+    uint8_t buf0[16], *buf = buf0;
+    if (unit_size(dtype) > (int) sizeof(buf0)) buf = malloc(unit_size(dtype));
+    fwrite(buf, tbk_encode1(bd, dtype, buf, conf), 1, out);
+    if (buf != buf0) free(buf);
     break;
   }
   case DT_NA: wzfatal("Fail to detect data type. Please specify -s explicity.\n"); break;
@@ -190,6 +344,408 @@ void tbk_write(
   }
 }
   
+/* finish a tbk written by tbk_write: flush the last sub-byte unit, set
+   the actual nmax and append the strings of stringd from tmp_out, which
+   is closed and removed. Does not close out. */
+void tbk_write_end(
+  uint64_t dtype, FILE *out, int64_t n, uint8_t *aux,
+  FILE *tmp_out, char *tmp_fname, uint64_t tmp_out_offset) {
+
+  if ((DATA_TYPE(dtype) == DT_INT1 && (n&0x7)) ||
+      (DATA_TYPE(dtype) == DT_INT2 && (n&0x3))) { if (out) fwrite(aux, 1, 1, out); *aux=0; }
+
+  /* the actual size */
+  if (out) {
+    fseek(out, HDR_NMAX0, SEEK_SET);
+    fwrite(&n, HDR_NMAX, 1, out);
+  }
+
+  if (tmp_out) {
+    fclose(tmp_out);
+    if (out) {
+      tmp_out = fopen(tmp_fname, "rb");
+      fseek(out, 0, SEEK_END);
+      char buf[65536];
+      size_t nb;
+      while (tmp_out_offset > 0 && (nb = fread(buf, 1, min(sizeof(buf), tmp_out_offset), tmp_out)) > 0) {
+        fwrite(buf, 1, nb, out);
+        tmp_out_offset -= nb;
+      }
+      fclose(tmp_out);
+    }
+    unlink(tmp_fname);
+  }
+}
+
+/* -C, one tbk per selected column from a single pass over the bed. Rows
+   are read in batches, split in place, and the columns of a batch are
+   encoded in parallel, each column by one thread into its own output. */
+#define PACK_BATCH 4096
+
+typedef struct pack_column_t {
+  int col;                      /* 0-based, the first of the units */
+  char *sname;
+  char *fname;
+  uint64_t dtype;
+  FILE *out;
+  FILE *tmp_out;                /* strings of stringd */
+  char *tmp_fname;
+  uint64_t tmp_out_offset;
+  uint8_t aux;                  /* sub-byte encoding */
+  tbk_sparse_writer_t *sparse;  /* if DT_SPARSE */
+  tbk_split_writer_t *split;    /* if DT_SPLIT */
+  tbk_zone_writer_t *zone;      /* --zonemap */
+  char *buf;                    /* output buffer */
+} pack_column_t;
+
+typedef struct pack_batch_t {
+  char **fields;                /* n x nf, the fields of each row */
+  int n, nf;
+  int64_t n0;                   /* rows before this batch */
+  pack_column_t *cols;
+  int n_cols;
+  int n_threads;
+  conf_pack_t *conf;
+} pack_batch_t;
+
+typedef struct pack_worker_t {
+  pack_batch_t *batch;
+  int t;
+} pack_worker_t;
+
+static void *pack_columns_worker(void *arg) {
+  pack_worker_t *w = (pack_worker_t*) arg;
+  pack_batch_t *b = w->batch;
+  beddata_t bd = {{0}, 2};
+  int i, k;
+  for (k = w->t; k < b->n_cols; k += b->n_threads) {
+    pack_column_t *c = &b->cols[k];
+    for (i=0; i<b->n; ++i) {
+      bd.s[0] = b->fields[i*b->nf + c->col];
+      bd.s[1] = b->fields[i*b->nf + c->col + 1];
+      if (c->sparse) tbk_sparse_write(c->sparse, &bd, c->out, b->conf);
+      else if (c->split) tbk_split_write(c->split, &bd, c->out, b->conf);
+      else tbk_write(&bd, c->dtype, c->out, b->n0 + i, &c->aux, c->tmp_out, &c->tmp_out_offset, b->conf);
+      if (c->zone) tbk_zone_add(c->zone, &bd, b->conf);
+    }
+  }
+  return NULL;
+}
+
+static void pack_columns_batch(pack_batch_t *b) {
+  pack_worker_t *ws = calloc(b->n_threads, sizeof(pack_worker_t));
+  pthread_t *tids = calloc(b->n_threads, sizeof(pthread_t));
+  int t;
+  for (t=0; t<b->n_threads; ++t) { ws[t].batch = b; ws[t].t = t; }
+  for (t=1; t<b->n_threads; ++t)
+    if (pthread_create(&tids[t], NULL, pack_columns_worker, &ws[t]))
+      wzfatal("Cannot create thread.\n");
+  pack_columns_worker(&ws[0]);
+  for (t=1; t<b->n_threads; ++t) pthread_join(tids[t], NULL);
+  free(ws); free(tids);
+}
+
+/* "4,6,8-10,12-" to 0-based first columns, an open range runs to the last
+   column, and ranges step by the number of units per record */
+static int *parse_columns(char *spec, int units, int nfields, int *n) {
+  char **fields; int nfields_spec, i, a, b;
+  int *cols = NULL; *n = 0;
+  line_get_fields(spec, ",", &fields, &nfields_spec);
+  for (i=0; i<nfields_spec; ++i) {
+    char *dash = strchr(fields[i], '-');
+    a = atoi(fields[i]);
+    if (!dash) b = a;
+    else if (dash[1]) b = atoi(dash+1);
+    else b = nfields - units + 1;
+    if (a < 4) wzfatal("Column %s is not a data column (4 or above).\n", fields[i]);
+    for (; a <= b; a += units) {
+      if (a + units - 1 > nfields) wzfatal("Column %d is beyond the %d columns of the bed.\n", a + units - 1, nfields);
+      cols = realloc(cols, sizeof(int) * (*n + 1));
+      cols[(*n)++] = a - 1;
+    }
+  }
+  free_fields(fields, nfields_spec);
+  if (!*n) wzfatal("No column selected by %s.\n", spec);
+  return cols;
+}
+
+/* copy the next line into slot i of the batch, whose buffers are kept
+   across batches. 0 at the end of input. */
+static int pack_read_line(wzreader_t *r, char **lines, size_t *m_lines, int i) {
+  size_t len;
+  char *line = wzreader_line(r, &len);
+  if (!line) return 0;
+  if (len + 1 > m_lines[i]) {
+    m_lines[i] = len + 1 > 256 ? len + 1 : 256;
+    lines[i] = realloc(lines[i], m_lines[i]);
+  }
+  memcpy(lines[i], line, len + 1);
+  return 1;
+}
+
+/* split line in place into its first nf fields, the rest is dropped */
+static int split_fields(char *line, char **fields, int nf) {
+  int k = 0;
+  fields[k++] = line;
+  for (; *line; ++line) {
+    if (*line != '\t') continue;
+    *line = '\0';
+    if (k == nf) break;
+    fields[k++] = line + 1;
+  }
+  return k;
+}
+
+/* concatenate the column tbks into a bundle, the sample name goes after
+   the message as in tbmate bundle */
+static void pack_columns_bundle(pack_column_t *cols, int n_cols, int64_t n, char *msg, char *out_fname) {
+  FILE *out = fopen(out_fname, "wb");
+  if (!out) wzfatal("Cannot open %s to write.\n", out_fname);
+  char *buf = malloc(1<<20), extra[HDR_EXTRA];
+  size_t nb;
+  int k;
+  for (k=0; k<n_cols; ++k) {
+    if (strlen(msg) + strlen(cols[k].sname) >= HDR_EXTRA-5)
+      wzfatal("%s index and %s sname is too long. Consider shorter sample names.", msg, cols[k].sname);
+    memset(extra, 0, HDR_EXTRA);
+    strcpy(extra, msg);
+    strcpy(extra + strlen(extra) + 2, cols[k].sname);
+    tbk_write_hdr(k + 1 < n_cols ? 100 : 1, cols[k].dtype, n, extra, out);
+
+    FILE *in = fopen(cols[k].fname, "rb");
+    if (!in) wzfatal("Cannot open %s to read.\n", cols[k].fname);
+    fseek(in, HDR_TOTALBYTES, SEEK_SET);
+    while ((nb = fread(buf, 1, 1<<20, in)) > 0) fwrite(buf, 1, nb, out);
+    fclose(in);
+    unlink(cols[k].fname);
+  }
+  free(buf);
+  if (fclose(out)) wzfatal("Cannot write to %s.\n", out_fname);
+}
+
+static int pack_columns(
+  char *in_fname, char *out_path, char *spec, int bundle, int zonemap,
+  uint64_t dtype, double tol, char *msg, FILE *idx, int n_threads, conf_pack_t *conf) {
+
+  int units = (DATA_TYPE(dtype) == DT_FLOAT_INT || DATA_TYPE(dtype) == DT_FLOAT_FLOAT) ? 2 : 1;
+  wzreader_t *r = wzreader_open(in_fname);
+  char **lines = calloc(PACK_BATCH, sizeof(char*));
+  size_t *m_lines = calloc(PACK_BATCH, sizeof(size_t));
+  int i, k, n_cols = 0, nf = 0;
+
+  /* the first line decides the number of columns, '#' gives sample names */
+  char **names = NULL; int n_names = 0;
+  if (!pack_read_line(r, lines, m_lines, 0)) wzfatal("%s is empty.\n", in_fname);
+  if (lines[0][0] == '#') {
+    line_get_fields(lines[0] + 1, "\t", &names, &n_names);
+    if (!pack_read_line(r, lines, m_lines, 0)) wzfatal("%s has no data.\n", in_fname);
+  }
+  char **fields0; int nfields0;
+  line_get_fields(lines[0], "\t", &fields0, &nfields0);
+  free_fields(fields0, nfields0);
+  int *col_ids = parse_columns(spec, units, nfields0, &n_cols);
+  for (k=0; k<n_cols; ++k) nf = max(nf, col_ids[k] + units);
+  nf = max(nf, 3);
+
+  uint64_t *dtypes = malloc(sizeof(uint64_t) * n_cols);
+  for (k=0; k<n_cols; ++k) dtypes[k] = dtype;
+  if (DATA_TYPE(dtype) == DT_NA) {
+    pack_infer(in_fname, col_ids, n_cols, tol, !(dtype & (DT_SPARSE | DT_SPLIT)), dtypes);
+    for (k=0; k<n_cols; ++k) dtypes[k] |= dtype & (DT_SPARSE | DT_SPLIT);
+  }
+
+  if (!bundle) mkdir(out_path, 0755);
+  pack_column_t *cols = calloc(n_cols, sizeof(pack_column_t));
+  for (k=0; k<n_cols; ++k) {
+    pack_column_t *c = &cols[k];
+    c->col = col_ids[k];
+    c->dtype = dtypes[k];
+    if (c->col < n_names && names[c->col][0]) c->sname = strdup(names[c->col]);
+    else { c->sname = malloc(16); sprintf(c->sname, "col%d", c->col + 1); }
+    c->fname = malloc(strlen(out_path) + strlen(c->sname) + 32);
+    if (bundle) sprintf(c->fname, "%s_tmp_%d", out_path, k);
+    else sprintf(c->fname, "%s/%s.tbk", out_path, c->sname);
+    if (!(c->out = fopen(c->fname, "wb"))) wzfatal("Cannot open %s to write.\n", c->fname);
+    c->buf = malloc(1<<16);
+    setvbuf(c->out, c->buf, _IOFBF, 1<<16);
+    tbk_write_hdr(1, c->dtype, 0, msg, c->out);
+    if (c->dtype & DT_SPARSE) c->sparse = tbk_sparse_writer_init(c->dtype, c->out, conf);
+    if (c->dtype & DT_SPLIT) c->split = tbk_split_writer_init(c->dtype, c->fname);
+    if (zonemap) c->zone = tbk_zone_writer_init(c->dtype, conf);
+    if (DATA_TYPE(c->dtype) == DT_STRINGD) {
+      c->tmp_fname = malloc(strlen(c->fname) + 10);
+      strcpy(c->tmp_fname, c->fname); strcat(c->tmp_fname, "_tmp_");
+      if (!(c->tmp_out = fopen(c->tmp_fname, "wb"))) wzfatal("Cannot open %s to write.\n", c->tmp_fname);
+    }
+  }
+  free(col_ids); free(dtypes);
+  if (n_threads > n_cols) n_threads = n_cols;
+  if (n_threads < 1) n_threads = 1;
+
+  pack_batch_t b = {0};
+  b.fields = calloc((size_t) PACK_BATCH * nf, sizeof(char*));
+  b.nf = nf; b.cols = cols; b.n_cols = n_cols; b.n_threads = n_threads; b.conf = conf;
+  int p = prof_enter(PROF_PARSE);
+  int pending = 1;              /* lines[0] is read but not split */
+  while (1) {
+    for (b.n = 0; b.n < PACK_BATCH; ) {
+      if (!pending && !pack_read_line(r, lines, m_lines, b.n)) break;
+      pending = 0;
+      if (lines[b.n][0] == '\0' || lines[b.n][0] == '#') continue;
+      char **f = b.fields + (size_t) b.n * nf;
+      if (split_fields(lines[b.n], f, nf) < nf)
+        wzfatal("Row %"PRId64" has fewer than %d columns.\n", b.n0 + b.n + 1, nf);
+      if (idx) fprintf(idx, "%s\t%s\t%s\t%"PRId64"\n", f[0], f[1], f[2], b.n0 + b.n);
+      b.n++;
+    }
+    if (b.n == 0) break;
+
+    prof_enter(PROF_WRITE);
+    pack_columns_batch(&b);
+    PROF_COUNT(n_rows, b.n);
+    PROF_COUNT(n_cells, (int64_t) b.n * n_cols);
+    b.n0 += b.n;
+    prof_enter(PROF_PARSE);
+  }
+  prof_enter(PROF_WRITE);
+  if (b.n0 == 0) wzfatal("%s has no data.\n", in_fname);
+
+  for (k=0; k<n_cols; ++k) {
+    pack_column_t *c = &cols[k];
+    if (c->sparse) tbk_sparse_writer_end(c->sparse, c->out, b.n0);
+    else if (c->split) tbk_split_writer_end(c->split, c->out, b.n0);
+    else tbk_write_end(c->dtype, c->out, b.n0, &c->aux, c->tmp_out, c->tmp_fname, c->tmp_out_offset);
+    if (fclose(c->out)) wzfatal("Cannot write to %s.\n", c->fname);
+    if (c->zone) tbk_zone_writer_end(c->zone, c->fname);
+  }
+  if (bundle) pack_columns_bundle(cols, n_cols, b.n0, msg, out_path);
+  fprintf(stderr, "[%s] Packed %"PRId64" rows into %d %s.\n", __func__, b.n0, n_cols,
+          bundle ? "bundled tbks" : "tbks");
+  prof_leave(p);
+
+  for (k=0; k<n_cols; ++k) {
+    free(cols[k].sname); free(cols[k].fname); free(cols[k].tmp_fname); free(cols[k].buf);
+  }
+  for (i=0; i<PACK_BATCH; ++i) free(lines[i]);
+  free(lines); free(m_lines); free(cols); free(b.fields);
+  if (names) free_fields(names, n_names);
+  wzreader_close(r);
+  return 0;
+}
+
+/* -i: each row is placed at the offset of its chromosome, start and end
+   in the index, so the input can be in any order and index rows it lacks
+   are left NA. The index is loaded once through its coordinate cache and
+   shared by all the input and output pairs, which are packed in parallel
+   into preallocated, mmapped tbks. */
+typedef struct pack_scatter_t {
+  tbk_cache_t *cache;
+  tbx_t *tbx;
+  int64_t nmax;
+  char **pairs;                 /* in.bed, out.tbk, ... */
+  int n_pairs;
+  uint64_t dtype;
+  double tol;
+  char *msg;
+  conf_pack_t *conf;
+  int *next;                    /* next pair to pack */
+} pack_scatter_t;
+
+static void pack_scatter1(pack_scatter_t *ps, char *in_fname, char *out_fname) {
+
+  char *spool_fname = NULL;
+  uint64_t dtype = ps->dtype;
+  if (DATA_TYPE(dtype) == DT_NA) {
+    int col = 3;
+    if (strcmp(in_fname, "-") == 0) in_fname = spool_fname = pack_spool_stdin(out_fname);
+    pack_infer(in_fname, &col, 1, ps->tol, 0, &dtype);
+    fprintf(stderr, "[%s] %s: inferred data type: %s.\n", __func__, in_fname, dtype_str(dtype));
+  }
+
+  int unit = unit_size(dtype);
+  uint8_t *na = malloc(max(unit, 16));
+  beddata_t bd = {{".", "."}, 2};
+  if (tbk_encode1(&bd, dtype, na, ps->conf) < 0)
+    wzfatal("Data type %s cannot be packed with -i.\n", dtype_str(dtype));
+
+  FILE *out = fopen(out_fname, "w+b"); /* read access for the mapping */
+  if (!out) wzfatal("Cannot open %s to write.\n", out_fname);
+  tbk_write_hdr(1, dtype, ps->nmax, ps->msg, out);
+  fflush(out);
+  size_t size = HDR_TOTALBYTES + ps->nmax * unit;
+  if (ftruncate(fileno(out), size)) wzfatal("Cannot write to %s.\n", out_fname);
+  uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+  if (map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", out_fname);
+  uint8_t *data = map + HDR_TOTALBYTES;
+
+  /* NA everywhere, doubling the filled part */
+  int64_t filled = min(ps->nmax, 1);
+  if (filled) memcpy(data, na, unit);
+  for (; filled < ps->nmax; filled *= 2)
+    memcpy(data + filled * unit, data, min(filled, ps->nmax - filled) * unit);
+
+  int nf = DATA_TYPE(dtype) == DT_FLOAT_INT || DATA_TYPE(dtype) == DT_FLOAT_FLOAT ? 5 : 4;
+  char *f[5], *line, *last_chrom = NULL; size_t len;
+  int64_t n = 0, n_placed = 0, n_end = 0;
+  int tid = -1;
+  wzreader_t *r = wzreader_open(in_fname);
+  while ((line = wzreader_line(r, &len))) {
+    if (line[0] == '\0' || line[0] == '#') continue;
+    n++;
+    if (split_fields(line, f, nf) < nf)
+      wzfatal("Row %"PRId64" of %s has fewer than %d columns.\n", n, in_fname, nf);
+    if (!last_chrom || strcmp(f[0], last_chrom)) {
+      free(last_chrom); last_chrom = strdup(f[0]);
+      tid = tbx_name2id(ps->tbx, f[0]);
+    }
+    int64_t off = tbk_cache_find(ps->cache, tid, atoi(f[1]), atoi(f[2]));
+    if (off < 0) { n_end += off == -2; continue; }
+    bd.s[0] = f[3]; bd.s[1] = f[4];
+    tbk_encode1(&bd, dtype, data + off * unit, ps->conf);
+    n_placed++;
+  }
+  wzreader_close(r);
+  fprintf(stderr, "[%s] %s: placed %"PRId64" rows, %"PRId64" not in the index, %"PRId64" of which "
+          "start at an index row with a different end.\n", __func__, out_fname, n_placed, n - n_placed, n_end);
+
+  if (munmap(map, size) || fclose(out)) wzfatal("Cannot write to %s.\n", out_fname);
+  free(last_chrom); free(na);
+  if (spool_fname) { unlink(spool_fname); free(spool_fname); }
+}
+
+static void *pack_scatter_worker(void *arg) {
+  pack_scatter_t *ps = (pack_scatter_t*) arg;
+  int k;
+  while ((k = __sync_fetch_and_add(ps->next, 1)) < ps->n_pairs)
+    pack_scatter1(ps, ps->pairs[2*k], ps->pairs[2*k+1]);
+  return NULL;
+}
+
+static int pack_scatter(char *idx_fname, char **pairs, int n_pairs, uint64_t dtype,
+                        double tol, char *msg, int n_threads, conf_pack_t *conf) {
+
+  tbx_t *tbx = tbx_index_load(idx_fname);
+  if (!tbx) wzfatal("Could not load .tbi/.csi index of %s\n", idx_fname);
+  tbk_cache_t *cache = tbk_cache_open(idx_fname, tbx, 1);
+  if (!cache) wzfatal("Cannot build the cache of %s.\n", idx_fname);
+
+  int64_t i, nmax = 0;
+  for (i=0; i<cache->n_rows; ++i)
+    if (cache->off[i] >= nmax) nmax = cache->off[i] + 1;
+
+  int next = 0;
+  pack_scatter_t ps = {cache, tbx, nmax, pairs, n_pairs, dtype, tol, msg, conf, &next};
+  n_threads = max(1, min(n_threads, n_pairs));
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  for (i=0; i<n_threads; ++i) pthread_create(&threads[i], NULL, pack_scatter_worker, &ps);
+  for (i=0; i<n_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+
+  tbk_cache_close(cache);
+  tbx_destroy(tbx);
+  return 0;
+}
+
 int main_pack(int argc, char *argv[]) {
 
   conf_pack_t conf = {0};
@@ -199,10 +755,32 @@ int main_pack(int argc, char *argv[]) {
   if (argc<2) return usage(&conf);
   uint64_t dtype = DT_NA;
   char *idx_path = NULL;
+  char *index_fname = NULL;
   char msg[HDR_EXTRA] = {0};
   uint64_t max_str_length = 64;
-  while ((c = getopt(argc, argv, "s:x:m:n:h"))>=0) {
+  static const struct option loptions[] = {
+    {"profile", no_argument, NULL, 1003},
+    {"bundle", no_argument, NULL, 1004},
+    {"tol", required_argument, NULL, 1005},
+    {"sparse", no_argument, NULL, 1006},
+    {"split", no_argument, NULL, 1007},
+    {"zonemap", no_argument, NULL, 1008},
+    {NULL, 0, NULL, 0}
+  };
+  char *columns = NULL;
+  int bundle = 0, n_threads = 1, zonemap = 0;
+  uint64_t layout = 0;          /* DT_SPARSE or DT_SPLIT */
+  double tol = -1;
+  while ((c = getopt_long(argc, argv, "s:x:i:m:n:C:@:h", loptions, NULL))>=0) {
     switch (c) {
+    case 1003: tbk_prof_start(); break;
+    case 1004: bundle = 1; break;
+    case 1005: tol = atof(optarg); break;
+    case 1006: layout |= DT_SPARSE; break;
+    case 1007: layout |= DT_SPLIT; break;
+    case 1008: zonemap = 1; break;
+    case 'C': columns = optarg; break;
+    case '@': n_threads = atoi(optarg); break;
     case 's':
       if (strcmp(optarg, "int1") == 0)             dtype = DT_INT1;
       else if (strcmp(optarg, "int2") == 0)        dtype = DT_INT2;
@@ -216,11 +794,13 @@ int main_pack(int argc, char *argv[]) {
       else if (strcmp(optarg, "ones") == 0)        dtype = DT_ONES;
       else if (strcmp(optarg, "float.int") == 0)   dtype = DT_FLOAT_INT;
       else if (strcmp(optarg, "float.float") == 0) dtype = DT_FLOAT_FLOAT;
+      else if (strcmp(optarg, "beta8") == 0)       dtype = DT_BETA8;
+      else if (strcmp(optarg, "half") == 0)        dtype = DT_HALF;
       else wzfatal("Unrecognized data type: %s.\n", optarg);
       break;
     case 'x': idx_path = strdup(optarg); break;
     case 'n': conf.nan = atof(optarg); break;
-    case 'i': max_str_length = atol(optarg); break;
+    case 'i': index_fname = strdup(optarg); break;
     case 'm': {
       if (strlen(optarg) > HDR_EXTRA - 1) wzfatal("Message cannot be over %d in length.", HDR_EXTRA);
       strcpy(msg, optarg);
@@ -234,20 +814,63 @@ int main_pack(int argc, char *argv[]) {
   if (dtype == DT_STRINGF) {
     dtype |= (max_str_length << 8);
   }
+  if (layout == (DT_SPARSE | DT_SPLIT)) wzfatal("--sparse and --split cannot be combined.\n");
+  if (zonemap && bundle) wzfatal("--zonemap is not supported with --bundle.\n");
+  dtype |= layout;
 
   if (optind + 2 > argc) { 
     usage(&conf); 
     wzfatal("Please supply input and output file.\n"); 
   }
 
-  bed_file_t *bed = init_bed_file(argv[optind++]);
+  if (index_fname) {
+    if (columns || idx_path || layout || zonemap)
+      wzfatal("-i cannot be used with -C, -x, --sparse, --split or --zonemap.\n");
+    if ((argc - optind) % 2) wzfatal("Please supply pairs of input and output file with -i.\n");
+    int ret = pack_scatter(index_fname, argv + optind, (argc - optind) / 2, dtype, tol, msg, n_threads, &conf);
+    free(index_fname);
+    tbk_prof_report("pack", stderr);
+    return ret;
+  }
+
+  FILE *idx = NULL;
+  if (idx_path) {
+    if (strcmp(idx_path, "stdout") == 0) {
+      idx = stdout;
+    } else if (strcmp(idx_path, "stderr") == 0) {
+      idx = stderr;
+    } else {
+      idx = fopen(idx_path, "w");
+    }
+  }
+
+  char *in_fname = argv[optind++], *spool_fname = NULL;
+  if (DATA_TYPE(dtype) == DT_NA && strcmp(in_fname, "-") == 0)
+    in_fname = spool_fname = pack_spool_stdin(argv[optind]);
+
+  if (columns) {
+    int ret = pack_columns(in_fname, argv[optind], columns, bundle, zonemap, dtype, tol, msg, idx, n_threads, &conf);
+    if (idx) { fclose(idx); free(idx_path); }
+    if (spool_fname) { unlink(spool_fname); free(spool_fname); }
+    tbk_prof_report("pack", stderr);
+    return ret;
+  }
+
+  if (DATA_TYPE(dtype) == DT_NA) {
+    int col = 3;
+    pack_infer(in_fname, &col, 1, tol, !layout, &dtype);
+    fprintf(stderr, "[%s] Inferred data type: %s.\n", __func__, dtype_str(dtype));
+    dtype |= layout;
+  }
+
+  bed_file_t *bed = init_bed_file(in_fname);
   FILE *tbk_out = NULL;
   if (optind < argc) tbk_out = fopen(argv[optind], "wb");
 
   char *tmp_fname = NULL;       /* temporary file holding variable length strings */
   FILE *tmp_out = NULL;
   uint64_t tmp_out_offset = 0;
-  if (dtype == DT_STRINGD) {
+  if (DATA_TYPE(dtype) == DT_STRINGD) {
     tmp_fname = calloc(strlen(argv[optind])+10, 1);
     strcpy(tmp_fname, argv[optind]);
     strcat(tmp_fname, "_tmp_");
@@ -255,63 +878,40 @@ int main_pack(int argc, char *argv[]) {
   }
 
   bed1_t *b;
-  if (dtype == DT_FLOAT_FLOAT || dtype == DT_FLOAT_INT) {
+  if (DATA_TYPE(dtype) == DT_FLOAT_FLOAT || DATA_TYPE(dtype) == DT_FLOAT_INT) {
     b = init_bed1(init_data, (void*) 2);
   } else {
     b = init_bed1(init_data, (void*) 1);
   }
 
-  FILE *idx = NULL;
-  if (idx_path) {
-    if (strcmp(idx_path, "stdout") == 0) {
-      idx = stdout;
-    } else if (strcmp(idx_path, "stderr") == 0) {
-      idx = stderr;
-    } else {
-      idx = fopen(idx_path, "w");
-    }
-  }
-
   int64_t n = 0;
-  beddata_t samples[1000] = {0};
-  int64_t i;
-  uint8_t aux;                  /* sub-byte encoding */
+  uint8_t aux = 0;              /* sub-byte encoding */
+  tbk_sparse_writer_t *sw = NULL;
+  tbk_split_writer_t *spw = NULL;
+  if (tbk_out) tbk_write_hdr(1, dtype, 0, msg, tbk_out);
+  if (tbk_out && (dtype & DT_SPARSE)) sw = tbk_sparse_writer_init(dtype, tbk_out, &conf);
+  if (tbk_out && (dtype & DT_SPLIT)) spw = tbk_split_writer_init(dtype, argv[optind]);
+  tbk_zone_writer_t *zw = NULL;
+  if (tbk_out && zonemap) zw = tbk_zone_writer_init(dtype, &conf);
+  int p = prof_enter(PROF_PARSE);
   while (bed_read1(bed, b, parse_data)) {
 
+    prof_enter(PROF_WRITE);
+    PROF_COUNT(n_rows, 1);
+
     if (idx) {
       fprintf(idx, "%s\t%"PRId64"\t%"PRId64"\t%"PRId64"\n", b->seqname, b->beg, b->end, n);
     }
-    
-    if (n < 1000) {
-      samples[n++] = *((beddata_t*) b->data);
-      continue;
-    }
-
-    if (n == 1000) {
-      if (dtype == DT_NA) dtype = data_type(samples, n);
-      if (tbk_out) tbk_write_hdr(1, dtype, n, msg, tbk_out);
-      for(i=0; i<n; ++i) {
-        if (tbk_out) tbk_write(&samples[i], dtype, tbk_out, i, &aux, tmp_out, &tmp_out_offset, &conf);
-        free_data(&samples[i]);
-      }
-    }
-    if (tbk_out) tbk_write(b->data, dtype, tbk_out, n, &aux, tmp_out, &tmp_out_offset, &conf);
+    if (sw) tbk_sparse_write(sw, b->data, tbk_out, &conf);
+    else if (spw) tbk_split_write(spw, b->data, tbk_out, &conf);
+    else if (tbk_out) tbk_write(b->data, dtype, tbk_out, n, &aux, tmp_out, &tmp_out_offset, &conf);
+    if (zw) tbk_zone_add(zw, b->data, &conf);
     free_data(b->data);
     n++;
+    prof_enter(PROF_PARSE);
   }
+  prof_enter(PROF_WRITE);
 
-  /* if no more than 1000 records */
-  if (n <= 1000) {
-    if (dtype == DT_NA) dtype = data_type(samples, n);
-    if (tbk_out) tbk_write_hdr(1, dtype, n, msg, tbk_out);
-    for(i=0; i<n; ++i) {
-      if (tbk_out) tbk_write(&samples[i], dtype, tbk_out, i, &aux, tmp_out, &tmp_out_offset, &conf);
-      free_data(&samples[i]);
-    }
-  }
-
-  if (dtype == DT_INT2) { if (tbk_out) fwrite(&aux, 1, 1, tbk_out); aux=0; }
-  
   free_bed1(b, free_data);
   free_bed_file(bed);
   if (idx) {
@@ -319,28 +919,16 @@ int main_pack(int argc, char *argv[]) {
     free(idx_path);
   }
 
-  /* the actual size */
-  fseek(tbk_out, HDR_NMAX0, SEEK_SET);
-  fwrite(&n,     HDR_NMAX, 1, tbk_out);
-
-  if (tmp_out) {
-    fclose(tmp_out);
-
-    /* exit(1); */
-    tmp_out = fopen(tmp_fname, "rb");
-    fseek(tbk_out, 0, SEEK_END);
-    char data;
-    unsigned j;
-    for (j=0; j<tmp_out_offset; ++j) {
-      fread(&data, 1, 1, tmp_out);
-      fwrite(&data, 1, 1, tbk_out);
-    }
-    fclose(tmp_out);
-    unlink(tmp_fname);
-    free(tmp_fname);
-  }
+  if (sw) tbk_sparse_writer_end(sw, tbk_out, n);
+  else if (spw) tbk_split_writer_end(spw, tbk_out, n);
+  else tbk_write_end(dtype, tbk_out, n, &aux, tmp_out, tmp_fname, tmp_out_offset);
+  free(tmp_fname);
+  if (spool_fname) { unlink(spool_fname); free(spool_fname); }
 
   if (tbk_out) fclose(tbk_out);
-  
+  if (zw) tbk_zone_writer_end(zw, argv[optind]);
+  prof_leave(p);
+  tbk_prof_report("pack", stderr);
+
   return 0;
 }
@@ -0,0 +1,324 @@
+/* Reproject tbks onto another index
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* remap builds a translation table once, trans[new offset] = old offset
+ * or -1, by matching the rows of the two indices on chromosome, start and
+ * end, or with -N on a given name column as in view -P. Each tbk is then
+ * gathered through the table from its mmapped data into a dense tbk of
+ * the same data type, one block of output units at a time, with samples
+ * in parallel. Values are copied as packed, no
+ * decoding or text is involved. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+
+/* output units gathered at a time */
+#define REMAP_BLOCK (1<<16)
+
+typedef struct remap_conf_t {
+  char *out_dir;
+  char msg[HDR_EXTRA];
+  int name_col;                 /* -N, match rows on this column if >0 */
+  int n_threads;
+  conf_pack_t pconf;            /* the NA of unmatched rows */
+} remap_conf_t;
+
+typedef struct remap_t {
+  int64_t *trans;               /* old offset of each new offset, -1 if none */
+  int64_t n;                    /* new nmax */
+  int64_t max_old;              /* largest old offset used */
+  tbk_t *tbks;
+  int n_tbks;
+  remap_conf_t *conf;
+  int *next;                    /* next sample to remap */
+} remap_t;
+
+static int usage(remap_conf_t *conf) {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate remap [options] -i <new_idx.gz> -o <out_dir> [.tbk [...]]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -i        the index to remap onto, a tabix-ed bed file.\n");
+  fprintf(stderr, "    -f        the index of the tbks. If not given search for idx.gz in the\n");
+  fprintf(stderr, "              folder containing the first tbk file.\n");
+  fprintf(stderr, "    -o        output folder, one <sample>.tbk per sample.\n");
+  fprintf(stderr, "    -l        provide tbk file names in the list.\n");
+  fprintf(stderr, "    -N        match rows by the names in this column of the indices, as\n");
+  fprintf(stderr, "              view --name-col, instead of chromosome, start and end.\n");
+  fprintf(stderr, "    -n        number for rows missing from the old index [%f].\n", conf->pconf.nan);
+  fprintf(stderr, "    -m        message of the new tbks [path of the new index].\n");
+  fprintf(stderr, "    -@        number of threads [%d].\n", conf->n_threads);
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, tbks are copied as packed into dense tbks of the same data type.\n");
+  fprintf(stderr, "Builds <idx>.tbc, or <idx>.tbn with -N, for both indices if missing.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+static tbk_cache_t *remap_cache_open(const char *idx_fname, tbx_t **tbx) {
+  *tbx = tbx_index_load(idx_fname);
+  if (!*tbx) wzfatal("Could not load .tbi/.csi index of %s\n", idx_fname);
+  tbk_cache_t *c = tbk_cache_open(idx_fname, *tbx, 1);
+  if (!c) wzfatal("Cannot build the cache of %s.\n", idx_fname);
+  return c;
+}
+
+static void remap_trans_set(remap_t *rm, int64_t new_off, int64_t old_off) {
+  if (new_off < 0) return;
+  rm->trans[new_off] = old_off;
+  if (old_off > rm->max_old) rm->max_old = old_off;
+}
+
+static void remap_trans_alloc(remap_t *rm, const int64_t *off, int64_t n_rows) {
+  int64_t i;
+  rm->n = 0;
+  for (i=0; i<n_rows; ++i) if (off[i] >= rm->n) rm->n = off[i] + 1;
+  rm->trans = malloc(sizeof(int64_t) * max(1, rm->n));
+  for (i=0; i<rm->n; ++i) rm->trans[i] = -1;
+  rm->max_old = -1;
+}
+
+static void remap_trans_coord(remap_t *rm, const char *old_idx, const char *new_idx) {
+  tbx_t *old_tbx, *new_tbx;
+  tbk_cache_t *oc = remap_cache_open(old_idx, &old_tbx);
+  tbk_cache_t *nc = remap_cache_open(new_idx, &new_tbx);
+  remap_trans_alloc(rm, nc->off, nc->n_rows);
+
+  int t; int64_t i, n_found = 0, n_end = 0;
+  for (t=0; t<nc->n_seqs; ++t) {
+    int old_tid = tbx_name2id(old_tbx, nc->seqnames[t]);
+    for (i=nc->seq_beg[t]; i<nc->seq_beg[t+1]; ++i) {
+      int64_t old_off = tbk_cache_find(oc, old_tid, nc->beg[i], nc->end[i]);
+      remap_trans_set(rm, nc->off[i], old_off);
+      n_found += old_off >= 0;
+      n_end += old_off == -2;
+    }
+  }
+  fprintf(stderr, "[%s] %"PRId64" of %"PRId64" rows found in %s, %"PRId64" more start at a row with a different end.\n",
+          __func__, n_found, nc->n_rows, old_idx, n_end);
+  tbk_cache_close(oc); tbk_cache_close(nc);
+  tbx_destroy(old_tbx); tbx_destroy(new_tbx);
+}
+
+static void remap_trans_name(remap_t *rm, const char *old_idx, const char *new_idx) {
+  int name_col = rm->conf->name_col;
+  tbk_names_t *on = tbk_names_open(old_idx, name_col), *nn = tbk_names_open(new_idx, name_col);
+  if (!on || !nn) wzfatal("Cannot build the name index of %s.\n", on ? new_idx : old_idx);
+  remap_trans_alloc(rm, nn->off, nn->n_rows);
+
+  int64_t i, n_found = 0;
+  for (i=0; i<nn->n_rows; ++i) {
+    int64_t row = tbk_names_get(on, nn->pool + nn->entry[i]);
+    int64_t old_off = row >= 0 ? on->off[row] : -1;
+    remap_trans_set(rm, nn->off[i], old_off);
+    n_found += old_off >= 0;
+  }
+  fprintf(stderr, "[%s] %"PRId64" of %"PRId64" names found in %s.\n", __func__, n_found, nn->n_rows, old_idx);
+  tbk_names_close(on); tbk_names_close(nn);
+}
+
+/* dst[i] = src[trans[i]], or na, for unit-byte units. Fixed sizes let
+   the compiler turn the copy into plain loads and stores. */
+#define REMAP_GATHER(T) do {                                            \
+    const T *s = (const T*) src; T *d = (T*) dst, v; memcpy(&v, na, sizeof(T)); \
+    for (i=0; i<n; ++i) d[i] = trans[i] < 0 ? v : s[trans[i]];          \
+  } while (0)
+
+static void remap_gather(const uint8_t *src, const int64_t *trans, int n, int unit,
+                         const uint8_t *na, uint8_t *dst) {
+  int i;
+  switch (unit) {
+  case 1: REMAP_GATHER(uint8_t); break;
+  case 2: REMAP_GATHER(uint16_t); break;
+  case 4: REMAP_GATHER(uint32_t); break;
+  case 8: REMAP_GATHER(uint64_t); break;
+  default:
+    for (i=0; i<n; ++i)
+      memcpy(dst + (int64_t) i*unit, trans[i] < 0 ? na : src + trans[i]*unit, unit);
+  }
+}
+
+static void remap_sample(remap_t *rm, tbk_t *tbk) {
+
+  remap_conf_t *conf = rm->conf;
+  int unit = unit_size(tbk->dtype);
+  uint8_t *na = malloc(max(unit, 16));
+  beddata_t bd = {{".", "."}, 2};
+  tbk_encode1(&bd, tbk->dtype, na, &conf->pconf);
+
+  /* the data of the sample, mapped from a page boundary */
+  int64_t beg = tbk->offset_sample_beg + HDR_TOTALBYTES;
+  int64_t map_beg = beg & ~((int64_t) sysconf(_SC_PAGESIZE) - 1);
+  size_t map_size = beg - map_beg + tbk->nmax * unit;
+  int fd = open(tbk->tbf->fname, O_RDONLY);
+  if (fd < 0) wzfatal("Cannot open %s.\n", tbk->tbf->fname);
+  uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, map_beg);
+  close(fd);
+  if (map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", tbk->tbf->fname);
+  madvise(map, map_size, MADV_WILLNEED);
+  const uint8_t *src = map + (beg - map_beg);
+
+  char *out_fname = malloc(strlen(conf->out_dir) + strlen(tbk->sname) + 6);
+  sprintf(out_fname, "%s/%s.tbk", conf->out_dir, tbk->sname);
+  FILE *out = fopen(out_fname, "wb");
+  if (!out) wzfatal("Cannot open %s to write.\n", out_fname);
+  tbk_write_hdr(1, tbk->dtype, rm->n, conf->msg, out);
+
+  uint8_t *buf = malloc((size_t) REMAP_BLOCK * unit);
+  int64_t i;
+  for (i=0; i<rm->n; i+=REMAP_BLOCK) {
+    int n = min(REMAP_BLOCK, rm->n - i);
+    remap_gather(src, rm->trans + i, n, unit, na, buf);
+    fwrite(buf, unit, n, out);
+  }
+  if (fclose(out)) wzfatal("Cannot write to %s.\n", out_fname);
+
+  munmap(map, map_size);
+  free(buf); free(na); free(out_fname);
+}
+
+static int remap_dtype_ok(uint64_t dtype) {
+  switch(DATA_TYPE(dtype)) {
+  case DT_INT32: case DT_FLOAT: case DT_DOUBLE: case DT_STRINGF: case DT_ONES:
+  case DT_FLOAT_INT: case DT_FLOAT_FLOAT: case DT_BETA8: case DT_HALF: return 1;
+  default: return 0;
+  }
+}
+
+static void *remap_worker(void *arg) {
+  remap_t *rm = (remap_t*) arg;
+  int k;
+  while ((k = __sync_fetch_and_add(rm->next, 1)) < rm->n_tbks)
+    remap_sample(rm, &rm->tbks[k]);
+  return NULL;
+}
+
+static int cmp_str(const void *a, const void *b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* outputs are named by sample, two inputs of one name would collide */
+static void remap_check_snames(tbk_t *tbks, int n_tbks, const char *out_dir) {
+  char **names = malloc(sizeof(char*) * max(n_tbks, 1));
+  int i;
+  for (i=0; i<n_tbks; ++i) names[i] = tbks[i].sname;
+  qsort(names, n_tbks, sizeof(char*), cmp_str);
+  for (i=1; i<n_tbks; ++i)
+    if (strcmp(names[i-1], names[i]) == 0)
+      wzfatal("More than one tbk is named %s, all would be written to %s/%s.tbk.\n", names[i], out_dir, names[i]);
+  free(names);
+}
+
+int main_remap(int argc, char *argv[]) {
+
+  remap_conf_t conf = {0};
+  conf.pconf.nan = -1.0;
+  conf.n_threads = 1;
+
+  int c;
+  if (argc<2) return usage(&conf);
+
+  char *new_idx = NULL, *old_idx = NULL;
+  char *tbk_fname_list = NULL;
+  int msg_set = 0;
+  while ((c = getopt(argc, argv, "i:f:o:l:n:m:@:N:h"))>=0) {
+    switch (c) {
+    case 'i': new_idx = strdup(optarg); break;
+    case 'f': old_idx = strdup(optarg); break;
+    case 'o': conf.out_dir = strdup(optarg); break;
+    case 'l': tbk_fname_list = strdup(optarg); break;
+    case 'N':
+      if ((conf.name_col = atoi(optarg)) < 1) wzfatal("Invalid name column: %s.\n", optarg);
+      break;
+    case 'n': conf.pconf.nan = atof(optarg); break;
+    case 'm': {
+      if (strlen(optarg) > HDR_EXTRA - 1) wzfatal("Message cannot be over %d in length.", HDR_EXTRA);
+      strcpy(conf.msg, optarg); msg_set = 1;
+      break;
+    }
+    case '@': conf.n_threads = atoi(optarg); break;
+    case 'h': return usage(&conf); break;
+    default: usage(&conf); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+
+  if (!new_idx) { usage(&conf); wzfatal("Please supply the new index with -i.\n"); }
+  if (!conf.out_dir) { usage(&conf); wzfatal("Please supply the output folder with -o.\n"); }
+  if (!msg_set) {               /* so view finds the new index */
+    char path[PATH_MAX];
+    if (!realpath(new_idx, path)) wzfatal("Cannot find %s.\n", new_idx);
+    if (strlen(path) > HDR_EXTRA - 1) wzfatal("Path of %s is too long for the message.\n", new_idx);
+    strcpy(conf.msg, path);
+  }
+
+  int n_tbks = 0; tbk_t *tbks = NULL;
+  int n_tbfs = 0; tbf_t *tbfs = NULL;
+  parse_tbf_from_argument(argc, argv, optind, &tbfs, &n_tbfs);
+  parse_tbf_fname_list(tbk_fname_list, &tbfs, &n_tbfs);
+  int i;
+  for (i=0; i<n_tbfs; ++i) parse_tbk_from_tbf(&tbfs[i], &tbks, &n_tbks);
+  if (!n_tbks) { usage(&conf); wzfatal("Please supply tbk file.\n"); }
+  for (i=0; i<n_tbks; ++i) {
+    if (tbks[i].sparse || tbks[i].split || !remap_dtype_ok(tbks[i].dtype))
+      wzfatal("%s: remap needs a dense tbk of a fixed-width data type.\n", tbks[i].sname);
+  }
+  remap_check_snames(tbks, n_tbks, conf.out_dir);
+  infer_idx(tbks, n_tbks, &old_idx);
+  mkdir(conf.out_dir, 0755);
+
+  int next = 0;
+  remap_t rm = {0};
+  rm.tbks = tbks; rm.n_tbks = n_tbks; rm.conf = &conf; rm.next = &next;
+  if (conf.name_col) remap_trans_name(&rm, old_idx, new_idx);
+  else remap_trans_coord(&rm, old_idx, new_idx);
+  for (i=0; i<n_tbks; ++i) {
+    if (rm.max_old >= tbks[i].nmax)
+      wzfatal("Error: %s has %"PRId64" rows, offset %"PRId64" is out of range. Wrong idx file?\n",
+              tbks[i].sname, tbks[i].nmax, rm.max_old);
+  }
+
+  int n_threads = max(1, min(conf.n_threads, n_tbks));
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  for (i=0; i<n_threads; ++i) pthread_create(&threads[i], NULL, remap_worker, &rm);
+  for (i=0; i<n_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+  fprintf(stderr, "[%s] Remapped %d tbks onto %"PRId64" rows.\n", __func__, n_tbks, rm.n);
+
+  free(rm.trans);
+  if (n_tbfs > 0) {for (i=0; i<n_tbfs; ++i) tbf_close(&tbfs[i]); free(tbfs);}
+  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) free(tbks[i].sname); free(tbks);}
+  free(new_idx); free(old_idx); free(conf.out_dir); free(tbk_fname_list);
+  return 0;
+}
@@ -0,0 +1,158 @@
+/* Sparse tbk, presence bitmap with a rank index
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* Data of a sparse tbk (dtype | DT_SPARSE), after the 8192-byte header:
+ *
+ *   8 bytes   number of present rows, n_present
+ *   8 bytes   number of stored bitmap words, n_words
+ *   8 bytes   the unit of an absent row, zero-padded
+ *   unit x n_present          the present units in row order
+ *   16 bytes x (n_super+1)    per superblock of 512 rows, the present rows
+ *                             before it (int64) and its first word in the
+ *                             bitmap (int64), -1 if it has no present row.
+ *                             The last entry closes the directory.
+ *   8 bytes x n_words         the presence bits of the non-empty
+ *                             superblocks, 8 words each, row i at bit i%64
+ *
+ * A row is absent if its unit equals the unit packed for "." (conf.nan),
+ * with a coverage of 0 for float.int, so reading it back gives what the
+ * dense tbk would. A stretch of NA
+ * costs 16 bytes per 512 rows, and the rank of a row is the superblock
+ * count plus at most 8 popcounts. The directory and the bitmap are used
+ * in place through mmap, the values are read as in a dense tbk. */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tbmate.h"
+
+struct tbk_sparse_writer_t {
+  uint64_t dtype;
+  int usize;
+  uint8_t fill[8];
+  uint8_t buf[8];
+  int64_t n;                    /* rows added */
+  int64_t n_present;
+  int64_t sb_rank;              /* present rows before the current superblock */
+  uint64_t sb[8];               /* words of the current superblock */
+  int64_t *dir;
+  int64_t n_dir, m_dir;
+  uint64_t *words;
+  int64_t n_words, m_words;
+};
+
+int dtype_sparse_ok(uint64_t dtype) {
+  switch(DATA_TYPE(dtype)) {
+  case DT_INT32: case DT_FLOAT: case DT_DOUBLE: case DT_ONES:
+  case DT_FLOAT_INT: case DT_FLOAT_FLOAT: case DT_BETA8: case DT_HALF: return 1;
+  default: return 0;
+  }
+}
+
+tbk_sparse_t *tbk_sparse_open(tbk_t *tbk) {
+  int fd = fileno(tbk->tbf->fh);
+  int64_t beg = tbk->offset_sample_beg + HDR_TOTALBYTES, cnt[2];
+  tbk_sparse_t *sp = calloc(1, sizeof(tbk_sparse_t));
+  if (pread(fd, cnt, 16, beg) != 16 || pread(fd, sp->fill, 8, beg + 16) != 8)
+    wzfatal("%s is truncated.\n", tbk->tbf->fname);
+  sp->n_present = cnt[0];
+  sp->values = SPARSE_PREAMBLE;
+
+  /* mmap from the page holding the directory to the end of the bitmap */
+  int64_t n_super = (tbk->nmax + (1<<SPARSE_SB_SHIFT) - 1) >> SPARSE_SB_SHIFT;
+  int64_t dir_at = beg + SPARSE_PREAMBLE + cnt[0] * unit_size(tbk->dtype);
+  int64_t page = sysconf(_SC_PAGESIZE), map_at = dir_at / page * page;
+  sp->map_size = dir_at - map_at + (n_super + 1) * 16 + cnt[1] * 8;
+  sp->map = mmap(NULL, sp->map_size, PROT_READ, MAP_SHARED, fd, map_at);
+  if (sp->map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", tbk->tbf->fname);
+  sp->dir = (const int64_t*) ((char*) sp->map + (dir_at - map_at));
+  sp->words = (const uint64_t*) (sp->dir + (n_super + 1) * 2);
+  return sp;
+}
+
+tbk_sparse_writer_t *tbk_sparse_writer_init(uint64_t dtype, FILE *out, conf_pack_t *conf) {
+  if (!dtype_sparse_ok(dtype)) wzfatal("Data type %d cannot be sparse.\n", DATA_TYPE(dtype));
+  tbk_sparse_writer_t *sw = calloc(1, sizeof(tbk_sparse_writer_t));
+  sw->dtype = dtype;
+  beddata_t bd = {{".", DATA_TYPE(dtype) == DT_FLOAT_INT ? "0" : "."}, 2};
+  sw->usize = tbk_encode1(&bd, dtype, sw->fill, conf);
+  uint8_t zero[SPARSE_PREAMBLE] = {0};
+  fwrite(zero, SPARSE_PREAMBLE, 1, out);  /* set by tbk_sparse_writer_end */
+  return sw;
+}
+
+/* close the superblock in sw->sb, empty ones keep no words */
+static void sparse_flush_sb(tbk_sparse_writer_t *sw) {
+  int j, any = 0;
+  for (j=0; j<8; ++j) any |= sw->sb[j] != 0;
+  if (sw->n_dir + 2 > sw->m_dir) {
+    sw->m_dir = sw->m_dir ? sw->m_dir * 2 : 1024;
+    sw->dir = realloc(sw->dir, sizeof(int64_t) * sw->m_dir);
+  }
+  sw->dir[sw->n_dir++] = sw->sb_rank;
+  sw->dir[sw->n_dir++] = any ? sw->n_words : -1;
+  sw->sb_rank = sw->n_present;
+  if (!any) return;
+  if (sw->n_words + 8 > sw->m_words) {
+    sw->m_words = sw->m_words ? sw->m_words * 2 : 1024;
+    sw->words = realloc(sw->words, sizeof(uint64_t) * sw->m_words);
+  }
+  memcpy(sw->words + sw->n_words, sw->sb, sizeof(sw->sb));
+  sw->n_words += 8;
+  memset(sw->sb, 0, sizeof(sw->sb));
+}
+
+/* rows are added in order, absent ones only set no bit */
+void tbk_sparse_write(tbk_sparse_writer_t *sw, beddata_t *bd, FILE *out, conf_pack_t *conf) {
+  int64_t i = sw->n++;
+  tbk_encode1(bd, sw->dtype, sw->buf, conf);
+  if (memcmp(sw->buf, sw->fill, sw->usize)) {
+    sw->sb[(i >> 6) & 7] |= 1ULL << (i & 63);
+    fwrite(sw->buf, sw->usize, 1, out);
+    sw->n_present++;
+  }
+  if (((i + 1) & ((1<<SPARSE_SB_SHIFT) - 1)) == 0) sparse_flush_sb(sw);
+}
+
+/* append the directory and the bitmap, then set nmax and the preamble.
+   Frees sw, does not close out. */
+void tbk_sparse_writer_end(tbk_sparse_writer_t *sw, FILE *out, int64_t n) {
+  if (n != sw->n) wzfatal("Sparse tbk expects %"PRId64" rows, got %"PRId64".\n", n, sw->n);
+  if (n & ((1<<SPARSE_SB_SHIFT) - 1)) sparse_flush_sb(sw);
+  sparse_flush_sb(sw);          /* the closing entry, n_present and no words */
+
+  fwrite(sw->dir, sizeof(int64_t), sw->n_dir, out);
+  fwrite(sw->words, sizeof(uint64_t), sw->n_words, out);
+  fseek(out, HDR_NMAX0, SEEK_SET);
+  fwrite(&n, HDR_NMAX, 1, out);
+  fseek(out, HDR_TOTALBYTES, SEEK_SET);
+  fwrite(&sw->n_present, 8, 1, out);
+  fwrite(&sw->n_words, 8, 1, out);
+  fwrite(sw->fill, 8, 1, out);
+
+  free(sw->dir); free(sw->words); free(sw);
+}
@@ -0,0 +1,175 @@
+/* Split tbk, the two values of float.int and float.float stored apart
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* Data of a split float.int or float.float tbk (dtype | DT_SPLIT), after
+ * the 8192-byte header:
+ *
+ *   4 bytes x nmax            the first value (float) of each row
+ *
+ * then for float.float
+ *
+ *   4 bytes x nmax            the second value (float) of each row
+ *
+ * and for float.int, the coverage in frames of reference of 128 rows,
+ *
+ *   16 bytes x (n_blocks+1)   per block, the byte offset of its bits in
+ *                             the packed stream (int64), the block minimum
+ *                             (int32) and the bits per row (int32). The
+ *                             last entry has the size of the packed stream.
+ *   packed stream             per block, 128 x width bits of coverage minus
+ *                             the minimum, from the low bit of each byte,
+ *                             followed by 8 zero bytes
+ *
+ * A query of the first value reads half the bytes of the interleaved
+ * layout, and the second values are only read when asked for. Coverage
+ * below 256 takes at most a byte per row, and a block of constant
+ * coverage takes no bits. The second values are used in place through
+ * mmap. */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tbmate.h"
+
+#define SPLIT_BLOCK (1<<SPLIT_BLOCK_SHIFT)
+
+struct tbk_split_writer_t {
+  uint64_t dtype;
+  FILE *tmp;                    /* the second values or the packed stream */
+  char *tmp_fname;
+  int64_t n;                    /* rows added */
+  int32_t cov[SPLIT_BLOCK];     /* coverage of the current block */
+  split_block_t *blocks;
+  int64_t n_blocks, m_blocks;
+  int64_t offset;               /* bytes in the packed stream */
+};
+
+tbk_split_t *tbk_split_open(tbk_t *tbk) {
+  int fd = fileno(tbk->tbf->fh);
+  int64_t second_at = tbk->offset_sample_beg + HDR_TOTALBYTES + tbk->nmax * 4;
+  int64_t nb = (tbk->nmax + SPLIT_BLOCK - 1) >> SPLIT_BLOCK_SHIFT;
+  tbk_split_t *sp = calloc(1, sizeof(tbk_split_t));
+  int64_t size;
+  if (DATA_TYPE(tbk->dtype) == DT_FLOAT_INT) {
+    split_block_t last;
+    if (pread(fd, &last, sizeof(last), second_at + nb * sizeof(last)) != sizeof(last))
+      wzfatal("%s is truncated.\n", tbk->tbf->fname);
+    size = (nb + 1) * sizeof(last) + last.offset;
+  } else size = tbk->nmax * 4;
+
+  int64_t page = sysconf(_SC_PAGESIZE), map_at = second_at / page * page;
+  sp->map_size = second_at - map_at + size;
+  sp->map = mmap(NULL, sp->map_size, PROT_READ, MAP_SHARED, fd, map_at);
+  if (sp->map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", tbk->tbf->fname);
+  const char *p = (const char*) sp->map + (second_at - map_at);
+  if (DATA_TYPE(tbk->dtype) == DT_FLOAT_INT) {
+    sp->blocks = (const split_block_t*) p;
+    sp->packed = (const uint8_t*) (sp->blocks + nb + 1);
+  } else sp->second = (const float*) p;
+  return sp;
+}
+
+tbk_split_writer_t *tbk_split_writer_init(uint64_t dtype, const char *out_fname) {
+  if (DATA_TYPE(dtype) != DT_FLOAT_INT && DATA_TYPE(dtype) != DT_FLOAT_FLOAT)
+    wzfatal("Only float.int and float.float can be split.\n");
+  tbk_split_writer_t *sw = calloc(1, sizeof(tbk_split_writer_t));
+  sw->dtype = dtype;
+  sw->tmp_fname = malloc(strlen(out_fname) + 10);
+  strcpy(sw->tmp_fname, out_fname);
+  strcat(sw->tmp_fname, "_tmp_");
+  if (!(sw->tmp = fopen(sw->tmp_fname, "wb+"))) wzfatal("Cannot open %s to write.\n", sw->tmp_fname);
+  return sw;
+}
+
+/* pack the n coverages of the current block */
+static void split_flush_block(tbk_split_writer_t *sw, int n) {
+  int32_t lo = sw->cov[0], hi = sw->cov[0];
+  int i, width = 0;
+  for (i=1; i<n; ++i) {
+    if (sw->cov[i] < lo) lo = sw->cov[i];
+    if (sw->cov[i] > hi) hi = sw->cov[i];
+  }
+  while (width < 32 && ((uint64_t) ((int64_t) hi - lo) >> width)) width++;
+
+  if (sw->n_blocks == sw->m_blocks) {
+    sw->m_blocks = sw->m_blocks ? sw->m_blocks * 2 : 1024;
+    sw->blocks = realloc(sw->blocks, sizeof(split_block_t) * sw->m_blocks);
+  }
+  split_block_t *b = &sw->blocks[sw->n_blocks++];
+  b->offset = sw->offset; b->base = lo; b->width = width;
+  if (!width) return;
+
+  uint8_t buf[SPLIT_BLOCK * 4 + 8] = {0};
+  uint64_t bit = 0;
+  for (i=0; i<n; ++i, bit += width) {
+    uint64_t v = (uint32_t) sw->cov[i] - (uint32_t) lo, w;
+    memcpy(&w, buf + (bit >> 3), 8);
+    w |= v << (bit & 7);
+    memcpy(buf + (bit >> 3), &w, 8);
+  }
+  fwrite(buf, 1, SPLIT_BLOCK / 8 * width, sw->tmp);
+  sw->offset += SPLIT_BLOCK / 8 * width;
+}
+
+/* rows are added in order, the first value goes to out */
+void tbk_split_write(tbk_split_writer_t *sw, beddata_t *bd, FILE *out, conf_pack_t *conf) {
+  uint8_t buf[8];
+  tbk_encode1(bd, sw->dtype, buf, conf);
+  fwrite(buf, 4, 1, out);
+  if (DATA_TYPE(sw->dtype) == DT_FLOAT_FLOAT) {
+    fwrite(buf + 4, 4, 1, sw->tmp);
+  } else {
+    int j = sw->n & (SPLIT_BLOCK - 1);
+    memcpy(&sw->cov[j], buf + 4, 4);
+    if (j == SPLIT_BLOCK - 1) split_flush_block(sw, SPLIT_BLOCK);
+  }
+  sw->n++;
+}
+
+/* append the second values, then set nmax. Frees sw, does not close out. */
+void tbk_split_writer_end(tbk_split_writer_t *sw, FILE *out, int64_t n) {
+  if (n != sw->n) wzfatal("Split tbk expects %"PRId64" rows, got %"PRId64".\n", n, sw->n);
+  if (DATA_TYPE(sw->dtype) == DT_FLOAT_INT) {
+    if (n & (SPLIT_BLOCK - 1)) split_flush_block(sw, n & (SPLIT_BLOCK - 1));
+    uint8_t pad[8] = {0};
+    fwrite(pad, 1, 8, sw->tmp);
+    split_block_t last = {sw->offset + 8, 0, 0};
+    fwrite(sw->blocks, sizeof(split_block_t), sw->n_blocks, out);
+    fwrite(&last, sizeof(last), 1, out);
+  }
+
+  char buf[65536];
+  size_t nb;
+  rewind(sw->tmp);
+  while ((nb = fread(buf, 1, sizeof(buf), sw->tmp)) > 0) fwrite(buf, 1, nb, out);
+  fclose(sw->tmp);
+  unlink(sw->tmp_fname);
+
+  fseek(out, HDR_NMAX0, SEEK_SET);
+  fwrite(&n, HDR_NMAX, 1, out);
+  free(sw->tmp_fname); free(sw->blocks); free(sw);
+}
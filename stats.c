@@ -0,0 +1,484 @@
+/* Summary statistics of .tbk
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+#include <pthread.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "wzio.h"
+#include "htslib/htslib/tbx.h"
+#include "htslib/htslib/hts.h"
+#include "htslib/htslib/ksort.h"
+
+KSORT_INIT_GENERIC(float)
+KSORT_INIT_GENERIC(int64_t)
+
+/* independent accumulators so that the reduction can be vectorized */
+#define STATS_LANES 8
+/* offsets closer than this are read in one sequential run */
+#define STATS_MAX_GAP 4096
+
+typedef struct stats_conf_t {
+  view_conf_t vconf;
+  int n_chunk_data;
+  int n_threads;
+} stats_conf_t;
+
+static int usage(stats_conf_t *conf) {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate stats [options] [.tbk [...]]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -o        optional file output\n");
+  fprintf(stderr, "    -i        index, a tabix-ed bed file, used with -g and -R.\n");
+  fprintf(stderr, "    -l        provide tbk file names in the list.\n");
+  fprintf(stderr, "    -g        REGION, report per region instead of per sample\n");
+  fprintf(stderr, "    -R        file listing the regions, report per region\n");
+  fprintf(stderr, "    -s        min coverage for float.int (%d)\n", conf->vconf.min_coverage);
+  fprintf(stderr, "    -t        max p-value for float.float (%f)\n", conf->vconf.max_pval);
+  fprintf(stderr, "    -n        chunk size for data [%d].\n", conf->n_chunk_data);
+  fprintf(stderr, "    -@        number of threads [%d].\n", conf->n_threads);
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, negative values (the pack NA) are counted as missing.\n");
+  fprintf(stderr, "Output: n, n_na, missing_rate, mean, median and coverage-weighted\n");
+  fprintf(stderr, "mean (float.int only) per sample, or per region and sample.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+void tbk_stats_add(tbk_stats_t *st, const float *v, const float *cov, int n, int keep_vals) {
+
+  double sum[STATS_LANES] = {0};
+  double sum_cov[STATS_LANES] = {0};
+  double sum_wx[STATS_LANES] = {0};
+  int64_t cnt[STATS_LANES] = {0};
+  int i, j;
+  for (i=0; i+STATS_LANES <= n; i+=STATS_LANES) {
+    for (j=0; j<STATS_LANES; ++j) {
+      float x = v[i+j];
+      int ok = (x == x);        /* not NAN */
+      float xx = ok ? x : 0;
+      float w = (ok && cov[i+j] > 0) ? cov[i+j] : 0;
+      sum[j] += xx; sum_cov[j] += w; sum_wx[j] += w*xx; cnt[j] += ok;
+    }
+  }
+  for (; i<n; ++i) {
+    float x = v[i];
+    if (x != x) continue;
+    sum[0] += x; cnt[0]++;
+    if (cov[i] > 0) { sum_cov[0] += cov[i]; sum_wx[0] += cov[i]*x; }
+  }
+
+  int64_t n_ok = 0;
+  for (j=0; j<STATS_LANES; ++j) {
+    st->sum += sum[j]; st->sum_cov += sum_cov[j];
+    st->sum_wx += sum_wx[j]; n_ok += cnt[j];
+  }
+  st->n += n;
+  st->n_na += n - n_ok;
+
+  if (keep_vals) {
+    int64_t k = st->n - st->n_na - n_ok;
+    if (st->n - st->n_na > st->m_vals) {
+      st->m_vals = max(st->n - st->n_na, st->m_vals<<1);
+      st->vals = realloc(st->vals, st->m_vals * sizeof(float));
+    }
+    for (i=0; i<n; ++i) if (v[i] == v[i]) st->vals[k++] = v[i];
+  }
+}
+
+/* compute median from the kept values and release them */
+void tbk_stats_finish(tbk_stats_t *st) {
+  int64_t n = st->n - st->n_na;
+  if (st->vals && n > 0) {
+    float m = ks_ksmall(float, n, st->vals, n/2);
+    if (n % 2 == 0) {
+      float m2 = ks_ksmall(float, n/2, st->vals, n/2-1); /* lower half after partition */
+      st->median = ((double) m + m2) / 2;
+    } else st->median = m;
+  } else st->median = NAN;
+  free(st->vals); st->vals = NULL; st->m_vals = 0;
+}
+
+/* unsigned key of a float in the same order, and back */
+static inline uint32_t float_key(float x) {
+  uint32_t u; memcpy(&u, &x, 4);
+  return (u & 0x80000000u) ? ~u : u | 0x80000000u;
+}
+
+static inline float key_float(uint32_t k) {
+  uint32_t u = (k & 0x80000000u) ? k & 0x7fffffffu : ~k;
+  float x; memcpy(&x, &u, 4);
+  return x;
+}
+
+/* bin of hist holding the 0-based rank r, *r becomes the rank in the bin */
+static int stats_hist_rank(const int64_t *hist, int64_t *r) {
+  int b;
+  for (b=0; *r >= hist[b]; ++b) *r -= hist[b];
+  return b;
+}
+
+/* Whole-sample stats in two passes with a private file handle, so
+   samples can be read in parallel. The first pass adds up the sums and
+   counts the high 16 bits of each value's key, the second counts the
+   low 16 bits of the values in the bins of the middle ranks. The median
+   is thus exact without keeping the values. */
+static void stats_sample(tbk_t *tbk0, stats_conf_t *conf, tbk_stats_t *st) {
+
+  tbf_t tbf; tbk_t tbk;
+  tbk_open_private(tbk0, &tbk, &tbf);
+
+  tbk_data_t data = {0};
+  float *v = malloc(sizeof(float) * conf->n_chunk_data);
+  float *cov = malloc(sizeof(float) * conf->n_chunk_data);
+  int64_t *hi = calloc(1<<16, sizeof(int64_t));
+  int64_t chunk_beg; int i;
+  for (chunk_beg = 0; chunk_beg < tbk.nmax; chunk_beg += conf->n_chunk_data) {
+    tbk_query_n(&tbk, chunk_beg, conf->n_chunk_data, &data);
+    for (i=0; i<data.n; ++i) {
+      v[i] = tbk_data_float(&data, i, &conf->vconf, &cov[i]);
+      if (v[i] == v[i]) hi[float_key(v[i])>>16]++;
+    }
+    tbk_stats_add(st, v, cov, data.n, 0);
+  }
+
+  int64_t n_ok = st->n - st->n_na;
+  st->median = NAN;
+  if (n_ok > 0) {               /* ranks (n-1)/2 and n/2, the same if n is odd */
+    int64_t r0 = (n_ok-1)/2, r1 = n_ok/2;
+    int b0 = stats_hist_rank(hi, &r0), b1 = stats_hist_rank(hi, &r1);
+    int64_t *lo0 = calloc(1<<16, sizeof(int64_t));
+    int64_t *lo1 = b1 == b0 ? lo0 : calloc(1<<16, sizeof(int64_t));
+    for (chunk_beg = 0; chunk_beg < tbk.nmax; chunk_beg += conf->n_chunk_data) {
+      tbk_query_n(&tbk, chunk_beg, conf->n_chunk_data, &data);
+      for (i=0; i<data.n; ++i) {
+        float x = tbk_data_float(&data, i, &conf->vconf, &cov[i]);
+        if (x != x) continue;
+        uint32_t k = float_key(x);
+        if ((int) (k>>16) == b0) lo0[k & 0xffff]++;
+        else if ((int) (k>>16) == b1) lo1[k & 0xffff]++;
+      }
+    }
+    float m0 = key_float(((uint32_t) b0<<16) | stats_hist_rank(lo0, &r0));
+    float m1 = key_float(((uint32_t) b1<<16) | stats_hist_rank(lo1, &r1));
+    st->median = ((double) m0 + m1) / 2;
+    if (lo1 != lo0) free(lo1);
+    free(lo0);
+  }
+
+  free(v); free(cov); free(hi); free(data.data);
+  tbf_close(&tbf);
+}
+
+typedef struct stats_region_t {
+  char *name;
+  int64_t *offsets;             /* sorted, -1 for unaddressed */
+  int n;
+} stats_region_t;
+
+/* accumulate the sorted offsets of one region, grouped into sequential
+   runs so each run is one chunked read. Runs are added as they are read,
+   values are kept only with keep_vals, for the median. */
+void tbk_stats_offsets(tbk_t *tbk, int64_t *offsets, int n, view_conf_t *conf,
+                       int n_chunk_data, int keep_vals, tbk_stats_t *st, tbk_stats_aux_t *aux) {
+
+  if (n_chunk_data > aux->m) {
+    aux->m = n_chunk_data;
+    aux->v = realloc(aux->v, sizeof(float) * aux->m);
+    aux->cov = realloc(aux->cov, sizeof(float) * aux->m);
+  }
+
+  if (n > 0 && offsets[n-1] >= tbk->nmax)
+    wzfatal("Error: query %"PRId64" out of range. Wrong idx file?", offsets[n-1]);
+
+  int i = 0, j, k;
+  for (; i < n && offsets[i] < 0; ++i);
+  st->n += i; st->n_na += i;    /* unaddressed rows are missing */
+  while (i < n) {
+    for (j=i+1; j<n && j-i < n_chunk_data &&
+           offsets[j] - offsets[i] < n_chunk_data &&
+           offsets[j] - offsets[j-1] <= STATS_MAX_GAP; ++j);
+    int64_t run_beg = offsets[i];
+    tbk_query_n(tbk, run_beg, offsets[j-1] - run_beg + 1, &aux->data);
+    for (k=0; i<j; ++i, ++k)
+      aux->v[k] = tbk_data_float(&aux->data, offsets[i] - run_beg, conf, &aux->cov[k]);
+    tbk_stats_add(st, aux->v, aux->cov, k, keep_vals);
+  }
+  tbk_stats_finish(st);
+}
+
+void tbk_stats_aux_free(tbk_stats_aux_t *aux) {
+  free(aux->v); free(aux->cov); free(aux->data.data);
+  memset(aux, 0, sizeof(tbk_stats_aux_t));
+}
+
+typedef struct stats_worker_t {
+  tbk_t *tbks;
+  int n_tbks;
+  stats_region_t *regs;         /* NULL for whole sample */
+  int n_regs;
+  stats_conf_t *conf;
+  tbk_stats_t *res;             /* n_regs x n_tbks, or n_tbks */
+  int *next;                    /* next sample to process */
+} stats_worker_t;
+
+static void *stats_worker(void *arg) {
+  stats_worker_t *w = (stats_worker_t*) arg;
+  int k;
+  while ((k = __sync_fetch_and_add(w->next, 1)) < w->n_tbks) {
+    if (!w->regs) {
+      stats_sample(&w->tbks[k], w->conf, &w->res[k]);
+      continue;
+    }
+    tbf_t tbf; tbk_t tbk;
+    tbk_open_private(&w->tbks[k], &tbk, &tbf);
+    tbk_stats_aux_t aux = {0}; int r;
+    for (r=0; r<w->n_regs; ++r)
+      tbk_stats_offsets(&tbk, w->regs[r].offsets, w->regs[r].n, &w->conf->vconf,
+                        w->conf->n_chunk_data, 1, &w->res[r*w->n_tbks+k], &aux);
+    tbk_stats_aux_free(&aux);
+    tbf_close(&tbf);
+  }
+  return NULL;
+}
+
+static void stats_run(tbk_t *tbks, int n_tbks, stats_region_t *regs, int n_regs,
+                      stats_conf_t *conf, tbk_stats_t *res) {
+  int next = 0, i;
+  int n_threads = max(1, min(conf->n_threads, n_tbks));
+  stats_worker_t w = {tbks, n_tbks, regs, n_regs, conf, res, &next};
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  for (i=0; i<n_threads; ++i) pthread_create(&threads[i], NULL, stats_worker, &w);
+  for (i=0; i<n_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+static void stats_print1(tbk_stats_t *st, FILE *out_fh) {
+  int64_t n_ok = st->n - st->n_na;
+  fprintf(out_fh, "\t%"PRId64"\t%"PRId64, st->n, st->n_na);
+  if (st->n > 0) fprintf(out_fh, "\t%f", (double) st->n_na / st->n);
+  else fputs("\tNA", out_fh);
+  if (n_ok > 0) fprintf(out_fh, "\t%f\t%f", st->sum / n_ok, st->median);
+  else fputs("\tNA\tNA", out_fh);
+  if (st->sum_cov > 0) fprintf(out_fh, "\t%f", st->sum_wx / st->sum_cov);
+  else fputs("\tNA", out_fh);
+  fputc('\n', out_fh);
+}
+
+static const char *stats_colnames = "n\tn_na\tmissing_rate\tmean\tmedian\tcov_mean\n";
+
+/* read region offsets from the index */
+static void stats_load_region(htsFile *fp, tbx_t *tbx, char *reg, stats_region_t *sr) {
+  kstring_t str = {0,0,0};
+  char **fields = NULL; int nfields = -1; char *aux = NULL;
+  int m = 0;
+  sr->name = reg; sr->n = 0; sr->offsets = NULL;
+  hts_itr_t *itr = tbx_itr_querys(tbx, reg);
+  if (itr) {
+    while (tbx_itr_next(fp, tbx, itr, &str) >= 0) {
+      line_get_fields2(str.s, "\t", &fields, &nfields, &aux);
+      if (nfields < 4)
+        wzfatal("[%s:%d] Index file has fewer than 4 columns.\n", __func__, __LINE__);
+      ensure_number2(fields[3]);
+      if (sr->n >= m) { m = max(16, m<<1); sr->offsets = realloc(sr->offsets, m*sizeof(int64_t)); }
+      sr->offsets[sr->n++] = atol(fields[3]);
+    }
+    tbx_itr_destroy(itr);
+  }
+  if (sr->n > 1) ks_introsort(int64_t, sr->n, sr->offsets);
+  free_fields(fields, nfields);
+  free(aux); free(str.s);
+}
+
+static void stats_regions(char *fname, char **regs, int nregs, tbk_t *tbks, int n_tbks,
+                          stats_conf_t *conf, FILE *out_fh) {
+
+  htsFile *fp = hts_open(fname,"r");
+  if(!fp) wzfatal("Could not read %s\n", fname);
+  tbx_t *tbx = tbx_index_load(fname);
+  if(!tbx) wzfatal("Could not load .tbi/.csi index of %s\n", fname);
+
+  /* regions are processed in batches so the results stay bounded */
+  int batch = max(1, (1<<20) / n_tbks);
+  stats_region_t *srs = calloc(batch, sizeof(stats_region_t));
+  tbk_stats_t *res = calloc((size_t) batch * n_tbks, sizeof(tbk_stats_t));
+  fprintf(out_fh, "region\tsample\t%s", stats_colnames);
+  int i, r, k;
+  for (i=0; i<nregs; i+=batch) {
+    int nb = min(batch, nregs-i);
+    for (r=0; r<nb; ++r) stats_load_region(fp, tbx, regs[i+r], &srs[r]);
+    memset(res, 0, sizeof(tbk_stats_t) * nb * n_tbks);
+    stats_run(tbks, n_tbks, srs, nb, conf, res);
+    for (r=0; r<nb; ++r) {
+      for (k=0; k<n_tbks; ++k) {
+        fprintf(out_fh, "%s\t%s", srs[r].name, tbks[k].sname);
+        stats_print1(&res[r*n_tbks+k], out_fh);
+      }
+      free(srs[r].offsets);
+    }
+  }
+  free(srs); free(res);
+  tbx_destroy(tbx);
+  if(hts_close(fp)) wzfatal("hts_close returned non-zero status: %s\n", fname);
+}
+
+static void summarize_print1(tbk_stats_t *st, view_conf_t *conf, FILE *out_fh) {
+  int64_t n_ok = st->n - st->n_na;
+  if (conf->summarize == SUMMARIZE_COUNT) {
+    fprintf(out_fh, "\t%"PRId64, n_ok);
+  } else if (n_ok == 0) {
+    fputc('\t', out_fh); fputs(conf->na_token, out_fh);
+  } else {
+    switch (conf->summarize) {
+    case SUMMARIZE_MEAN: fprintf(out_fh, "\t%f", st->sum / n_ok); break;
+    case SUMMARIZE_MEDIAN: fprintf(out_fh, "\t%f", st->median); break;
+    case SUMMARIZE_SUM: fprintf(out_fh, "\t%f", st->sum); break;
+    default: wzfatal("Unrecognized summary: %d.\n", conf->summarize);
+    }
+  }
+}
+
+/* one row per region, one column per sample. Negative values are
+   treated as missing like in stats. */
+int summarize_regions(char *fname, char **regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+
+  int i, k;
+  for (k=0; k<n_tbks; ++k) {
+    if (!dtype_is_numeric(tbks[k].dtype))
+      wzfatal("%s: data type %d cannot be summarized.\n", tbks[k].sname, DATA_TYPE(tbks[k].dtype));
+  }
+
+  htsFile *fp = hts_open(fname,"r");
+  if(!fp) wzfatal("Could not read %s\n", fname);
+  tbx_t *tbx = tbx_index_load(fname);
+  if(!tbx) wzfatal("Could not load .tbi/.csi index of %s\n", fname);
+
+  view_conf_t vconf = *conf;
+  vconf.na_for_negative = 1;
+
+  if (conf->column_name) {
+    fputs("region", out_fh);
+    for (k=0; k<n_tbks; ++k) fprintf(out_fh, "\t%s", tbks[k].sname);
+    fputc('\n', out_fh);
+  }
+
+  stats_region_t sr;
+  tbk_stats_aux_t aux = {0};
+  for (i=0; i<nregs; ++i) {
+    stats_load_region(fp, tbx, regs[i], &sr);
+    fputs(regs[i], out_fh);
+    for (k=0; k<n_tbks; ++k) {
+      tbk_stats_t st = {0};
+      tbk_stats_offsets(&tbks[k], sr.offsets, sr.n, &vconf, conf->n_chunk_data,
+                        conf->summarize == SUMMARIZE_MEDIAN, &st, &aux);
+      summarize_print1(&st, conf, out_fh);
+    }
+    fputc('\n', out_fh);
+    free(sr.offsets);
+  }
+  tbk_stats_aux_free(&aux);
+
+  tbx_destroy(tbx);
+  if(hts_close(fp)) wzfatal("hts_close returned non-zero status: %s\n", fname);
+
+  for(i=0; i<nregs; i++) free(regs[i]);
+  free(regs);
+  return 0;
+}
+
+int main_stats(int argc, char *argv[]) {
+
+  stats_conf_t conf = {0};
+  conf.vconf.na_for_negative = 1;
+  conf.vconf.max_pval = -1.0;
+  conf.vconf.min_coverage = -1;
+  conf.n_chunk_data = 1000000;
+  conf.n_threads = 1;
+
+  int c;
+  if (argc<2) return usage(&conf);
+
+  char *regions_fname = NULL;
+  char *region = NULL;
+  FILE *out_fh = stdout;
+  char *idx_fname = NULL;
+  char *tbk_fname_list = NULL;
+  while ((c = getopt(argc, argv, "i:l:o:R:g:s:t:n:@:h"))>=0) {
+    switch (c) {
+    case 'i': idx_fname = strdup(optarg); break;
+    case 'l': tbk_fname_list = strdup(optarg); break;
+    case 'o': out_fh = fopen(optarg, "w"); break;
+    case 'R': regions_fname = optarg; break;
+    case 'g': region = strdup(optarg); break;
+    case 's': conf.vconf.min_coverage = atoi(optarg); break;
+    case 't': conf.vconf.max_pval = atof(optarg); break;
+    case 'n': conf.n_chunk_data = atoi(optarg); break;
+    case '@': conf.n_threads = atoi(optarg); break;
+    case 'h': return usage(&conf); break;
+    default: usage(&conf); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+  if (!out_fh) wzfatal("Cannot open output file.\n");
+  if (conf.n_chunk_data <= 0) wzfatal("Chunk size must be positive.\n");
+
+  int n_tbks = 0; tbk_t *tbks = NULL;
+  int n_tbfs = 0; tbf_t *tbfs = NULL;
+  parse_tbf_from_argument(argc, argv, optind, &tbfs, &n_tbfs);
+  parse_tbf_fname_list(tbk_fname_list, &tbfs, &n_tbfs);
+  int i;
+  for (i=0; i<n_tbfs; ++i) parse_tbk_from_tbf(&tbfs[i], &tbks, &n_tbks);
+  if (!n_tbks) { usage(&conf); wzfatal("Please supply tbk file.\n"); }
+  for (i=0; i<n_tbks; ++i) {
+    if (!dtype_is_numeric(tbks[i].dtype))
+      wzfatal("%s: data type %d is not supported by stats.\n", tbks[i].sname, DATA_TYPE(tbks[i].dtype));
+  }
+
+  if (regions_fname || region) {
+    int nregs = 0;
+    char **regs = parse_regions(regions_fname, region, &nregs);
+    infer_idx(tbks, n_tbks, &idx_fname);
+    stats_regions(idx_fname, regs, nregs, tbks, n_tbks, &conf, out_fh);
+    for (i=0; i<nregs; ++i) free(regs[i]);
+    free(regs);
+  } else {
+    tbk_stats_t *res = calloc(n_tbks, sizeof(tbk_stats_t));
+    stats_run(tbks, n_tbks, NULL, 0, &conf, res);
+    fprintf(out_fh, "sample\t%s", stats_colnames);
+    for (i=0; i<n_tbks; ++i) {
+      fputs(tbks[i].sname, out_fh);
+      stats_print1(&res[i], out_fh);
+    }
+    free(res);
+  }
+
+  if (out_fh != stdout) fclose(out_fh);
+  if (n_tbfs > 0) {for (i=0; i<n_tbfs; ++i) tbf_close(&tbfs[i]); free(tbfs);}
+  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) free(tbks[i].sname); free(tbks);}
+  free(idx_fname); free(tbk_fname_list); free(region);
+  return 0;
+}
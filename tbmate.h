@@ -35,7 +35,12 @@
 #include <limits.h>
 #include <inttypes.h>
 #include <wordexp.h>
+#include <time.h>
 #include "wzmisc.h"
+#include "htslib/htslib/tbx.h"
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 
 
 #define PACKAGE_VERSION "1.7.20210306"
@@ -61,10 +66,19 @@
 #define DT_ONES          30
 #define DT_FLOAT_INT     31
 #define DT_FLOAT_FLOAT   32
+#define DT_BETA8         33
+#define DT_HALF          34
 #define DT_NA            99
 
 #define DATA_TYPE(d) ((d)&0xff)
-#define STRING_MAX(d) ((d)>>8)
+#define STRING_MAX(d) (((d)>>8)&0xffffffff)
+
+/* flag on a fixed-width data type, only the present (non-NA) units are
+   stored, see sparse.c */
+#define DT_SPARSE        (1ULL<<48)
+/* flag on float.int and float.float, the first values of all rows then
+   the second values, see split.c */
+#define DT_SPLIT         (1ULL<<49)
 
 /* typedef enum { */
 /*   DT_NA, DT_INT1, DT_INT2, DT_INT32, DT_FLOAT, */
@@ -78,6 +92,79 @@ static inline uint16_t float_to_uint16(float f) {
   return (uint16_t) roundf((f+1) * MAX_DOUBLE16);
 }
 
+/* beta8, a value in [0,1] in steps of 1/254, 255 is reserved for NA */
+#define BETA8_MAX 254
+#define BETA8_NA  255
+
+static inline float beta8_to_float(uint8_t c) {
+  return c == BETA8_NA ? NAN : c / (float) BETA8_MAX;
+}
+
+/* negative and nan are NA, f must not exceed 1 */
+static inline uint8_t float_to_beta8(float f) {
+  if (!(f >= 0)) return BETA8_NA;
+  return (uint8_t) lroundf(f * BETA8_MAX);
+}
+
+/* half, IEEE 754 binary16. F16C is used when the build targets it
+   (e.g., -mf16c or -march=native), otherwise the same conversion with
+   round to nearest even is done in software. */
+static inline float half_to_float(uint16_t h) {
+#ifdef __F16C__
+  return _cvtsh_ss(h);
+#else
+  uint32_t s = (uint32_t) (h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, u;
+  if (e == 0x1f) u = s | 0x7f800000 | (m << 13);     /* inf, nan */
+  else if (e) u = s | ((e + 112) << 23) | (m << 13);
+  else if (m) {                                     /* subnormal */
+    e = 113;
+    while (!(m & 0x400)) { m <<= 1; e--; }
+    u = s | (e << 23) | ((m & 0x3ff) << 13);
+  } else u = s;
+  float f;
+  memcpy(&f, &u, 4);
+  return f;
+#endif
+}
+
+static inline uint16_t float_to_half(float f) {
+#ifdef __F16C__
+  return _cvtss_sh(f, 0);
+#else
+  uint32_t u, a, r;
+  memcpy(&u, &f, 4);
+  uint16_t s = (u >> 16) & 0x8000;
+  a = u & 0x7fffffff;
+  if (a > 0x7f800000) return s | 0x7e00;            /* nan */
+  if (a >= 0x477ff000) return s | 0x7c00;           /* inf, or rounds to it */
+  if (a < 0x38800000) {                             /* subnormal or zero */
+    int shift = 126 - (a >> 23);
+    if (shift > 24) return s;
+    uint32_t m = (a & 0x7fffff) | 0x800000, rem, half;
+    r = m >> shift; rem = m & ((1u << shift) - 1); half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (r & 1))) r++;
+    return s | r;
+  }
+  r = a - 0x38000000;                               /* exponent bias 127 to 15 */
+  return s | ((r + 0xfff + ((r >> 13) & 1)) >> 13);
+#endif
+}
+
+/* n halves to floats, 8 at a time with F16C */
+static inline void half_to_float_n(const uint16_t *h, float *f, int n) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i+8 <= n; i+=8)
+    _mm256_storeu_ps(f+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (h+i))));
+#endif
+  for (; i<n; ++i) f[i] = half_to_float(h[i]);
+}
+
+static inline void beta8_to_float_n(const uint8_t *c, float *f, int n) {
+  int i;
+  for (i=0; i<n; ++i) f[i] = beta8_to_float(c[i]);
+}
+
 extern const int unit_base[40];
 static inline int unit_size(uint64_t d) {
   int nu = unit_base[DATA_TYPE(d)];
@@ -87,6 +174,22 @@ static inline int unit_size(uint64_t d) {
   return nu;
 }
 
+/* byte offset of unit n, int1 and int2 are packed from the low bits of
+   each byte, 8 and 4 units to a byte */
+static inline int64_t unit_byte(uint64_t d, int64_t n) {
+  switch (DATA_TYPE(d)) {
+  case DT_INT1: return n >> 3;
+  case DT_INT2: return n >> 2;
+  default: return n * unit_size(d);
+  }
+}
+
+/* value of unit n of a sub-byte type from the byte holding it */
+static inline int unit_sub_byte(uint64_t d, uint8_t b, int64_t n) {
+  if (DATA_TYPE(d) == DT_INT1) return (b >> (n & 7)) & 0x1;
+  return (b >> ((n & 3) << 1)) & 0x3;
+}
+
 typedef struct tbf_t {
   FILE *fh;
   int64_t offset;               /* where the file has been read */
@@ -94,6 +197,71 @@ typedef struct tbf_t {
   char *sname_first;
 } tbf_t;
 
+/* rank index of a sparse tbk, mmapped, see sparse.c */
+typedef struct tbk_sparse_t {
+  void *map;
+  size_t map_size;
+  int64_t n_present;
+  int64_t values;               /* byte offset of the values in the data */
+  uint8_t fill[8];              /* the unit of an absent row */
+  const int64_t *dir;           /* rank and first word of each superblock */
+  const uint64_t *words;        /* presence bits of non-empty superblocks */
+} tbk_sparse_t;
+
+/* second values of a split tbk, mmapped, see split.c */
+typedef struct split_block_t {
+  int64_t offset;               /* of the packed bits in the stream */
+  int32_t base;                 /* frame of reference, the block minimum */
+  int32_t width;                /* bits per value */
+} split_block_t;
+
+typedef struct tbk_split_t {
+  void *map;
+  size_t map_size;
+  const split_block_t *blocks;  /* float.int, the coverage */
+  const uint8_t *packed;
+  const float *second;          /* float.float */
+} tbk_split_t;
+
+/* per-block summary of a tbk, mmapped from <tbk>.tbz, see zonemap.c */
+typedef struct zone_block_t {
+  float min, max;               /* over the non-NA rows, inf and -inf if none */
+  float min2, max2;             /* second values of float.int and float.float */
+  int32_t n_na;
+  int32_t n;                    /* rows in the block */
+} zone_block_t;
+
+typedef struct tbk_zone_t {
+  void *map;
+  size_t map_size;
+  float na;                     /* the value packed for "." */
+  int64_t n_blocks;
+  const zone_block_t *blocks;
+} tbk_zone_t;
+
+/* zoom levels of a tbk, mmapped from <tbk>.tbr, see zoom.c */
+typedef struct zoom_bin_t {
+  int32_t bin;                  /* [bin*bin_size, (bin+1)*bin_size) */
+  int32_t n_sites;              /* index rows starting in the bin */
+  int32_t n;                    /* rows that are not NA */
+  float mean, min, max;         /* NAN if n is 0 */
+} zoom_bin_t;
+
+typedef struct zoom_level_t {
+  int32_t bin_size;             /* in bp */
+  int64_t n_bins;
+  const int64_t *seq_bin;       /* first bin of each tid, n_seqs+1 */
+  const zoom_bin_t *bins;       /* sorted by tid then bin */
+} zoom_level_t;
+
+typedef struct tbk_zoom_t {
+  void *map;
+  size_t map_size;
+  int32_t n_seqs;
+  int32_t n_levels;
+  zoom_level_t *levels;         /* finest first */
+} tbk_zoom_t;
+
 typedef struct tbk_t {
   char *sname;
   tbf_t *tbf;
@@ -104,9 +272,78 @@ typedef struct tbk_t {
   char extra[HDR_EXTRA];
   uint64_t dtype;               /* data type */
   uint8_t data;                 /* sub-byte data */
+  int64_t data_at;              /* file offset + 1 of the byte in data, 0 if none */
+  tbk_sparse_t *sparse;         /* set by parse_tbk_from_tbf if DT_SPARSE */
+  tbk_split_t *split;           /* set by parse_tbk_from_tbf if DT_SPLIT */
+  int skip_second;              /* split, second values are not needed */
+  tbk_zone_t *zone;             /* zone map if loaded and up to date */
+  tbk_zoom_t *zoom;             /* zoom levels if loaded and up to date */
   int num_samples;
 } tbk_t;
 
+/* --profile. Time is charged to one phase at a time: prof_enter switches
+   the current phase and prof_leave switches back, so nested phases (a read
+   inside formatting) are exclusive. Everything is behind tbk_prof_on, and
+   building with -DTBMATE_NO_PROFILE removes it altogether. The state is
+   per thread, worker threads merge theirs into the report when done. */
+enum {
+  PROF_OTHER, PROF_INDEX, PROF_PARSE, PROF_SEEK, PROF_READ,
+  PROF_DECODE, PROF_FORMAT, PROF_WRITE, PROF_N
+};
+
+typedef struct tbk_prof_t {
+  double t[PROF_N];
+  double t_last;
+  int cur;
+  int64_t bytes_read;
+  int64_t n_reads;
+  int64_t n_seeks;
+  int64_t n_seeks_elided;
+  int64_t n_rows;
+  int64_t n_cells;
+} tbk_prof_t;
+
+extern int tbk_prof_on;
+extern __thread tbk_prof_t tbk_prof;
+
+#ifdef TBMATE_NO_PROFILE
+#define PROF_ON 0
+#else
+#define PROF_ON __builtin_expect(tbk_prof_on, 0)
+#endif
+
+#define PROF_COUNT(field, x) do { if (PROF_ON) tbk_prof.field += (x); } while (0)
+
+static inline double prof_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline int prof_switch(int phase) {
+  double t = prof_now();
+  int prev = tbk_prof.cur;
+  tbk_prof.t[prev] += t - tbk_prof.t_last;
+  tbk_prof.t_last = t;
+  tbk_prof.cur = phase;
+  return prev;
+}
+
+/* returns the phase to pass to prof_leave, -1 if not profiling */
+static inline int prof_enter(int phase) {
+  if (PROF_ON) return prof_switch(phase);
+  return -1;
+}
+
+static inline void prof_leave(int prev) {
+  if (prev >= 0) prof_switch(prev);
+}
+
+void tbk_prof_start();
+void tbk_prof_start_thread();
+void tbk_prof_merge_thread();
+void tbk_prof_report(const char *cmd, FILE *fh);
+
 static inline void tbf_open1(char *fname, tbf_t *tbf, char *sname) {
   memset(tbf, 0, sizeof(tbf_t));
   tbf->offset = 0;
@@ -131,26 +368,86 @@ static inline tbf_t *tbf_open_update(char *fname) {
   return tbf;
 }
 
+/* a tbk with its own file handle, for use from another thread */
+static inline void tbk_open_private(tbk_t *tbk0, tbk_t *tbk, tbf_t *tbf) {
+  tbf_open1(tbk0->tbf->fname, tbf, NULL);
+  *tbk = *tbk0;
+  tbk->tbf = tbf;
+}
+
+#define SPARSE_PREAMBLE 24       /* n_present, n_words, fill */
+#define SPARSE_SB_SHIFT 9        /* 512 rows, 8 words, per superblock */
+#define SPLIT_BLOCK_SHIFT 7      /* 128 coverages per frame of reference */
+#define ZONE_BLOCK_SHIFT 10      /* 1024 rows per zone map block */
+
+/* bytes of data after the header, stringd is the offsets followed by the
+   strings, the last of which ends the data. The file position is kept. */
+static inline int64_t tbk_data_size(tbk_t *tbk) {
+  if ((tbk->dtype & DT_SPLIT) && DATA_TYPE(tbk->dtype) == DT_FLOAT_INT) {
+    FILE *fh = tbk->tbf->fh;
+    int64_t nb = (tbk->nmax + (1<<SPLIT_BLOCK_SHIFT) - 1) >> SPLIT_BLOCK_SHIFT;
+    split_block_t last;
+    fseek(fh, tbk->offset_sample_beg + HDR_TOTALBYTES + tbk->nmax*4 + nb*sizeof(split_block_t), SEEK_SET);
+    if (fread(&last, sizeof(last), 1, fh) != 1) wzfatal("%s is truncated.\n", tbk->tbf->fname);
+    fseek(fh, tbk->tbf->offset, SEEK_SET);
+    return tbk->nmax*4 + (nb+1)*sizeof(split_block_t) + last.offset;
+  }
+  if (tbk->dtype & DT_SPARSE) {
+    FILE *fh = tbk->tbf->fh;
+    int64_t cnt[2];
+    fseek(fh, tbk->offset_sample_beg + HDR_TOTALBYTES, SEEK_SET);
+    if (fread(cnt, 8, 2, fh) != 2) wzfatal("%s is truncated.\n", tbk->tbf->fname);
+    fseek(fh, tbk->tbf->offset, SEEK_SET);
+    int64_t n_super = (tbk->nmax + (1<<SPARSE_SB_SHIFT) - 1) >> SPARSE_SB_SHIFT;
+    return SPARSE_PREAMBLE + cnt[0] * unit_size(tbk->dtype) + (n_super + 1) * 16 + cnt[1] * 8;
+  }
+  switch (DATA_TYPE(tbk->dtype)) {
+  case DT_INT1: return (tbk->nmax + 7) >> 3;
+  case DT_INT2: return (tbk->nmax + 3) >> 2;
+  case DT_STRINGD: {
+    if (tbk->nmax <= 0) return 0;
+    FILE *fh = tbk->tbf->fh;
+    int64_t beg = tbk->offset_sample_beg + HDR_TOTALBYTES;
+    uint64_t last = 0; int64_t n = 0; int c;
+    fseek(fh, beg + (tbk->nmax-1)*8, SEEK_SET);
+    if (fread(&last, 8, 1, fh) != 1) wzfatal("%s is truncated.\n", tbk->tbf->fname);
+    fseek(fh, beg + tbk->nmax*8 + last, SEEK_SET);
+    while ((c = fgetc(fh)) != EOF && c) n++;
+    fseek(fh, tbk->tbf->offset, SEEK_SET);
+    return tbk->nmax*8 + last + n + 1;
+  }
+  default: return tbk->nmax * unit_size(tbk->dtype);
+  }
+}
+
 static inline void tbf_skip_data(tbk_t *tbk) {
-  fseek(tbk->tbf->fh, tbk->nmax * unit_size(tbk->dtype), SEEK_CUR);
-  tbk->tbf->offset += tbk->nmax * unit_size(tbk->dtype);
+  int64_t size = tbk_data_size(tbk);
+  fseek(tbk->tbf->fh, size, SEEK_CUR);
+  tbk->tbf->offset += size;
 }
 
 static inline void tbf_read(tbf_t *tbf, void *ptr, size_t nbytes, size_t n) {
+  int p = prof_enter(PROF_READ);
   fread(ptr, nbytes, n, tbf->fh);
   tbf->offset += nbytes * n;
+  PROF_COUNT(bytes_read, nbytes * n);
+  PROF_COUNT(n_reads, 1);
+  prof_leave(p);
 }
 
 static inline void tbk_seek_n(tbk_t *tbk, int64_t n) {
   int64_t offset = tbk->offset_sample_beg + HDR_TOTALBYTES;
-  offset += n * unit_size(tbk->dtype);
+  offset += unit_byte(tbk->dtype, n);
 
   tbf_t *tbf = tbk->tbf;
-  if (offset == tbf->offset) return;
-  
+  if (offset == tbf->offset) { PROF_COUNT(n_seeks_elided, 1); return; }
+
+  int p = prof_enter(PROF_SEEK);
   tbf->offset = offset;
   if (fseek(tbf->fh, tbf->offset, SEEK_SET))
     wzfatal("File %s cannot be seeked.\n", tbk->tbf->fname);
+  PROF_COUNT(n_seeks, 1);
+  prof_leave(p);
 }
 
 static inline void tbk_seek_offset(tbk_t *tbk, int64_t offset) {
@@ -158,11 +455,14 @@ static inline void tbk_seek_offset(tbk_t *tbk, int64_t offset) {
   offset += tbk->offset_sample_beg + HDR_TOTALBYTES;
   
   tbf_t *tbf = tbk->tbf;
-  if (offset == tbf->offset) return;
-  
+  if (offset == tbf->offset) { PROF_COUNT(n_seeks_elided, 1); return; }
+
+  int p = prof_enter(PROF_SEEK);
   tbf->offset = offset;
   if (fseek(tbf->fh, tbf->offset, SEEK_SET))
     wzfatal("File %s cannot be seeked.\n", tbk->tbf->fname);
+  PROF_COUNT(n_seeks, 1);
+  prof_leave(p);
 }
 
 static inline void tbk_set_sname_by_fname(tbk_t *tbk) {
@@ -227,7 +527,8 @@ static inline int tbf_num_samples(char *fname) {
 static inline char* clean_path(char *path, char *fname) {
   /* expand POSIX */
   wordexp_t result;
-  wordexp(path, &result, 0);
+  if (wordexp(path, &result, 0) != 0) return NULL;
+  if (result.we_wordc == 0) { wordfree(&result); return NULL; } /* empty message */
   strcpy(path, result.we_wordv[0]);
   wordfree(&result);
 
@@ -264,8 +565,54 @@ typedef struct beddata_t {
   int n;
 } beddata_t;
 
+/* rows present in [0, i), i may be nmax */
+static inline int64_t tbk_sparse_count(tbk_sparse_t *sp, int64_t i) {
+  const int64_t *e = sp->dir + (i >> SPARSE_SB_SHIFT) * 2;
+  if (e[1] < 0) return e[0];
+  const uint64_t *w = sp->words + e[1];
+  int k = (i >> 6) & 7, j;
+  int64_t r = e[0];
+  for (j=0; j<k; ++j) r += __builtin_popcountll(w[j]);
+  return r + __builtin_popcountll(w[k] & ((1ULL << (i & 63)) - 1));
+}
+
+static inline int tbk_sparse_present(tbk_sparse_t *sp, int64_t i) {
+  int64_t w = sp->dir[(i >> SPARSE_SB_SHIFT) * 2 + 1];
+  if (w < 0) return 0;
+  return (sp->words[w + ((i >> 6) & 7)] >> (i & 63)) & 1;
+}
+
+/* the second value of row i, 4 bytes to out */
+static inline void tbk_split_second(tbk_split_t *sp, int64_t i, void *out) {
+  if (sp->second) { memcpy(out, sp->second + i, 4); return; }
+  const split_block_t *b = sp->blocks + (i >> SPLIT_BLOCK_SHIFT);
+  int32_t v = b->base;
+  if (b->width) {
+    uint64_t bit = (uint64_t) (i & ((1<<SPLIT_BLOCK_SHIFT) - 1)) * b->width, w;
+    memcpy(&w, sp->packed + b->offset + (bit >> 3), 8);
+    v += (uint32_t) ((w >> (bit & 7)) & ((1ULL << b->width) - 1));
+  }
+  memcpy(out, &v, 4);
+}
+
+typedef struct tbk_sparse_writer_t tbk_sparse_writer_t;
+int dtype_sparse_ok(uint64_t dtype);
+tbk_sparse_t *tbk_sparse_open(tbk_t *tbk);
+tbk_sparse_writer_t *tbk_sparse_writer_init(uint64_t dtype, FILE *out, conf_pack_t *conf);
+void tbk_sparse_write(tbk_sparse_writer_t *sw, beddata_t *bd, FILE *out, conf_pack_t *conf);
+void tbk_sparse_writer_end(tbk_sparse_writer_t *sw, FILE *out, int64_t n);
+
+typedef struct tbk_split_writer_t tbk_split_writer_t;
+tbk_split_t *tbk_split_open(tbk_t *tbk);
+tbk_split_writer_t *tbk_split_writer_init(uint64_t dtype, const char *out_fname);
+void tbk_split_write(tbk_split_writer_t *sw, beddata_t *bd, FILE *out, conf_pack_t *conf);
+void tbk_split_writer_end(tbk_split_writer_t *sw, FILE *out, int64_t n);
+
 void tbk_write(beddata_t *bd, uint64_t dtype, FILE *out, int n, uint8_t *aux,
                FILE*tmp_out, uint64_t *tmp_out_offset, conf_pack_t *conf);
+int tbk_encode1(beddata_t *bd, uint64_t dtype, uint8_t *buf, conf_pack_t *conf);
+void tbk_write_end(uint64_t dtype, FILE *out, int64_t n, uint8_t *aux,
+                   FILE *tmp_out, char *tmp_fname, uint64_t tmp_out_offset);
 
 
 /* doesn't close tbf, need to close separately */
@@ -276,6 +623,35 @@ static inline void tbk_close(tbk_t *tbk) {
   tbk->sname = sname;
 }
 
+/* coordinate-to-offset cache of an idx.gz, see cache.c */
+typedef struct tbk_cache_t {
+  void *map;                    /* file image, mmapped or malloc-ed */
+  size_t map_size;
+  int mapped;
+  int32_t n_seqs;
+  int64_t n_rows;
+  char **seqnames;
+  int64_t *seq_beg;             /* first row of each tid, n_seqs+1 */
+  int32_t *maxlen;              /* longest row of each tid */
+  int32_t *beg, *end;           /* per row, as in the bed columns */
+  int64_t *off;                 /* per row tbk offset, -1 if unaddressed */
+} tbk_cache_t;
+
+/* name column to row hash of an idx.gz, see cache.c */
+typedef struct tbk_names_t {
+  char *data;                   /* file image, mmapped or malloc-ed */
+  size_t size;
+  int mapped;
+  int name_col;                 /* 1-based column of the names */
+  int64_t n_rows;
+  uint64_t n_buckets;
+  char *pool;                   /* name\0 of each row */
+  int64_t *entry;               /* per row position in pool */
+  int64_t *off;                 /* per row tbk offset, -1 if unaddressed */
+  int64_t *voff;                /* per row BGZF virtual offset of the line */
+  uint32_t *buckets;            /* row+1, 0 if empty */
+} tbk_names_t;
+
 typedef struct view_conf_t {
   int precision;
   int column_name;
@@ -290,15 +666,202 @@ typedef struct view_conf_t {
   float max_pval;               /* maximum pval for float.float */
   int min_coverage;             /* minimum coverage for float.int */
   int full_path_as_colname;
+  int summarize;                /* one of SUMMARIZE_*, per-region summary */
+  int64_t mem_budget;           /* bytes, plan strategy and chunk sizes if >0 */
+  int verbose;
+  int n_threads;                /* region shards in parallel, -@ */
+  int keep_order;               /* regions as given, no sorting or merging */
+  tbk_cache_t *cache;           /* used instead of tabix if set */
+  struct tbk_where_t *where;    /* --where, rows to keep */
+  int resolution;               /* --resolution, bp per output row if >0 */
 } view_conf_t;
 
+#define SUMMARIZE_NONE   0
+#define SUMMARIZE_MEAN   1
+#define SUMMARIZE_MEDIAN 2
+#define SUMMARIZE_COUNT  3
+#define SUMMARIZE_SUM    4
+
 typedef struct tbk_data_t {
   uint64_t dtype;
   void *data;
   int n;
 } tbk_data_t;
 
-int chunk_query_region(char *fname, char **regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh);
+/* a query region resolved against the tabix index, 0-based half-open */
+typedef struct tbk_region_t {
+  int tid;                      /* HTS_IDX_START for the whole file */
+  int beg, end;
+} tbk_region_t;
+
+tbk_region_t *plan_regions(tbx_t *tbx, char *regions_fname, char *region, int keep_order, int *n);
+
+tbk_cache_t *tbk_cache_open(const char *idx_fname, tbx_t *tbx, int build);
+void tbk_cache_close(tbk_cache_t *c);
+void tbk_cache_range(tbk_cache_t *c, tbk_region_t *r, int64_t *lo, int64_t *hi);
+int64_t tbk_cache_find(tbk_cache_t *c, int tid, int32_t beg, int32_t end);
+int tbk_cache_tid(tbk_cache_t *c, int64_t row);
+
+/* same test as the tabix iterator */
+static inline int tbk_cache_overlap(tbk_cache_t *c, tbk_region_t *r, int64_t i) {
+  return r->tid == HTS_IDX_START || (c->end[i] > r->beg && c->beg[i] < r->end);
+}
+tbk_names_t *tbk_names_open(const char *idx_fname, int name_col);
+void tbk_names_close(tbk_names_t *nm);
+int64_t tbk_names_get(tbk_names_t *nm, const char *name);
+
+/* rows of idx.gz in a batch from idx_reader_next, see idxread.c */
+typedef struct idx_batch_t {
+  int n, m;
+  int64_t *off;                 /* tbk offset, column 4 */
+  size_t *pos;                  /* start of each line in text */
+  int *len3;                    /* length of the first three columns */
+  kstring_t text;               /* the lines, each '\0'-terminated */
+} idx_batch_t;
+
+typedef struct idx_reader_t idx_reader_t;
+idx_reader_t *idx_reader_open(htsFile *fp, tbx_t *tbx, tbk_region_t *regs, int nregs, int threaded);
+idx_batch_t *idx_reader_next(idx_reader_t *r);
+void idx_reader_close(idx_reader_t *r);
+
+FILE *tbk_writer_open(const char *fname, int bgzf, int line_skip);
+
+int chunk_query_region(char *fname, tbx_t *tbx, tbk_region_t *regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh);
+void tbk_query_n(tbk_t *tbk, int64_t chunk_beg, int n, tbk_data_t *data);
+void tbk_decode_n(const uint8_t *raw, int n, tbk_data_t *data);
+void tbk_print1(tbk_data_t *d, int i, view_conf_t *conf, kstring_t *ks);
+void view_plan(tbk_t *tbks, int n_tbks, int64_t n_rows, view_conf_t *conf,
+               int chunk_read_set, int n_chunk_index_set, int n_chunk_data_set);
+
+/* shared by the subcommands that take a tbk list, see view.c */
+char **parse_regions(char *regions_fname, char *region, int *nregs);
+void parse_tbf_from_argument(int argc, char **argv, int optind, tbf_t **tbfs, int *n_tbfs);
+void parse_tbf_fname_list(char *tbk_fname_list, tbf_t **tbfs, int *n_tbfs);
+void infer_idx(tbk_t *tbks, int n_tbks, char **idx_fname);
+
+/* the i-th data entry of a numeric tbk as float, NAN if missing under
+   conf (negative, low coverage or high p-value). The coverage of
+   float.int is returned in cov, 1 for other data types. */
+static inline float tbk_data_float(tbk_data_t *d, int i, view_conf_t *conf, float *cov) {
+  float data;
+  *cov = 1.0;
+  switch(DATA_TYPE(d->dtype)) {
+  case DT_INT1: case DT_INT2: data = ((uint8_t*) (d->data))[i]; break;
+  case DT_INT32: data = ((int32_t*) (d->data))[i]; break;
+  case DT_FLOAT: data = ((float*) (d->data))[i]; break;
+  case DT_DOUBLE: data = ((double*) (d->data))[i]; break;
+  case DT_ONES: case DT_BETA8: case DT_HALF:
+    data = ((float*) (d->data))[i]; break; /* decoded by tbk_query_n */
+  case DT_FLOAT_INT: {
+    data = ((float*) (d->data))[i*2];
+    int data2 = ((int32_t*) (d->data))[i*2+1];
+    *cov = data2;
+    if (conf->min_coverage >= 0 && data2 < conf->min_coverage) data = NAN;
+    break;
+  }
+  case DT_FLOAT_FLOAT: {
+    data = ((float*) (d->data))[i*2];
+    float data2 = ((float*) (d->data))[i*2+1];
+    if (conf->max_pval >= 0 && data2 > conf->max_pval) data = NAN;
+    break;
+  }
+  default: wzfatal("Data type %d is not numeric.\n", DATA_TYPE(d->dtype));
+  }
+  if (conf->na_for_negative && data < 0) data = NAN;
+  return data;
+}
+
+/* the second value of float.int and float.float, NAN for other types */
+static inline float tbk_data_second(tbk_data_t *d, int i) {
+  switch(DATA_TYPE(d->dtype)) {
+  case DT_FLOAT_INT: return ((int32_t*) (d->data))[i*2+1];
+  case DT_FLOAT_FLOAT: return ((float*) (d->data))[i*2+1];
+  default: return NAN;
+  }
+}
+
+/* zone maps, see zonemap.c */
+typedef struct tbk_zone_writer_t tbk_zone_writer_t;
+tbk_zone_writer_t *tbk_zone_writer_init(uint64_t dtype, conf_pack_t *conf);
+void tbk_zone_add(tbk_zone_writer_t *zw, beddata_t *bd, conf_pack_t *conf);
+void tbk_zone_writer_end(tbk_zone_writer_t *zw, const char *tbk_fname);
+tbk_zone_t *tbk_zone_open(tbk_t *tbk);
+
+tbk_zoom_t *tbk_zoom_open(tbk_t *tbk, const char *idx_fname);
+void tbk_zoom_close(tbk_zoom_t *z);
+int zoom_pick_level(tbk_t *tbks, int n_tbks, int resolution);
+int zoom_query_regions(tbx_t *tbx, tbk_region_t *regs, int nregs, tbk_t *tbks, int n_tbks,
+                       int bin_size, view_conf_t *conf, FILE *out_fh);
+
+/* view --where, see where.c */
+#define WHERE_V      1          /* the value */
+#define WHERE_V2     2          /* coverage or the second float */
+#define WHERE_NA     3
+#define WHERE_NOT_NA 4
+
+#define WHERE_ANY    1
+#define WHERE_ALL    2
+#define WHERE_FRAC   3
+
+typedef struct where_cond_t {
+  int var;
+  int op;                       /* one of the WHERE_OP_* in where.c */
+  float x;
+} where_cond_t;
+
+typedef struct where_clause_t {
+  int quant;
+  int op;                       /* comparing the fraction under WHERE_FRAC */
+  float x;
+  where_cond_t *conds;          /* all of them hold for a sample */
+  int n_conds;
+} where_clause_t;
+
+typedef struct tbk_where_t {
+  where_clause_t *clauses;      /* all of them hold for a row */
+  int n_clauses;
+} tbk_where_t;
+
+tbk_where_t *where_parse(const char *expr);
+void where_free(tbk_where_t *w);
+int where_block_may_match(tbk_where_t *w, tbk_t *tbks, int n_tbks, int64_t block, view_conf_t *conf);
+void where_filter_rows(tbk_where_t *w, tbk_t *tbks, tbk_data_t *cols, int n_tbks, int n,
+                       view_conf_t *conf, uint8_t *keep);
+
+static inline int dtype_is_numeric(uint64_t dtype) {
+  switch(DATA_TYPE(dtype)) {
+  case DT_INT1: case DT_INT2: case DT_INT32: case DT_FLOAT: case DT_DOUBLE:
+  case DT_ONES: case DT_FLOAT_INT: case DT_FLOAT_FLOAT:
+  case DT_BETA8: case DT_HALF: return 1;
+  default: return 0;
+  }
+}
+
+/* summary statistics of one sample over the whole tbk or a region */
+typedef struct tbk_stats_t {
+  int64_t n;                    /* number of sites */
+  int64_t n_na;                 /* number of missing sites */
+  double sum;                   /* sum of non-missing values */
+  double sum_cov;               /* sum of coverage, float.int only */
+  double sum_wx;                /* sum of coverage-weighted values */
+  double median;                /* set by tbk_stats_finish */
+  float *vals;                  /* non-missing values kept for the median */
+  int64_t m_vals;
+} tbk_stats_t;
+
+/* reusable buffers for tbk_stats_offsets */
+typedef struct tbk_stats_aux_t {
+  tbk_data_t data;
+  float *v, *cov;
+  int m;
+} tbk_stats_aux_t;
+
+void tbk_stats_add(tbk_stats_t *st, const float *v, const float *cov, int n, int keep_vals);
+void tbk_stats_finish(tbk_stats_t *st);
+void tbk_stats_offsets(tbk_t *tbk, int64_t *offsets, int n, view_conf_t *conf,
+                       int n_chunk_data, int keep_vals, tbk_stats_t *st, tbk_stats_aux_t *aux);
+void tbk_stats_aux_free(tbk_stats_aux_t *aux);
+int summarize_regions(char *fname, char **regs, int nregs, tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh);
 
 static inline void tbk_print_columnnames(
   tbk_t *tbks, int n_tbks, int nfields, FILE *out_fh, view_conf_t *conf) {
@@ -0,0 +1,319 @@
+/* Update values of a tbk file in place
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+/* Journal layout, <.tbk>.journal, an undo log written before the tbk is
+ * touched:
+ *
+ *   4 bytes   "tbj\0"
+ *   8 bytes   nmax before the update
+ *   8 bytes   file size before the update
+ *   then per run: 8 bytes file position, 8 bytes length, the old bytes
+ *
+ * An incomplete last run is ignored, the tbk was not modified yet then. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "wzio.h"
+#include "htslib/htslib/ksort.h"
+
+#define UPDATE_RUN_BYTES (1<<20)
+
+typedef struct update_t {
+  int64_t off;
+  int64_t order;                /* line number, the last one wins */
+} update_t;
+
+#define update_lt(a, b) ((a).off < (b).off || ((a).off == (b).off && (a).order < (b).order))
+KSORT_INIT(update, update_t, update_lt)
+
+typedef struct update_run_t {
+  int64_t beg;                  /* first offset */
+  int64_t n;                    /* number of units */
+  int64_t i;                    /* first update */
+} update_run_t;
+
+static int usage(conf_pack_t *conf) {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate update [options] <.tbk> <updates>\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -i        index, a tabix-ed bed file. Updates are then a bed file whose\n");
+  fprintf(stderr, "              rows are located by seqname, start and end in the index.\n");
+  fprintf(stderr, "    -n        number for nan or '.' [%f].\n", conf->nan);
+  fprintf(stderr, "    -j        keep an undo journal (<.tbk>.journal) until the update is on disk.\n");
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, without -i each line of updates is an offset followed by the value(s),\n");
+  fprintf(stderr, "tab-delimited. Offsets past the end extend the tbk, the gap is filled with\n");
+  fprintf(stderr, "nan. Only fixed-width data types can be updated.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+static void pwrite_full(int fd, const void *buf, size_t n, off_t offset, const char *fname) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, offset);
+    if (w < 0) wzfatal("Cannot write to %s.\n", fname);
+    p += w; n -= w; offset += w;
+  }
+}
+
+static void pread_full(int fd, void *buf, size_t n, off_t offset, const char *fname) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t r = pread(fd, p, n, offset);
+    if (r <= 0) wzfatal("Cannot read %s.\n", fname);
+    p += r; n -= r; offset += r;
+  }
+}
+
+static char *journal_fname(const char *fname) {
+  char *s = malloc(strlen(fname) + 9);
+  strcpy(s, fname); strcat(s, ".journal");
+  return s;
+}
+
+/* undo an update that did not finish, if there is a journal */
+static void journal_rollback(const char *fname) {
+
+  char *jname = journal_fname(fname);
+  FILE *jh = fopen(jname, "rb");
+  if (!jh) { free(jname); return; }
+
+  char id[4]; int64_t nmax, size, pos, len;
+  if (fread(id, 4, 1, jh) == 1 && memcmp(id, "tbj", 4) == 0 &&
+      fread(&nmax, 8, 1, jh) == 1 && fread(&size, 8, 1, jh) == 1) {
+    int fd = open(fname, O_RDWR);
+    if (fd < 0) wzfatal("Cannot open %s to update.\n", fname);
+    char *buf = NULL; int64_t m = 0;
+    while (fread(&pos, 8, 1, jh) == 1 && fread(&len, 8, 1, jh) == 1) {
+      if (len > m) { m = len; buf = realloc(buf, m); }
+      if (fread(buf, 1, len, jh) != (size_t) len) break;
+      pwrite_full(fd, buf, len, pos, fname);
+    }
+    pwrite_full(fd, &nmax, HDR_NMAX, HDR_NMAX0, fname);
+    if (ftruncate(fd, size)) wzfatal("Cannot truncate %s.\n", fname);
+    if (fsync(fd) || close(fd)) wzfatal("Cannot write to %s.\n", fname);
+    free(buf);
+    fprintf(stderr, "[%s] Rolled back an unfinished update of %s.\n", __func__, fname);
+  }
+  fclose(jh);
+  unlink(jname);
+  free(jname);
+}
+
+static void drop_sidecar(const char *fname, const char *ext) {
+  char *sname = malloc(strlen(fname) + strlen(ext) + 1);
+  sprintf(sname, "%s%s", fname, ext);
+  if (unlink(sname) == 0)
+    fprintf(stderr, "[%s] Removed %s, rebuild it if needed.\n", __func__, sname);
+  free(sname);
+}
+
+/* offset of the index row with exactly this seqname, start and end, -1 if none */
+static int64_t locate_row(tbk_cache_t *c, tbx_t *tbx, char **fields) {
+  tbk_region_t r;
+  r.tid = tbx_name2id(tbx, fields[0]);
+  if (r.tid < 0) return -1;
+  ensure_number2(fields[1]); ensure_number2(fields[2]);
+  r.beg = atol(fields[1]);
+  r.end = atol(fields[2]);
+  if (r.end <= r.beg) r.end = r.beg + 1;
+  int64_t lo, hi, j;
+  tbk_cache_range(c, &r, &lo, &hi);
+  for (j=lo; j<hi; ++j)
+    if (c->beg[j] == atol(fields[1]) && c->end[j] == atol(fields[2])) return c->off[j];
+  return -1;
+}
+
+int main_update(int argc, char *argv[]) {
+
+  conf_pack_t conf = {0};
+  conf.nan = -1.0;
+
+  int c;
+  if (argc<2) return usage(&conf);
+
+  char *idx_fname = NULL;
+  int journal = 0;
+  while ((c = getopt(argc, argv, "i:n:jh"))>=0) {
+    switch (c) {
+    case 'i': idx_fname = strdup(optarg); break;
+    case 'n': conf.nan = atof(optarg); break;
+    case 'j': journal = 1; break;
+    case 'h': return usage(&conf); break;
+    default: usage(&conf); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+
+  if (optind + 2 > argc) {
+    usage(&conf);
+    wzfatal("Please supply the tbk file and the updates.\n");
+  }
+  char *fname = argv[optind];
+  journal_rollback(fname);
+
+  tbf_t *tbf = tbf_open_update(fname);
+  tbk_t tbk = {0};
+  tbf_next(tbf, &tbk);
+  if (tbk.version >= 100) wzfatal("%s is a bundle, update the tbks before bundling.\n", fname);
+  if (tbk.dtype & (DT_SPARSE | DT_SPLIT))
+    wzfatal("%s is %s and cannot be updated in place, please repack.\n", fname,
+            tbk.dtype & DT_SPARSE ? "sparse" : "split");
+  int usize = unit_size(tbk.dtype);
+  uint8_t *na = calloc(max(usize, 1), 1);
+  beddata_t bd = {{0}, 2};
+  bd.s[0] = bd.s[1] = ".";
+  if (tbk_encode1(&bd, tbk.dtype, na, &conf) < 0)
+    wzfatal("Data type %d of %s is not fixed-width, please repack.\n", DATA_TYPE(tbk.dtype), fname);
+
+  /* read the updates, values are encoded right away */
+  tbk_cache_t *cache = NULL; tbx_t *tbx = NULL;
+  if (idx_fname) {
+    if (!(tbx = tbx_index_load(idx_fname))) wzfatal("Could not load .tbi/.csi index of %s\n", idx_fname);
+    if (!(cache = tbk_cache_open(idx_fname, tbx, 1))) wzfatal("Cannot read %s.\n", idx_fname);
+  }
+  int n_values = (DATA_TYPE(tbk.dtype) == DT_FLOAT_INT || DATA_TYPE(tbk.dtype) == DT_FLOAT_FLOAT) ? 2 : 1;
+  int first = idx_fname ? 3 : 1;
+  wzreader_t *r = wzreader_open(argv[optind+1]);
+  char *line; size_t len; char **fields; int nfields;
+  int64_t n = 0, m = 1<<10, n_missing = 0, off;
+  update_t *ups = malloc(sizeof(update_t) * m);
+  uint8_t *vals = malloc((size_t) usize * m);
+  while ((line = wzreader_line(r, &len))) {
+    if (line[0] == '#' || line[0] == '\0') continue;
+    line_get_fields(line, "\t", &fields, &nfields);
+    if (nfields < first + n_values) wzfatal("Expect %d columns: %s\n", first + n_values, line);
+    if (idx_fname) off = locate_row(cache, tbx, fields);
+    else { ensure_number2(fields[0]); off = atol(fields[0]); }
+    if (off < 0) { n_missing++; free_fields(fields, nfields); continue; }
+    if (n == m) {
+      m <<= 1;
+      ups = realloc(ups, sizeof(update_t) * m);
+      vals = realloc(vals, (size_t) usize * m);
+    }
+    bd.s[0] = fields[first];
+    bd.s[1] = n_values > 1 ? fields[first+1] : NULL;
+    tbk_encode1(&bd, tbk.dtype, vals + (size_t) usize * n, &conf);
+    ups[n].off = off;
+    ups[n].order = n;
+    n++;
+    free_fields(fields, nfields);
+  }
+  wzreader_close(r);
+  if (n_missing && idx_fname)
+    fprintf(stderr, "[%s] Warning: %"PRId64" rows not addressed in %s, skipped.\n", __func__, n_missing, idx_fname);
+  else if (n_missing)
+    fprintf(stderr, "[%s] Warning: %"PRId64" rows with a negative offset in %s, skipped.\n", __func__, n_missing, argv[optind+1]);
+  tbk_cache_close(cache);
+  if (tbx) tbx_destroy(tbx);
+
+  /* sort by offset, of duplicates keep the last */
+  ks_introsort(update, n, ups);
+  int64_t i, j, k;
+  for (i=0, k=0; i<n; ++i) {
+    if (i+1 < n && ups[i+1].off == ups[i].off) continue;
+    ups[k++] = ups[i];
+  }
+  n = k;
+
+  /* runs of consecutive offsets within the current data */
+  int64_t run_max = max(UPDATE_RUN_BYTES / usize, 1), n_runs = 0;
+  update_run_t *runs = malloc(sizeof(update_run_t) * (n + 1));
+  for (i=0; i<n && ups[i].off < tbk.nmax; ) {
+    runs[n_runs].beg = ups[i].off; runs[n_runs].i = i;
+    for (j=i+1; j<n && ups[j].off < tbk.nmax && ups[j].off == ups[j-1].off + 1 && j-i < run_max; ++j);
+    runs[n_runs++].n = j - i;
+    i = j;
+  }
+  int64_t n_in = i;
+  int64_t nmax = n > 0 ? max(tbk.nmax, ups[n-1].off + 1) : tbk.nmax;
+
+  int fd = fileno(tbf->fh);
+  struct stat st;
+  if (fstat(fd, &st)) wzfatal("Cannot stat %s.\n", fname);
+  uint8_t *buf = malloc((size_t) usize * run_max);
+
+  char *jname = NULL;
+  if (journal) {
+    jname = journal_fname(fname);
+    FILE *jh = fopen(jname, "wb");
+    if (!jh) wzfatal("Cannot write journal %s.\n", jname);
+    int64_t size = st.st_size;
+    fwrite("tbj", 4, 1, jh);
+    fwrite(&tbk.nmax, 8, 1, jh);
+    fwrite(&size, 8, 1, jh);
+    for (i=0; i<n_runs; ++i) {
+      int64_t pos = HDR_TOTALBYTES + runs[i].beg * usize, len = runs[i].n * usize;
+      pread_full(fd, buf, len, pos, fname);
+      fwrite(&pos, 8, 1, jh);
+      fwrite(&len, 8, 1, jh);
+      fwrite(buf, 1, len, jh);
+    }
+    if (fflush(jh) || fsync(fileno(jh)) || fclose(jh)) wzfatal("Cannot write journal %s.\n", jname);
+  }
+
+  /* the zone map and zoom levels no longer hold once values change */
+  drop_sidecar(fname, ".tbz");
+  drop_sidecar(fname, ".tbr");
+
+  /* in place, one pwrite per run */
+  for (i=0; i<n_runs; ++i) {
+    for (j=0; j<runs[i].n; ++j)
+      memcpy(buf + j * usize, vals + (size_t) usize * ups[runs[i].i+j].order, usize);
+    pwrite_full(fd, buf, runs[i].n * usize, HDR_TOTALBYTES + runs[i].beg * usize, fname);
+  }
+
+  /* appended sites, the gap is filled with nan */
+  int64_t o;
+  for (o = tbk.nmax, i = n_in; o < nmax; ) {
+    int64_t beg = o;
+    for (j=0; j<run_max && o < nmax; ++j, ++o) {
+      if (i < n && ups[i].off == o) memcpy(buf + j * usize, vals + (size_t) usize * ups[i++].order, usize);
+      else memcpy(buf + j * usize, na, usize);
+    }
+    pwrite_full(fd, buf, j * usize, HDR_TOTALBYTES + beg * usize, fname);
+  }
+  if (nmax != tbk.nmax) pwrite_full(fd, &nmax, HDR_NMAX, HDR_NMAX0, fname);
+
+  if (journal) {
+    if (fsync(fd)) wzfatal("Cannot write to %s.\n", fname);
+    unlink(jname);
+    free(jname);
+  }
+  tbf_close(tbf); free(tbf);
+
+  fprintf(stderr, "[%s] Updated %"PRId64" values, %"PRId64" appended, nmax %"PRId64".\n",
+          __func__, n, n - n_in, nmax);
+  free(ups); free(vals); free(runs); free(buf); free(na);
+  free(tbk.sname); free(idx_fname);
+  return 0;
+}
@@ -25,15 +25,23 @@
 **/
 
 #include <dirent.h>
+#include <ctype.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include "tbmate.h"
 #include "wzmisc.h"
 #include "wzio.h"
 #include "wzbed.h"
 #include "htslib/htslib/tbx.h"
 #include "htslib/htslib/hts.h"
+#include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/hfile.h"
 #include "htslib/htslib/regidx.h"
 #include "htslib/htslib/kstring.h"
+#include "htslib/htslib/ksort.h"
+#include "htslib/htslib/kseq.h"
 
 static void error(const char *format, ...) {
   va_list ap;
@@ -43,7 +51,7 @@ static void error(const char *format, ...) {
   exit(EXIT_FAILURE);
 }
 
-static char **parse_regions(char *regions_fname, char *region, int *nregs) {
+char **parse_regions(char *regions_fname, char *region, int *nregs) {
   kstring_t str = {0,0,0};
   int iseq = 0, ireg = 0;
   char **regs = NULL;
@@ -100,37 +108,215 @@ static char **parse_regions(char *regions_fname, char *region, int *nregs) {
   return regs;
 }
 
+/* Region planner for the row-printing paths. Regions from -R and -g are
+   parsed straight into tid/beg/end. Unless keep_order is set, they are
+   sorted in index order and overlapping or adjacent regions are merged, so
+   every index line is printed once and neighbouring regions share BGZF
+   blocks. Regions on sequences absent from the index are dropped. */
+
+#define region_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(region, tbk_region_t, region_lt)
+
+/* a -g item: ".", "*", "chr", "chr:beg" or "chr:beg-end" (1-based) */
+static int region_from_string(tbx_t *tbx, const char *s, tbk_region_t *r) {
+  if (strcmp(s, ".") == 0) { r->tid = HTS_IDX_START; r->beg = r->end = 0; return 0; }
+  if (strcmp(s, "*") == 0) { r->tid = HTS_IDX_NOCOOR; r->beg = r->end = 0; return 0; }
+  const char *q = hts_parse_reg(s, &r->beg, &r->end);
+  if (q) {
+    char *tmp = strndup(s, q - s);
+    r->tid = tbx_name2id(tbx, tmp);
+    free(tmp);
+  } else {                      /* possibly a sequence named "foo:a" */
+    r->tid = tbx_name2id(tbx, s);
+    r->beg = 0; r->end = INT_MAX;
+  }
+  return r->tid >= 0 ? 0 : -1;
+}
+
+/* a -R line, .bed files are 0-based half-open, others are "chr pos" or
+   "chr beg end" 1-based inclusive as in regidx */
+static int region_from_line(tbx_t *tbx, char *line, int is_bed, tbk_region_t *r) {
+  char *ss = line, *se;
+  while (*ss && isspace(*ss)) ss++;
+  if (!*ss || *ss == '#') return -1;
+  se = ss;
+  while (*se && !isspace(*se)) se++;
+  if (!*se) wzfatal("Could not parse region line: %s\n", line);
+  *se = '\0';
+  r->tid = tbx_name2id(tbx, ss);
+
+  ss = se + 1;
+  int64_t beg = hts_parse_decimal(ss, &se, 0), end;
+  if (ss == se) wzfatal("Could not parse region line: %s\n", line);
+  ss = se;
+  while (*ss && isspace(*ss)) ss++;
+  end = *ss ? hts_parse_decimal(ss, &se, 0) : 0;
+  if (is_bed) {
+    if (!*ss || ss == se) wzfatal("Could not parse bed line: %s\n", line);
+  } else {
+    if (!*ss || ss == se) end = beg;
+    beg--;
+  }
+  r->beg = max(0, beg); r->end = min(end, INT_MAX);
+  return r->tid >= 0 ? 0 : -1;
+}
+
+static int is_bed_fname(const char *fname) {
+  int len = strlen(fname);
+  return (len >= 7 && !strcasecmp(".bed.gz", fname+len-7)) ||
+    (len >= 8 && !strcasecmp(".bed.bgz", fname+len-8)) ||
+    (len >= 4 && !strcasecmp(".bed", fname+len-4));
+}
+
+tbk_region_t *plan_regions(tbx_t *tbx, char *regions_fname, char *region, int keep_order, int *n) {
+  tbk_region_t *regs = NULL, r;
+  int m = 0;
+  *n = 0;
+
+  if (regions_fname) {
+    htsFile *fp = hts_open(regions_fname, "r");
+    if (!fp) error("Could not read %s\n", regions_fname);
+    int is_bed = is_bed_fname(regions_fname);
+    kstring_t str = {0,0,0};
+    while (hts_getline(fp, KS_SEP_LINE, &str) >= 0) {
+      if (region_from_line(tbx, str.s, is_bed, &r) < 0) continue;
+      if (*n == m) { m = m ? m<<1 : 1024; regs = realloc(regs, sizeof(tbk_region_t) * m); }
+      regs[(*n)++] = r;
+    }
+    free(str.s);
+    hts_close(fp);
+  }
+
+  if (region) {
+    char **fields; int nfields, i;
+    line_get_fields(region, ",", &fields, &nfields);
+    for (i=0; i<nfields; ++i) {
+      if (region_from_string(tbx, fields[i], &r) < 0) continue;
+      if (*n == m) { m = m ? m<<1 : 16; regs = realloc(regs, sizeof(tbk_region_t) * m); }
+      regs[(*n)++] = r;
+    }
+    free_fields(fields, nfields);
+  }
+
+  /* whole file */
+  if (!regions_fname && !region) {
+    regs = malloc(sizeof(tbk_region_t));
+    regs[0].tid = HTS_IDX_START; regs[0].beg = regs[0].end = 0;
+    *n = 1;
+  }
+
+  if (keep_order || *n < 2) return regs;
+
+  ks_introsort(region, *n, regs);
+  if (regs[0].tid == HTS_IDX_START) { *n = 1; return regs; }
+  int i, k = 0;
+  for (i=1; i<*n; ++i) {
+    if (regs[i].tid == regs[k].tid && regs[i].beg <= regs[k].end) {
+      if (regs[i].end > regs[k].end) regs[k].end = regs[i].end;
+    } else regs[++k] = regs[i];
+  }
+  *n = k+1;
+  return regs;
+}
+
+int tbk_prof_on = 0;
+__thread tbk_prof_t tbk_prof;
+static tbk_prof_t tbk_prof_total;
+static pthread_mutex_t tbk_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static double tbk_prof_t0;
+
+void tbk_prof_start_thread() {
+  memset(&tbk_prof, 0, sizeof(tbk_prof));
+  tbk_prof.t_last = prof_now();
+  tbk_prof.cur = PROF_OTHER;
+}
+
+void tbk_prof_start() {
+  tbk_prof_on = 1;
+  tbk_prof_start_thread();
+  tbk_prof_t0 = tbk_prof.t_last;
+}
+
+void tbk_prof_merge_thread() {
+  int i;
+  prof_switch(tbk_prof.cur);
+  pthread_mutex_lock(&tbk_prof_lock);
+  for (i=0; i<PROF_N; ++i) tbk_prof_total.t[i] += tbk_prof.t[i];
+  tbk_prof_total.bytes_read     += tbk_prof.bytes_read;
+  tbk_prof_total.n_reads        += tbk_prof.n_reads;
+  tbk_prof_total.n_seeks        += tbk_prof.n_seeks;
+  tbk_prof_total.n_seeks_elided += tbk_prof.n_seeks_elided;
+  tbk_prof_total.n_rows         += tbk_prof.n_rows;
+  tbk_prof_total.n_cells        += tbk_prof.n_cells;
+  pthread_mutex_unlock(&tbk_prof_lock);
+  tbk_prof_start_thread();
+}
+
+/* phase times are summed over threads, so under -@ they can exceed wall */
+void tbk_prof_report(const char *cmd, FILE *fh) {
+  static const char *names[PROF_N] = {
+    "other", "index", "parse", "seek", "read", "decode", "format", "write"};
+  if (!tbk_prof_on) return;
+  tbk_prof_merge_thread();
+  tbk_prof_t *pr = &tbk_prof_total;
+  double wall = prof_now() - tbk_prof_t0;
+  int i;
+  fprintf(fh, "[profile] %s wall %.3f s\n", cmd, wall);
+  fprintf(fh, "[profile] phase\tseconds\tpercent\n");
+  for (i=0; i<PROF_N; ++i) {
+    fprintf(fh, "[profile] %s\t%.3f\t%.1f\n", names[i], pr->t[i],
+            wall > 0 ? 100.0 * pr->t[i] / wall : 0.0);
+  }
+  fprintf(fh, "[profile] bytes_read\t%"PRId64"\n", pr->bytes_read);
+  fprintf(fh, "[profile] reads\t%"PRId64"\n", pr->n_reads);
+  fprintf(fh, "[profile] seeks\t%"PRId64"\n", pr->n_seeks);
+  fprintf(fh, "[profile] seeks_elided\t%"PRId64"\n", pr->n_seeks_elided);
+  fprintf(fh, "[profile] rows\t%"PRId64"\n", pr->n_rows);
+  fprintf(fh, "[profile] cells\t%"PRId64"\n", pr->n_cells);
+  if (wall > 0) fprintf(fh, "[profile] rows_per_s\t%.0f\n", pr->n_rows / wall);
+}
+
 void tbk_query(tbk_t *tbk, int64_t offset, view_conf_t *conf, FILE *out_fh, char **aux) {
 
   /* when the offset is unfound */
   if (offset < 0) { fputs("\t-1", out_fh); return; }
   if (offset >= tbk->nmax) {wzfatal("Error: query %d out of range. Wrong idx file?", offset);}
 
+  /* sparse and split tbks are read into one unit, then formatted as in
+     chunk reading */
+  if (tbk->sparse || tbk->split) {
+    int us = unit_size(tbk->dtype);
+    uint8_t raw[8] = {0};
+    tbk_sparse_t *sp = tbk->sparse;
+    if (!sp) {
+      tbk_seek_offset(tbk, offset*4);
+      tbf_read(tbk->tbf, raw, 4, 1);
+      if (!tbk->skip_second) tbk_split_second(tbk->split, offset, raw + 4);
+    } else if (tbk_sparse_present(sp, offset)) {
+      tbk_seek_offset(tbk, sp->values + tbk_sparse_count(sp, offset) * us);
+      tbf_read(tbk->tbf, raw, us, 1);
+    } else memcpy(raw, sp->fill, us);
+    static __thread tbk_data_t d;   /* kept, a query is one unit */
+    static __thread kstring_t ks;
+    d.dtype = tbk->dtype; d.n = 1; ks.l = 0;
+    tbk_decode_n(raw, 1, &d);
+    tbk_print1(&d, 0, conf, &ks);
+    fwrite(ks.s, 1, ks.l, out_fh);
+    return;
+  }
+
   switch(DATA_TYPE(tbk->dtype)) {
-  /* case DT_INT1: { */
-  /*   if(tbk->offset == 0 || offset/8 != tbk->offset-1) { /\* need to read? *\/ */
-  /*     if(offset/8 != tbk->offset) {                     /\* need to seek? *\/ */
-  /*       tbk->offset = offset/8; */
-  /*       if(fseek(tbk->fh, offset/8+HDR_TOTALBYTES, SEEK_SET)) */
-  /*         wzfatal("File %s cannot be seeked.\n", tbk->fname); */
-  /*     } */
-  /*     fread(&(tbk->data), 1, 1, tbk->fh); tbk->offset++; */
-  /*   } */
-  /*   fprintf(out_fh, "\t%d", ((tbk->data)>>(offset%8)) & 0x1); */
-  /*   break; */
-  /* } */
-  /* case DT_INT2: { */
-  /*   if(tbk->offset == 0 || offset/4 != tbk->offset-1) { /\* need to read? *\/ */
-  /*     if(offset/4 != tbk->offset) {                       /\* need to seek? *\/ */
-  /*       tbk->offset = offset/4; */
-  /*       if(fseek(tbk->fh, offset/4+HDR_TOTALBYTES, SEEK_SET)) */
-  /*         wzfatal("File %s cannot be seeked.\n", tbk->fname); */
-  /*     } */
-  /*     fread(&(tbk->data), 1, 1, tbk->fh); tbk->offset++; */
-  /*   } */
-  /*   fprintf(out_fh, "\t%d", ((tbk->data)>>((offset%4)*2)) & 0x3); */
-  /*   break; */
-  /* } */
+  case DT_INT1: case DT_INT2: {
+    /* consecutive rows mostly fall in the byte read last */
+    int64_t at = tbk->offset_sample_beg + HDR_TOTALBYTES + unit_byte(tbk->dtype, offset) + 1;
+    if (tbk->data_at != at) {
+      tbk_seek_n(tbk, offset);
+      tbf_read(tbk->tbf, &tbk->data, 1, 1);
+      tbk->data_at = at;
+    }
+    fprintf(out_fh, "\t%d", unit_sub_byte(tbk->dtype, tbk->data, offset));
+    break;
+  }
   case DT_INT32: {
     tbk_seek_n(tbk, offset);
     int data;
@@ -199,6 +385,25 @@ void tbk_query(tbk_t *tbk, int64_t offset, view_conf_t *conf, FILE *out_fh, char
     /* fprintf(out_fh, "\t%d", data); */
     break;
   }
+  case DT_BETA8: {
+    tbk_seek_n(tbk, offset);
+    uint8_t data;
+    tbf_read(tbk->tbf, &data, 1, 1);
+    if (data == BETA8_NA) {
+      fputc('\t', out_fh); fputs(conf->na_token, out_fh);
+    } else fprintf(out_fh, "\t%.*f", conf->precision, beta8_to_float(data));
+    break;
+  }
+  case DT_HALF: {
+    tbk_seek_n(tbk, offset);
+    uint16_t h;
+    tbf_read(tbk->tbf, &h, 2, 1);
+    float data = half_to_float(h);
+    if (conf->na_for_negative && data < 0) {
+      fputc('\t', out_fh); fputs(conf->na_token, out_fh);
+    } else fprintf(out_fh, "\t%f", data);
+    break;
+  }
   case DT_FLOAT_INT: {
     tbk_seek_n(tbk, offset);
     
@@ -241,71 +446,455 @@ void tbk_query(tbk_t *tbk, int64_t offset, view_conf_t *conf, FILE *out_fh, char
   }
 }
 
-static int query_regions(
-  char *fname, char **regs, int nregs,
-  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
-  
-  int i;
-  htsFile *fp = hts_open(fname,"r");
-  if(!fp) error("Could not read %s\n", fname);
+/* query_regions_range from the coordinate cache, no tabix or text parsing */
+static void query_regions_range_cached(
+  tbk_region_t *regs, int beg, int end,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh,
+  int print_header, int *first_nfields) {
 
-  tbx_t *tbx = tbx_index_load(fname);
-  if(!tbx) error("Could not load .tbi/.csi index of %s\n", fname);
-  kstring_t str = {0,0,0};
-  const char **seq = NULL;
-  
-  char **fields = NULL;
-  int nfields = -1;
-  char *aux = NULL; char *aux2 = NULL;
-  
-  int offset, ii, k;
-  int linenum=0;
-  for(i=0; i<nregs; i++) {
-    hts_itr_t *itr = tbx_itr_querys(tbx, regs[i]);
-    if(!itr) continue;
-    while (tbx_itr_next(fp, tbx, itr, &str) >= 0) {
-
-      line_get_fields2(str.s, "\t", &fields, &nfields, &aux);
-      
-      if (nfields < 3)
-        wzfatal("[%s:%d] Bed file has fewer than 3 columns.\n", __func__, __LINE__);
-
-      if (!linenum && conf->column_name) {
-        tbk_print_columnnames(tbks, n_tbks, nfields, out_fh, conf);
+  tbk_cache_t *c = conf->cache;
+  kstring_t ks = {0,0,0};
+  char *aux2 = NULL;
+  int64_t lo, hi, j;
+  int i, k, tid;
+  for (i=beg; i<end; ++i) {
+    int p = prof_enter(PROF_INDEX);
+    tbk_cache_range(c, &regs[i], &lo, &hi);
+    for (j=lo, tid=-1; j<hi; ++j) {
+      if (!tbk_cache_overlap(c, &regs[i], j)) continue;
+      if (*first_nfields < 0) {
+        *first_nfields = 4;
+        if (print_header) tbk_print_columnnames(tbks, n_tbks, 4, out_fh, conf);
+      }
+      if (c->off[j] < 0 && !conf->show_unaddressed) continue;
+
+      prof_enter(PROF_FORMAT);
+      if (regs[i].tid == HTS_IDX_START) { /* rows span sequences */
+        while (tid < 0 || j >= c->seq_beg[tid+1]) tid++;
+      } else tid = regs[i].tid;
+      ks.l = 0;
+      kputs(c->seqnames[tid], &ks); kputc('\t', &ks);
+      kputw(c->beg[j], &ks); kputc('\t', &ks);
+      kputw(c->end[j], &ks);
+      fputs(ks.s, out_fh);
+      for (k=0; k<n_tbks; ++k) tbk_query(&tbks[k], c->off[j], conf, out_fh, &aux2);
+      fputc('\n', out_fh);
+      PROF_COUNT(n_rows, 1);
+      PROF_COUNT(n_cells, n_tbks);
+      prof_enter(PROF_INDEX);
+    }
+    prof_leave(p);
+  }
+  free(ks.s); free(aux2);
+}
+
+/* query regs[beg..end) and write the rows to out_fh. *first_nfields keeps
+   the number of fields of the first index line, -1 if there was none, and
+   the column header is printed before it when print_header is set. With
+   read_ahead the index is read on its own thread. */
+static void query_regions_range(
+  htsFile *fp, tbx_t *tbx, tbk_region_t *regs, int beg, int end,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh,
+  int print_header, int *first_nfields, int read_ahead) {
+
+  if (conf->cache) {
+    query_regions_range_cached(regs, beg, end, tbks, n_tbks, conf, out_fh, print_header, first_nfields);
+    return;
+  }
+
+  char *aux2 = NULL;
+  int j, k;
+  int p = prof_enter(PROF_INDEX);
+  idx_reader_t *r = idx_reader_open(fp, tbx, regs + beg, end - beg, read_ahead);
+  idx_batch_t *b;
+  while ((b = idx_reader_next(r))) {
+    for (j=0; j<b->n; ++j) {
+      char *line = b->text.s + b->pos[j];
+      if (*first_nfields < 0) {
+        int nfields = 1; char *l;
+        for (l = line; *l; ++l) if (*l == '\t') nfields++;
+        *first_nfields = nfields;
+        if (print_header) tbk_print_columnnames(tbks, n_tbks, nfields, out_fh, conf);
       }
-      linenum++;
-      
-      ensure_number2(fields[3]);
-      offset = atoi(fields[3]);
 
+      int64_t offset = b->off[j];
       if (offset >= 0 || conf->show_unaddressed) {
-        fputs(fields[0], out_fh);
-        fputc('\t', out_fh);
-        fputs(fields[1], out_fh);
-        fputc('\t', out_fh);
-        fputs(fields[2], out_fh);
-        if (conf->print_all) {
-          for(ii=3; ii<nfields; ++ii)
-            fprintf(out_fh, "\t%s", fields[ii]);
-        }
+        prof_enter(PROF_FORMAT);
+        if (conf->print_all) fputs(line, out_fh);
+        else fwrite(line, 1, b->len3[j], out_fh);
 
         for(k=0; k<n_tbks; ++k) tbk_query(&tbks[k], offset, conf, out_fh, &aux2);
         fputc('\n', out_fh);
+        PROF_COUNT(n_rows, 1);
+        PROF_COUNT(n_cells, n_tbks);
+        prof_enter(PROF_INDEX);
       }
     }
-    tbx_itr_destroy(itr);
   }
+  idx_reader_close(r);
+  prof_leave(p);
+  free(aux2);
+}
 
-  free(aux); free(aux2);
-  free_fields(fields, nfields);
-  free(seq);
-  free(str.s);
-  tbx_destroy(tbx);
+/* Region sharding for -@. Contiguous runs of regions are formatted by
+   workers into private buffers and written by the main thread in input
+   order. At most `window` shards are in flight, bounding the memory. */
+typedef struct view_shard_t {
+  int beg, end;
+  char *buf;
+  size_t len;
+  int first_nfields;
+  int done;
+} view_shard_t;
+
+typedef struct view_pool_t {
+  char *fname;
+  tbx_t *tbx;                   /* shared, only read */
+  tbk_region_t *regs;
+  tbk_t *tbks;
+  int n_tbks;
+  view_conf_t *conf;
+  view_shard_t *shards;
+  int n_shards;
+  int next;                     /* next shard to claim */
+  int n_emitted;                /* shards written by the main thread */
+  int window;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} view_pool_t;
+
+static void *view_worker(void *arg) {
+  view_pool_t *pool = (view_pool_t*) arg;
+
+  htsFile *fp = hts_open(pool->fname,"r");
+  if(!fp) error("Could not read %s\n", pool->fname);
+
+  /* tbks of a bundle share one private handle */
+  int k, n_tbfs = 0;
+  tbk_t *tbks = malloc(sizeof(tbk_t) * pool->n_tbks);
+  tbf_t *tbfs = calloc(pool->n_tbks, sizeof(tbf_t));
+  for (k=0; k<pool->n_tbks; ++k) {
+    if (k == 0 || pool->tbks[k].tbf != pool->tbks[k-1].tbf)
+      tbk_open_private(&pool->tbks[k], &tbks[k], &tbfs[n_tbfs++]);
+    else {
+      tbks[k] = pool->tbks[k];
+      tbks[k].tbf = &tbfs[n_tbfs-1];
+    }
+  }
+  if (tbk_prof_on) tbk_prof_start_thread();
 
-  if(hts_close(fp)) error("hts_close returned non-zero status: %s\n", fname);
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->n_shards && pool->next >= pool->n_emitted + pool->window)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    int i = pool->next < pool->n_shards ? pool->next++ : -1;
+    pthread_mutex_unlock(&pool->lock);
+    if (i < 0) break;
+
+    view_shard_t *sh = &pool->shards[i];
+    FILE *out = open_memstream(&sh->buf, &sh->len);
+    if (!out) wzfatal("Cannot allocate output buffer.\n");
+    query_regions_range(fp, pool->tbx, pool->regs, sh->beg, sh->end,
+                        tbks, pool->n_tbks, pool->conf, out, 0, &sh->first_nfields, 0);
+    fclose(out);
+
+    pthread_mutex_lock(&pool->lock);
+    sh->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  if (tbk_prof_on) tbk_prof_merge_thread();
+  for (k=0; k<n_tbfs; ++k) tbf_close(&tbfs[k]);
+  free(tbfs); free(tbks);
+  if(hts_close(fp)) error("hts_close returned non-zero status: %s\n", pool->fname);
+  return NULL;
+}
+
+/* every worker holds one handle per tbk file, stay under the fd limit */
+static int view_max_threads(tbk_t *tbks, int n_tbks, int n_threads) {
+  int k, n_tbfs = 0;
+  for (k=0; k<n_tbks; ++k)
+    if (k == 0 || tbks[k].tbf != tbks[k-1].tbf) n_tbfs++;
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    int64_t avail = (int64_t) rl.rlim_cur - n_tbfs - 64;
+    int lim = avail > 0 ? (int) min(avail / (n_tbfs + 2), INT_MAX) : 1;
+    if (n_threads > lim) {
+      fprintf(stderr, "[%s] Warning: %d threads would exceed the open file limit, using %d.\n",
+              __func__, n_threads, max(lim, 1));
+      n_threads = max(lim, 1);
+    }
+  }
+  return n_threads;
+}
+
+static void query_regions_parallel(
+  char *fname, tbx_t *tbx, tbk_region_t *regs, int nregs,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+
+  int n_threads = view_max_threads(tbks, n_tbks, conf->n_threads);
+  int shard_size = max(1, min(1024, nregs / (n_threads * 8)));
+
+  view_pool_t pool = {0};
+  pool.fname = fname; pool.tbx = tbx; pool.regs = regs;
+  pool.tbks = tbks; pool.n_tbks = n_tbks; pool.conf = conf;
+  pool.n_shards = (nregs + shard_size - 1) / shard_size;
+  pool.shards = calloc(pool.n_shards, sizeof(view_shard_t));
+  pool.window = n_threads * 4;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  int i;
+  for (i=0; i<pool.n_shards; ++i) {
+    pool.shards[i].beg = i * shard_size;
+    pool.shards[i].end = min(nregs, (i+1) * shard_size);
+    pool.shards[i].first_nfields = -1;
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  for (i=0; i<n_threads; ++i) pthread_create(&threads[i], NULL, view_worker, &pool);
+
+  int header_done = !conf->column_name;
+  for (i=0; i<pool.n_shards; ++i) {
+    view_shard_t *sh = &pool.shards[i];
+    pthread_mutex_lock(&pool.lock);
+    while (!sh->done) pthread_cond_wait(&pool.cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!header_done && sh->first_nfields >= 0) {
+      tbk_print_columnnames(tbks, n_tbks, sh->first_nfields, out_fh, conf);
+      header_done = 1;
+    }
+    int p = prof_enter(PROF_WRITE);
+    fwrite(sh->buf, 1, sh->len, out_fh);
+    prof_leave(p);
+    free(sh->buf); sh->buf = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.n_emitted++;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+  }
 
-  for(i=0; i<nregs; i++) free(regs[i]);
-  free(regs);
+  for (i=0; i<n_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.cond);
+  free(pool.shards);
+}
+
+static int query_regions(
+  char *fname, tbx_t *tbx, tbk_region_t *regs, int nregs,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+  
+  if (conf->n_threads > 1 && nregs > 1) {
+    query_regions_parallel(fname, tbx, regs, nregs, tbks, n_tbks, conf, out_fh);
+  } else {
+    htsFile *fp = hts_open(fname,"r");
+    if(!fp) error("Could not read %s\n", fname);
+
+    int first_nfields = -1;
+    query_regions_range(fp, tbx, regs, 0, nregs, tbks, n_tbks, conf, out_fh,
+                        conf->column_name, &first_nfields, 1);
+    if(hts_close(fp)) error("hts_close returned non-zero status: %s\n", fname);
+  }
+  return 0;
+}
+
+/* rows per uncompressed byte and uncompressed bytes per compressed byte
+   of idx.gz, from its first BGZF block */
+static void bgzf_density(char *fname, double *rows_per_byte, double *ratio) {
+  BGZF *fp = bgzf_open(fname, "r");
+  if (!fp) error("Could not read %s\n", fname);
+  *rows_per_byte = 0; *ratio = 1;
+  if (bgzf_read_block(fp) == 0 && fp->block_length > 0) {
+    const char *s = (const char*) fp->uncompressed_block;
+    int i, n = 0;
+    for (i=0; i<fp->block_length; ++i) n += s[i] == '\n';
+    *rows_per_byte = (double) n / fp->block_length;
+    off_t clen = htell(fp->fp);
+    if (clen > 0) *ratio = (double) fp->block_length / clen;
+  }
+  bgzf_close(fp);
+}
+
+/* number of index rows covered by the regions, to plan the reads. Exact
+   from the .tbc cache if open, else whole sequences are taken from the
+   index statistics and ranges estimated from the BGZF span of their
+   index chunks, without reading them. */
+static int64_t count_region_rows(char *fname, tbx_t *tbx, tbk_cache_t *cache, tbk_region_t *regs, int nregs) {
+
+  int64_t n = 0, lo, hi;
+  int i, j, tid, nseq;
+  double rows_per_byte = -1, ratio = 1, bytes = 0;
+  uint64_t mapped, unmapped;
+  if (cache) {
+    for (i=0; i<nregs; ++i) {
+      tbk_cache_range(cache, &regs[i], &lo, &hi);
+      n += hi - lo;
+    }
+    return n;
+  }
+  for (i=0; i<nregs; ++i) {
+    if (regs[i].tid == HTS_IDX_START) {
+      const char **seqs = tbx_seqnames(tbx, &nseq);
+      for (tid=0; tid<nseq; ++tid)
+        if (hts_idx_get_stat(tbx->idx, tid, &mapped, &unmapped) == 0) n += mapped;
+      free(seqs);
+    } else if (regs[i].beg == 0 && regs[i].end == INT_MAX &&
+               hts_idx_get_stat(tbx->idx, regs[i].tid, &mapped, &unmapped) == 0) {
+      n += mapped;
+    } else {
+      hts_itr_t *itr = tbx_itr_queryi(tbx, regs[i].tid, regs[i].beg, regs[i].end);
+      if (!itr) continue;
+      if (rows_per_byte < 0) bgzf_density(fname, &rows_per_byte, &ratio);
+      for (j=0; j<itr->n_off; ++j) {
+        uint64_t u = itr->off[j].u, v = itr->off[j].v;
+        bytes += (double) ((v>>16) - (u>>16)) * ratio + (double) (v&0xffff) - (double) (u&0xffff);
+      }
+      tbx_itr_destroy(itr);
+    }
+  }
+  return n + (int64_t) (bytes * rows_per_byte + 0.5);
+}
+
+/* -P lookup. Probes are resolved through the name index and read in
+   blocks: each block is sorted by tbk offset so the tbk files are read
+   forward, formatted into a buffer and written in the requested order.
+   Seqname, start and end come from the coordinate cache of the index;
+   the full lines under -a, or without a cache, are read back from
+   idx.gz the same way, sorted by their position in it. */
+typedef struct probe_t {
+  int64_t off;
+  int i;                        /* position in the block */
+} probe_t;
+
+#define probe_lt(a, b) ((a).off < (b).off || ((a).off == (b).off && (a).i < (b).i))
+KSORT_INIT(probe, probe_t, probe_lt)
+
+#define PROBE_BLOCK 65536
+
+/* the index line at voff, without reloading the block if it is the
+   one already decompressed */
+static void probe_index_line(BGZF *fp, int64_t voff, kstring_t *line) {
+  if (fp->block_length && fp->block_address == voff >> 16) fp->block_offset = voff & 0xFFFF;
+  else if (bgzf_seek(fp, voff, SEEK_SET) < 0) voff = -1;
+  if (voff < 0 || bgzf_getline(fp, '\n', line) < 0)
+    wzfatal("[%s] Cannot read the index line at %"PRId64".\n", __func__, voff);
+}
+
+static void query_probe_block(
+  tbk_names_t *nm, tbk_cache_t *c, BGZF *idx_fp, int64_t *rows, int n, probe_t *sorted,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+
+  int p = prof_enter(PROF_FORMAT);
+  int i, k;
+  for (i=0; i<n; ++i) { sorted[i].off = nm->off[rows[i]]; sorted[i].i = i; }
+  ks_introsort(probe, n, sorted);
+
+  char *buf = NULL; size_t size = 0; char *aux2 = NULL;
+  long *pos = malloc(sizeof(long) * n), *len = malloc(sizeof(long) * n);
+  FILE *ms = open_memstream(&buf, &size);
+  for (i=0; i<n; ++i) {
+    pos[sorted[i].i] = ftell(ms);
+    for (k=0; k<n_tbks; ++k) tbk_query(&tbks[k], sorted[i].off, conf, ms, &aux2);
+    len[sorted[i].i] = ftell(ms) - pos[sorted[i].i];
+  }
+  fclose(ms);
+
+  /* the index lines, read forward through idx.gz */
+  prof_enter(PROF_INDEX);
+  kstring_t text = {0,0,0}, line = {0,0,0};
+  size_t *lpos = malloc(sizeof(size_t) * n);
+  if (!c) {
+    for (i=0; i<n; ++i) { sorted[i].off = nm->voff[rows[i]]; sorted[i].i = i; }
+    ks_introsort(probe, n, sorted);
+    for (i=0; i<n; ++i) {
+      if (i && sorted[i].off == sorted[i-1].off) { lpos[sorted[i].i] = lpos[sorted[i-1].i]; continue; }
+      probe_index_line(idx_fp, sorted[i].off, &line);
+      lpos[sorted[i].i] = text.l;
+      kputsn(line.s, line.l, &text); kputc('\0', &text);
+    }
+  }
+
+  prof_enter(PROF_WRITE);
+  for (i=0; i<n; ++i) {
+    if (c) {                    /* seqname, start and end */
+      fprintf(out_fh, "%s\t%d\t%d", c->seqnames[tbk_cache_tid(c, rows[i])], c->beg[rows[i]], c->end[rows[i]]);
+    } else {
+      char *l = text.s + lpos[i], *q = l;
+      if (!conf->print_all) {
+        for (k=0; k<3 && (q = strchr(q, '\t')); ++k) q++;
+        fwrite(l, 1, q ? (size_t) (q - l - 1) : strlen(l), out_fh);
+      } else fputs(l, out_fh);
+    }
+    fwrite(buf + pos[i], 1, len[i], out_fh);
+    fputc('\n', out_fh);
+  }
+  PROF_COUNT(n_rows, n);
+  PROF_COUNT(n_cells, (int64_t) n * n_tbks);
+  free(buf); free(pos); free(len); free(aux2);
+  free(text.s); free(line.s); free(lpos);
+  prof_leave(p);
+}
+
+static int query_probes(
+  char *idx_fname, int name_col, char *probes_fname,
+  tbk_t *tbks, int n_tbks, view_conf_t *conf, FILE *out_fh) {
+
+  int p = prof_enter(PROF_INDEX);
+  tbk_names_t *nm = tbk_names_open(idx_fname, name_col);
+  BGZF *idx_fp = bgzf_open(idx_fname, "r");
+  if (!nm || !idx_fp) wzfatal("Cannot read %s.\n", idx_fname);
+  bgzf_set_cache_size(idx_fp, 1<<24);
+
+  tbk_cache_t *c = NULL;
+  tbx_t *tbx = conf->print_all ? NULL : tbx_index_load(idx_fname);
+  if (tbx && tbx->conf.preset == TBX_UCSC && tbx->conf.sc == 1 && tbx->conf.bc == 2 && tbx->conf.ec == 3)
+    c = tbk_cache_open(idx_fname, tbx, 1);
+  if (c && c->n_rows != nm->n_rows) { tbk_cache_close(c); c = NULL; }
+  if (tbx) tbx_destroy(tbx);
+
+  wzreader_t *r = wzreader_open(probes_fname);
+  int64_t *rows = malloc(sizeof(int64_t) * PROBE_BLOCK), row, n_missing = 0;
+  probe_t *sorted = malloc(sizeof(probe_t) * PROBE_BLOCK);
+  char *line; size_t len;
+  int n = 0, header_done = !conf->column_name;
+  while ((line = wzreader_line(r, &len))) {
+    char *name = line, *q;
+    while (isspace((unsigned char) *name)) name++;
+    for (q = name; *q && !isspace((unsigned char) *q); ++q);
+    *q = '\0';
+    if (!*name || *name == '#') continue;
+
+    if ((row = tbk_names_get(nm, name)) < 0) { n_missing++; continue; }
+    if (nm->off[row] < 0 && !conf->show_unaddressed) continue;
+    if (!header_done) {
+      int nfields = 1;
+      kstring_t l = {0,0,0};
+      probe_index_line(idx_fp, nm->voff[row], &l);
+      for (q = l.s; *q; ++q) if (*q == '\t') nfields++;
+      free(l.s);
+      tbk_print_columnnames(tbks, n_tbks, nfields, out_fh, conf);
+      header_done = 1;
+    }
+    rows[n++] = row;
+    if (n == PROBE_BLOCK) {
+      query_probe_block(nm, c, idx_fp, rows, n, sorted, tbks, n_tbks, conf, out_fh);
+      n = 0;
+    }
+  }
+  if (n) query_probe_block(nm, c, idx_fp, rows, n, sorted, tbks, n_tbks, conf, out_fh);
+  if (n_missing)
+    fprintf(stderr, "[%s] Warning: %"PRId64" names not found in column %d of %s, see --name-col.\n",
+            __func__, n_missing, nm->name_col, idx_fname);
+
+  free(rows); free(sorted);
+  wzreader_close(r);
+  bgzf_close(idx_fp);
+  tbk_cache_close(c);
+  tbk_names_close(nm);
+  prof_leave(p);
   return 0;
 }
 
@@ -315,6 +904,8 @@ static int usage(view_conf_t *conf) {
   fprintf(stderr, "\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "    -o        optional file output\n");
+  fprintf(stderr, "    -O        output format, bed or bed.gz [bed]. bed.gz is bgzipped and\n");
+  fprintf(stderr, "              indexed into <out>.tbi as it is written, it needs -o.\n");
   fprintf(stderr, "    -i        index, a tabix-ed bed file. Column 4 is the .tbk offset.\n");
   fprintf(stderr, "              if not given search for idx.gz and idx.gz.tbi in the folder\n");
   fprintf(stderr, "              containing the first tbk file.\n");
@@ -329,18 +920,41 @@ static int usage(view_conf_t *conf) {
   fprintf(stderr, "    -p        precision used to print float[%d]\n", conf->precision);
   fprintf(stderr, "    -u        show unaddressed (use -1)\n");
   fprintf(stderr, "    -R        file listing the regions\n");
+  fprintf(stderr, "    -P        file listing names to look up, e.g., probe IDs, one per line.\n");
+  fprintf(stderr, "              Rows are printed in the order listed. Builds <idx>.tbn, and\n");
+  fprintf(stderr, "              <idx>.tbc unless -a.\n");
+  fprintf(stderr, "    --name-col  column of the index holding the names for -P [5].\n");
+  fprintf(stderr, "    --keep-order  query -R/-g regions as given. By default they are sorted\n");
+  fprintf(stderr, "              and overlapping regions merged, so each row is printed once.\n");
   fprintf(stderr, "    -s        min coverage for float.int (%d)\n", conf->min_coverage);
   fprintf(stderr, "    -t        max p-value for float.float (%f)\n", conf->max_pval);
+  fprintf(stderr, "    -@        threads, regions are split among them [1], valid without -k.\n");
   fprintf(stderr, "    -k        read data in chunk\n");
   fprintf(stderr, "    -m        chunk size for index [%d], valid under -k.\n", conf->n_chunk_index);
   fprintf(stderr, "    -n        chunk size for data [%d], valid under -k.\n", conf->n_chunk_data);
+  fprintf(stderr, "    --mem     memory budget, e.g., 2G. Chooses -k and the chunk sizes\n");
+  fprintf(stderr, "              unless given explicitly.\n");
+  fprintf(stderr, "    -v        report the plan chosen under --mem to stderr\n");
+  fprintf(stderr, "    --summarize mean|median|count|sum\n");
+  fprintf(stderr, "              one row per region and one column per sample, negative\n");
+  fprintf(stderr, "              values are treated as missing.\n");
+  fprintf(stderr, "    --cache   build <idx>.tbc, a coordinate-to-offset cache of the index, if\n");
+  fprintf(stderr, "              missing or stale. A valid cache is always used, except under -a.\n");
+  fprintf(stderr, "    --where   print only rows matching a predicate over the samples, e.g.,\n");
+  fprintf(stderr, "              'any(v>0.8)', 'all(cov>=10)', 'frac(!na)>=0.5,any(v<0.2&cov>=5)'.\n");
+  fprintf(stderr, "              Blocks are skipped using zone maps from pack --zonemap. Implies -k.\n");
+  fprintf(stderr, "    --resolution bp, print one row per bin of the coarsest zoom level at most bp\n");
+  fprintf(stderr, "              wide, with the mean of each sample (-b adds min, max and count).\n");
+  fprintf(stderr, "              Zoom levels are built by tbmate zoom. Rows are printed if no\n");
+  fprintf(stderr, "              level is fine enough.\n");
+  fprintf(stderr, "    --profile report time per phase, reads and seeks to stderr\n");
   fprintf(stderr, "    -h        This help\n");
   fprintf(stderr, "\n");
 
   return 1;
 }
 
-static void parse_tbf_from_argument(
+void parse_tbf_from_argument(
   int argc, char **argv, int optind,
   tbf_t **tbfs, int *n_tbfs) {
   
@@ -374,16 +988,15 @@ static void parse_tbf_from_argument(
   }
 }
 
-static void parse_tbf_fname_list(
+void parse_tbf_fname_list(
   char *tbk_fname_list,
   tbf_t **tbfs, int *n_tbfs) {
   
   if (tbk_fname_list == NULL) return;
   
-  gzFile fh = wzopen(tbk_fname_list);
-  if (!fh) { wzfatal("Cannot read tbk file name list."); }
-  char *line = NULL; char **fields; int nfields; char *sname;
-  while(gzFile_read_line(fh, &line)) {
+  wzreader_t *r = wzreader_open(tbk_fname_list);
+  char *line; size_t len; char **fields; int nfields; char *sname;
+  while((line = wzreader_line(r, &len))) {
     line_get_fields(line, "\t", &fields, &nfields);
     if (nfields > 0) {
       (*tbfs) = realloc((*tbfs), (++(*n_tbfs)) * sizeof(tbf_t));
@@ -392,7 +1005,7 @@ static void parse_tbf_fname_list(
     }
     free_fields(fields, nfields);
   }
-  free(line);
+  wzreader_close(r);
 }
 
 void parse_tbk_from_tbf(tbf_t *tbf, tbk_t **tbks, int *n_tbks) {
@@ -402,6 +1015,8 @@ void parse_tbk_from_tbf(tbf_t *tbf, tbk_t **tbks, int *n_tbks) {
     (*tbks) = realloc((*tbks), (++(*n_tbks))*sizeof(tbk_t));
     tbk = &(*tbks)[(*n_tbks)-1];
     tbf_next(tbf, tbk);
+    if (tbk->dtype & DT_SPARSE) tbk->sparse = tbk_sparse_open(tbk);
+    if (tbk->dtype & DT_SPLIT) tbk->split = tbk_split_open(tbk);
     n++;
     if (tbf->sname_first != NULL) tbk->sname = strdup(tbf->sname_first);
     if (tbk->version < 100) break;
@@ -413,7 +1028,7 @@ void parse_tbk_from_tbf(tbf_t *tbf, tbk_t **tbks, int *n_tbks) {
   }
 }
 
-static void infer_idx(tbk_t *tbks, int n_tbks, char **idx_fname) {
+void infer_idx(tbk_t *tbks, int n_tbks, char **idx_fname) {
 
   if (*idx_fname != NULL) return;
   
@@ -470,25 +1085,70 @@ int main_view(int argc, char *argv[]) {
   if (argc<2) return usage(&conf);
 
   char *regions_fname = NULL;
+  char *probes_fname = NULL;
+  int name_col = 5;
   char *region = NULL;
-  FILE *out_fh = stdout;
+  FILE *out_fh = NULL;
+  char *out_fname = NULL;
+  int out_bgzf = 0;
   char *idx_fname = NULL;
   char *tbk_fname_list = NULL;
-  while ((c = getopt(argc, argv, "i:l:o:R:N:m:n:p:g:s:t:ckabduFh"))>=0) {
+  static const struct option loptions[] = {
+    {"summarize", required_argument, NULL, 1001},
+    {"mem", required_argument, NULL, 1002},
+    {"profile", no_argument, NULL, 1003},
+    {"keep-order", no_argument, NULL, 1004},
+    {"cache", no_argument, NULL, 1005},
+    {"where", required_argument, NULL, 1006},
+    {"resolution", required_argument, NULL, 1007},
+    {"name-col", required_argument, NULL, 1008},
+    {NULL, 0, NULL, 0}
+  };
+  int chunk_read_set = 0, n_chunk_index_set = 0, n_chunk_data_set = 0;
+  int build_cache = 0;
+  while ((c = getopt_long(argc, argv, "i:l:o:O:R:P:N:m:n:p:g:s:t:@:ckabduFvh", loptions, NULL))>=0) {
     switch (c) {
+    case 1001:
+      if (strcmp(optarg, "mean") == 0)        conf.summarize = SUMMARIZE_MEAN;
+      else if (strcmp(optarg, "median") == 0) conf.summarize = SUMMARIZE_MEDIAN;
+      else if (strcmp(optarg, "count") == 0)  conf.summarize = SUMMARIZE_COUNT;
+      else if (strcmp(optarg, "sum") == 0)    conf.summarize = SUMMARIZE_SUM;
+      else wzfatal("Unrecognized summary: %s.\n", optarg);
+      break;
+    case 1002:
+      if ((conf.mem_budget = parse_size(optarg)) <= 0) wzfatal("Invalid memory size: %s.\n", optarg);
+      break;
+    case 1003: tbk_prof_start(); break;
+    case 1004: conf.keep_order = 1; break;
+    case 1005: build_cache = 1; break;
+    case 1006: conf.where = where_parse(optarg); break;
+    case 1007:
+      if ((conf.resolution = atoi(optarg)) <= 0) wzfatal("Invalid resolution: %s.\n", optarg);
+      break;
+    case 1008:
+      if ((name_col = atoi(optarg)) < 1) wzfatal("Invalid name column: %s.\n", optarg);
+      break;
     case 'i': idx_fname = strdup(optarg); break;
+    case '@': conf.n_threads = atoi(optarg); break;
     case 'l': tbk_fname_list = strdup(optarg); break;
-    case 'o': out_fh = fopen(optarg, "w"); break;
+    case 'o': out_fname = optarg; break;
+    case 'O':
+      if (strcmp(optarg, "bed") == 0)         out_bgzf = 0;
+      else if (strcmp(optarg, "bed.gz") == 0) out_bgzf = 1;
+      else wzfatal("Unrecognized output format: %s.\n", optarg);
+      break;
     case 'R': regions_fname = optarg; break;
+    case 'P': probes_fname = optarg; break;
     case 'N': conf.na_token = strdup(optarg); break;
-    case 'm': conf.n_chunk_index = atoi(optarg); break;
-    case 'n': conf.n_chunk_data = atoi(optarg); break;
+    case 'm': conf.n_chunk_index = atoi(optarg); n_chunk_index_set = 1; break;
+    case 'n': conf.n_chunk_data = atoi(optarg); n_chunk_data_set = 1; break;
     case 'g': region = strdup(optarg); break;
     case 's': conf.min_coverage = atoi(optarg); break;
     case 't': conf.max_pval = atof(optarg); break;
     case 'p': conf.precision = atoi(optarg); break;
     case 'c': conf.column_name = 1; break;
-    case 'k': conf.chunk_read = 1; break;
+    case 'k': conf.chunk_read = 1; chunk_read_set = 1; break;
+    case 'v': conf.verbose = 1; break;
     case 'a': conf.print_all = 1; break;
     case 'b': conf.print_all_units = 1; break;
     case 'd': conf.na_for_negative = 1; break;
@@ -504,6 +1164,11 @@ int main_view(int argc, char *argv[]) {
     wzfatal("Please supply tbk file.\n"); 
   }
 
+  if (out_bgzf && !out_fname) wzfatal("-O bed.gz needs -o.\n");
+  if (out_bgzf && probes_fname) wzfatal("-P rows are not sorted, cannot be output as bed.gz.\n");
+  /* the header line is skipped by the index */
+  out_fh = tbk_writer_open(out_fname, out_bgzf, out_bgzf && conf.column_name);
+
   int nregs = 0;
   char **regs = NULL;
 
@@ -517,18 +1182,75 @@ int main_view(int argc, char *argv[]) {
   }
   
   infer_idx(tbks, n_tbks, &idx_fname);
-  
-  regs = parse_regions(regions_fname, region, &nregs);
+
+  /* the second values of split tbks are only read if they are printed
+     or filter; summaries weigh by coverage */
+  if (!conf.summarize) {
+    for (i=0; i<n_tbks; ++i) {
+      if (DATA_TYPE(tbks[i].dtype) == DT_FLOAT_INT)
+        tbks[i].skip_second = !conf.print_all_units && conf.min_coverage < 0;
+      else if (DATA_TYPE(tbks[i].dtype) == DT_FLOAT_FLOAT)
+        tbks[i].skip_second = !conf.print_all_units && conf.max_pval < 0;
+    }
+  }
+
+  if (conf.where) {
+    if (probes_fname || conf.summarize) wzfatal("--where cannot be used with -P or --summarize.\n");
+    for (i=0; i<n_tbks; ++i) {
+      if (!dtype_is_numeric(tbks[i].dtype))
+        wzfatal("%s: --where needs numeric data, got data type %d.\n", tbks[i].sname, DATA_TYPE(tbks[i].dtype));
+      tbks[i].zone = tbk_zone_open(&tbks[i]);
+    }
+    conf.chunk_read = 1; chunk_read_set = 1;
+  }
+
+  if (conf.resolution) {
+    if (probes_fname || conf.summarize || conf.where)
+      wzfatal("--resolution cannot be used with -P, --summarize or --where.\n");
+    for (i=0; i<n_tbks; ++i) {
+      if (!(tbks[i].zoom = tbk_zoom_open(&tbks[i], idx_fname)))
+        fprintf(stderr, "[%s] %s has no zoom levels, printing rows.\n", __func__, tbks[i].sname);
+    }
+  }
+
   int ret;
-  if (conf.chunk_read)
-    ret = chunk_query_region(idx_fname, regs, nregs, tbks, n_tbks, &conf, out_fh);
-  else
-    ret = query_regions(idx_fname, regs, nregs, tbks, n_tbks, &conf, out_fh);
+  if (probes_fname) {
+    ret = query_probes(idx_fname, name_col, probes_fname, tbks, n_tbks, &conf, out_fh);
+  } else if (conf.summarize) {
+    regs = parse_regions(regions_fname, region, &nregs);
+    ret = summarize_regions(idx_fname, regs, nregs, tbks, n_tbks, &conf, out_fh);
+  } else {
+    tbx_t *tbx = tbx_index_load(idx_fname);
+    if(!tbx) error("Could not load .tbi/.csi index of %s\n", idx_fname);
+    tbk_region_t *qregs = plan_regions(tbx, regions_fname, region, conf.keep_order, &nregs);
+    int bin_size = conf.resolution ? zoom_pick_level(tbks, n_tbks, conf.resolution) : 0;
+    if (!bin_size && !conf.print_all && tbx->conf.preset == TBX_UCSC && tbx->conf.sc == 1 &&
+        tbx->conf.bc == 2 && tbx->conf.ec == 3)
+      conf.cache = tbk_cache_open(idx_fname, tbx, build_cache);
+    if (!bin_size && conf.mem_budget > 0) {
+      view_plan(tbks, n_tbks, count_region_rows(idx_fname, tbx, conf.cache, qregs, nregs), &conf,
+                chunk_read_set, n_chunk_index_set, n_chunk_data_set);
+    }
+    if (bin_size)
+      ret = zoom_query_regions(tbx, qregs, nregs, tbks, n_tbks, bin_size, &conf, out_fh);
+    else if (conf.chunk_read)
+      ret = chunk_query_region(idx_fname, tbx, qregs, nregs, tbks, n_tbks, &conf, out_fh);
+    else
+      ret = query_regions(idx_fname, tbx, qregs, nregs, tbks, n_tbks, &conf, out_fh);
+    free(qregs);
+    tbk_cache_close(conf.cache);
+    tbx_destroy(tbx);
+  }
+  int p = prof_enter(PROF_WRITE);
+  if (fclose(out_fh)) wzfatal("Cannot write the output.\n");
+  prof_leave(p);
+  tbk_prof_report("view", stderr);
 
   if (n_tbfs > 0) {for (i=0; i<n_tbfs; ++i) tbf_close(&tbfs[i]); free(tbfs);}
-  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) free(tbks[i].sname); free(tbks);}
+  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) {free(tbks[i].sname); tbk_zoom_close(tbks[i].zoom);} free(tbks);}
   if (idx_fname) free(idx_fname);
   free(conf.na_token);
+  if (conf.where) where_free(conf.where);
   if (region) free(region);
   return ret;
 }
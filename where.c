@@ -0,0 +1,246 @@
+/* view --where, row predicates over the samples
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* A predicate is clauses separated by ',' which must all hold for a row
+ * to be printed. A clause is conditions joined by '&' on the value of one
+ * sample, with a quantifier over the samples:
+ *
+ *   any(conds)          at least one sample
+ *   all(conds)          every sample
+ *   frac(conds) OP X    the fraction of samples, e.g., frac(!na)>=0.5
+ *   conds               same as any(conds)
+ *
+ * A condition is  v OP X  on the value,  v2 OP X  (or cov) on the coverage
+ * of float.int and the second value of float.float, or  na / !na. OP is
+ * one of < <= > >= == !=. A sample is NA if its value is NAN, the value
+ * packed for "." (-1 without a zone map) or made NA by -d, -s or -t, and
+ * only na holds for it.
+ *
+ * Blocks of rows are first ruled out with the zone maps of the samples,
+ * then the rows left are tested one condition at a time over all rows of
+ * a sample. */
+
+#include "tbmate.h"
+
+#define WHERE_OP_LT 1
+#define WHERE_OP_LE 2
+#define WHERE_OP_GT 3
+#define WHERE_OP_GE 4
+#define WHERE_OP_EQ 5
+#define WHERE_OP_NE 6
+
+static void skip_space(const char **p) { while (isspace(**p)) (*p)++; }
+
+static int accept(const char **p, const char *tok) {
+  skip_space(p);
+  size_t n = strlen(tok);
+  if (strncmp(*p, tok, n)) return 0;
+  *p += n;
+  return 1;
+}
+
+static int parse_op(const char **p) {
+  if (accept(p, "<=")) return WHERE_OP_LE;
+  if (accept(p, ">=")) return WHERE_OP_GE;
+  if (accept(p, "==")) return WHERE_OP_EQ;
+  if (accept(p, "!=")) return WHERE_OP_NE;
+  if (accept(p, "<")) return WHERE_OP_LT;
+  if (accept(p, ">")) return WHERE_OP_GT;
+  if (accept(p, "=")) return WHERE_OP_EQ;
+  wzfatal("Expect a comparison in --where at: %s\n", *p);
+  return 0;
+}
+
+static float parse_number(const char **p) {
+  skip_space(p);
+  char *end;
+  float x = strtof(*p, &end);
+  if (end == *p) wzfatal("Expect a number in --where at: %s\n", *p);
+  *p = end;
+  return x;
+}
+
+static void parse_conds(const char **p, where_clause_t *cl) {
+  do {
+    cl->conds = realloc(cl->conds, sizeof(where_cond_t) * (cl->n_conds + 1));
+    where_cond_t *c = &cl->conds[cl->n_conds++];
+    memset(c, 0, sizeof(where_cond_t));
+    if (accept(p, "!na")) c->var = WHERE_NOT_NA;
+    else if (accept(p, "na")) c->var = WHERE_NA;
+    else {
+      if (accept(p, "v2") || accept(p, "cov")) c->var = WHERE_V2;
+      else if (accept(p, "v")) c->var = WHERE_V;
+      else wzfatal("Expect v, v2, cov, na or !na in --where at: %s\n", *p);
+      c->op = parse_op(p);
+      c->x = parse_number(p);
+    }
+  } while (accept(p, "&"));
+}
+
+tbk_where_t *where_parse(const char *expr) {
+  tbk_where_t *w = calloc(1, sizeof(tbk_where_t));
+  const char *p = expr;
+  do {
+    w->clauses = realloc(w->clauses, sizeof(where_clause_t) * (w->n_clauses + 1));
+    where_clause_t *cl = &w->clauses[w->n_clauses++];
+    memset(cl, 0, sizeof(where_clause_t));
+    int paren = 1;
+    if (accept(&p, "any(")) cl->quant = WHERE_ANY;
+    else if (accept(&p, "all(")) cl->quant = WHERE_ALL;
+    else if (accept(&p, "frac(")) cl->quant = WHERE_FRAC;
+    else { cl->quant = WHERE_ANY; paren = 0; }
+    parse_conds(&p, cl);
+    if (paren && !accept(&p, ")")) wzfatal("Expect ) in --where at: %s\n", p);
+    if (cl->quant == WHERE_FRAC) {
+      cl->op = parse_op(&p);
+      cl->x = parse_number(&p);
+    }
+  } while (accept(&p, ","));
+  skip_space(&p);
+  if (*p) wzfatal("Cannot parse --where at: %s\n", p);
+  return w;
+}
+
+void where_free(tbk_where_t *w) {
+  int i;
+  for (i=0; i<w->n_clauses; ++i) free(w->clauses[i].conds);
+  free(w->clauses); free(w);
+}
+
+static int compare(float a, int op, float x) {
+  switch (op) {
+  case WHERE_OP_LT: return a < x;
+  case WHERE_OP_LE: return a <= x;
+  case WHERE_OP_GT: return a > x;
+  case WHERE_OP_GE: return a >= x;
+  case WHERE_OP_EQ: return a == x;
+  default: return a != x;
+  }
+}
+
+/* whether some value in [lo, hi] can satisfy op x, lo > hi if empty */
+static int range_may(int op, float x, float lo, float hi) {
+  if (lo > hi) return 0;
+  switch (op) {
+  case WHERE_OP_LT: return lo < x;
+  case WHERE_OP_LE: return lo <= x;
+  case WHERE_OP_GT: return hi > x;
+  case WHERE_OP_GE: return hi >= x;
+  case WHERE_OP_EQ: return lo <= x && x <= hi;
+  default: return !(lo == x && hi == x);
+  }
+}
+
+/* -d, -s and -t only turn values into NA */
+static int cond_may(where_cond_t *c, const zone_block_t *b, int filtered) {
+  switch (c->var) {
+  case WHERE_NA: return b->n_na > 0 || filtered;
+  case WHERE_NOT_NA: return b->n_na < b->n;
+  case WHERE_V: return range_may(c->op, c->x, b->min, b->max);
+  default: return range_may(c->op, c->x, b->min2, b->max2);
+  }
+}
+
+int where_block_may_match(tbk_where_t *w, tbk_t *tbks, int n_tbks, int64_t block, view_conf_t *conf) {
+  int filtered = conf->na_for_negative || conf->min_coverage >= 0 || conf->max_pval >= 0;
+  int i, j, k;
+  for (i=0; i<w->n_clauses; ++i) {
+    where_clause_t *cl = &w->clauses[i];
+    int n_may = 0;
+    for (k=0; k<n_tbks; ++k) {
+      tbk_zone_t *z = tbks[k].zone;
+      int may = 1;
+      if (z && block < z->n_blocks)
+        for (j=0; j<cl->n_conds && may; ++j)
+          may = cond_may(&cl->conds[j], &z->blocks[block], filtered);
+      n_may += may;
+    }
+    switch (cl->quant) {
+    case WHERE_ANY: if (!n_may) return 0; break;
+    case WHERE_ALL: if (n_may < n_tbks) return 0; break;
+    default:                    /* only an upper bound on the fraction */
+      if ((cl->op == WHERE_OP_GT || cl->op == WHERE_OP_GE) &&
+          !compare((float) n_may / n_tbks, cl->op, cl->x)) return 0;
+    }
+  }
+  return 1;
+}
+
+#define WHERE_LOOP(expr) for (i=0; i<n; ++i) m[i] &= (expr)
+static void cond_rows(where_cond_t *c, const float *v, const uint8_t *na, int n, uint8_t *m) {
+  int i;
+  const float x = c->x;
+  if (c->var == WHERE_NA) { WHERE_LOOP(na[i]); return; }
+  if (c->var == WHERE_NOT_NA) { WHERE_LOOP(!na[i]); return; }
+  switch (c->op) {              /* NAN compares false except for != */
+  case WHERE_OP_LT: WHERE_LOOP(v[i] < x); break;
+  case WHERE_OP_LE: WHERE_LOOP(v[i] <= x); break;
+  case WHERE_OP_GT: WHERE_LOOP(v[i] > x); break;
+  case WHERE_OP_GE: WHERE_LOOP(v[i] >= x); break;
+  case WHERE_OP_EQ: WHERE_LOOP(v[i] == x); break;
+  default: WHERE_LOOP(v[i] == v[i] && v[i] != x);
+  }
+  WHERE_LOOP(!na[i]);
+}
+
+/* keep[i] is cleared for the rows failing w, only rows with keep[i] set
+   are looked at */
+void where_filter_rows(tbk_where_t *w, tbk_t *tbks, tbk_data_t *cols, int n_tbks, int n,
+                       view_conf_t *conf, uint8_t *keep) {
+  if (n <= 0) return;
+  float *v = malloc(sizeof(float) * n), *v2 = malloc(sizeof(float) * n), cov;
+  uint8_t *na = malloc(n), *m = malloc(n);
+  int *cnt = malloc(sizeof(int) * n);
+  int i, j, k, c;
+  for (c=0; c<w->n_clauses; ++c) {
+    where_clause_t *cl = &w->clauses[c];
+    memset(cnt, 0, sizeof(int) * n);
+    for (k=0; k<n_tbks; ++k) {
+      float na_value = tbks[k].zone ? tbks[k].zone->na : -1;
+      for (i=0; i<n; ++i) {
+        if (keep[i]) {
+          v[i] = tbk_data_float(&cols[k], i, conf, &cov);
+          v2[i] = tbk_data_second(&cols[k], i);
+        } else v[i] = v2[i] = NAN;
+      }
+      for (i=0; i<n; ++i) na[i] = v[i] != v[i] || v[i] == na_value;
+      memset(m, 1, n);
+      for (j=0; j<cl->n_conds; ++j)
+        cond_rows(&cl->conds[j], cl->conds[j].var == WHERE_V2 ? v2 : v, na, n, m);
+      for (i=0; i<n; ++i) cnt[i] += m[i];
+    }
+    for (i=0; i<n; ++i) {
+      if (!keep[i]) continue;
+      switch (cl->quant) {
+      case WHERE_ANY: keep[i] = cnt[i] > 0; break;
+      case WHERE_ALL: keep[i] = cnt[i] == n_tbks; break;
+      default: keep[i] = compare((float) cnt[i] / n_tbks, cl->op, cl->x);
+      }
+    }
+  }
+  free(v); free(v2); free(na); free(m); free(cnt);
+}
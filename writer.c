@@ -0,0 +1,273 @@
+/* Asynchronous output of tbmate view, optionally bgzipped and indexed
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* The FILE returned by tbk_writer_open copies what is written into one of
+ * two large blocks. A full block is handed to the writer thread, which
+ * writes it out while the other block is being filled. With bgzf, the
+ * thread compresses and, reading the rows as they go by, builds the
+ * .tbi index in the same pass: column 1 is the sequence and columns 2-3
+ * the 0-based start and end as in a BED file. Writers still open at
+ * exit, e.g., after wzfatal, are closed by an atexit hook so the rows
+ * already printed are not lost. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/khash.h"
+#include "htslib/htslib/kstring.h"
+KHASH_DECLARE(s2i, kh_cstr_t, int64_t)
+void tbx_set_meta(tbx_t *tbx);  /* in htslib's tbx.c, not in its header */
+
+#define WRITER_BLOCK (1<<22)
+
+typedef struct tbk_writer_t {
+  char *blk[2];
+  size_t len[2];
+  int cur;                      /* block being filled */
+  int pending;                  /* block handed over, -1 if none */
+  int closing;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  char *fname;
+  int fd;                       /* plain output */
+  BGZF *fp;                     /* bgzipped output */
+  tbx_t *tbx;                   /* index being built, bgzf only */
+  int line_skip;                /* header lines not indexed */
+  int64_t lineno;
+  uint64_t last_off;            /* end of the last line not indexed */
+  kstring_t line;               /* the part of a line seen so far */
+  FILE *fh;
+  struct tbk_writer_t *next;    /* writers open, for the atexit hook */
+} tbk_writer_t;
+
+static tbk_writer_t *writers_open = NULL;
+
+static void writer_unlink(tbk_writer_t *w) {
+  tbk_writer_t **p;
+  for (p = &writers_open; *p; p = &(*p)->next)
+    if (*p == w) { *p = w->next; break; }
+}
+
+/* exit before fclose, flush what was printed */
+static void writer_atexit(void) {
+  while (writers_open) {
+    tbk_writer_t *w = writers_open;
+    if (pthread_equal(pthread_self(), w->thread)) return; /* the writer failed */
+    fclose(w->fh);
+  }
+}
+
+static int writer_tid(tbx_t *tbx, const char *ss) {
+  khash_t(s2i) *d = (khash_t(s2i)*) tbx->dict;
+  int absent;
+  khint_t k = kh_put(s2i, d, ss, &absent);
+  if (absent) {
+    kh_key(d, k) = strdup(ss);
+    kh_val(d, k) = kh_size(d) - 1;
+  }
+  return kh_val(d, k);
+}
+
+/* index one complete line, which has just been written */
+static void writer_index1(tbk_writer_t *w, char *s) {
+  w->lineno++;
+  if (w->lineno <= w->line_skip || s[0] == w->tbx->conf.meta_char) {
+    w->last_off = bgzf_tell(w->fp);
+    return;
+  }
+  if (!w->tbx->idx) w->tbx->idx = hts_idx_init(0, HTS_FMT_TBI, w->last_off, 14, 5);
+
+  char *f2 = strchr(s, '\t'), *f3;
+  if (!f2 || !(f3 = strchr(f2 + 1, '\t')))
+    wzfatal("Cannot index line %"PRId64" of %s, fewer than 3 columns.\n", w->lineno, w->fname);
+  *f2 = '\0';
+  int tid = writer_tid(w->tbx, s);
+  *f2 = '\t';
+  long beg = strtol(f2 + 1, NULL, 10), end = strtol(f3 + 1, NULL, 10);
+  if (hts_idx_push(w->tbx->idx, tid, beg, end, bgzf_tell(w->fp), 1) < 0)
+    wzfatal("Cannot index %s, rows are not sorted by coordinate.\n", w->fname);
+}
+
+static void writer_bgzf(tbk_writer_t *w, const char *buf, size_t n) {
+  if (bgzf_write(w->fp, buf, n) < 0) wzfatal("Cannot write to %s.\n", w->fname);
+}
+
+static void writer_output(tbk_writer_t *w, char *buf, size_t n) {
+  if (!w->fp) {
+    while (n > 0) {
+      ssize_t k = write(w->fd, buf, n);
+      if (k < 0) wzfatal("Cannot write to %s.\n", w->fname);
+      buf += k; n -= k;
+    }
+    return;
+  }
+
+  /* line by line so the offset after each row goes into the index */
+  char *end = buf + n, *nl;
+  while (buf < end && (nl = memchr(buf, '\n', end - buf))) {
+    writer_bgzf(w, buf, nl + 1 - buf);
+    if (w->line.l) {
+      kputsn(buf, nl - buf, &w->line);
+      writer_index1(w, w->line.s);
+      w->line.l = 0;
+    } else {
+      *nl = '\0';
+      writer_index1(w, buf);
+    }
+    buf = nl + 1;
+  }
+  if (buf < end) {
+    writer_bgzf(w, buf, end - buf);
+    kputsn(buf, end - buf, &w->line);
+  }
+}
+
+static void *writer_thread(void *arg) {
+  tbk_writer_t *w = (tbk_writer_t*) arg;
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+    while (w->pending < 0 && !w->closing) pthread_cond_wait(&w->cond, &w->lock);
+    int i = w->pending;
+    pthread_mutex_unlock(&w->lock);
+    if (i < 0) break;
+
+    writer_output(w, w->blk[i], w->len[i]);
+
+    pthread_mutex_lock(&w->lock);
+    w->pending = -1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+/* hand the current block to the writer thread once it is free */
+static void writer_hand_off(tbk_writer_t *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->pending >= 0) pthread_cond_wait(&w->cond, &w->lock);
+  w->pending = w->cur;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  w->cur ^= 1;
+  w->len[w->cur] = 0;
+}
+
+static ssize_t writer_write(void *cookie, const char *buf, size_t size) {
+  tbk_writer_t *w = (tbk_writer_t*) cookie;
+  size_t n = size;
+  while (n > 0) {
+    size_t k = min(n, WRITER_BLOCK - w->len[w->cur]);
+    memcpy(w->blk[w->cur] + w->len[w->cur], buf, k);
+    w->len[w->cur] += k;
+    buf += k; n -= k;
+    if (w->len[w->cur] == WRITER_BLOCK) writer_hand_off(w);
+  }
+  return size;
+}
+
+static int writer_close(void *cookie) {
+  tbk_writer_t *w = (tbk_writer_t*) cookie;
+  writer_unlink(w);
+  if (w->len[w->cur]) writer_hand_off(w);
+  pthread_mutex_lock(&w->lock);
+  while (w->pending >= 0) pthread_cond_wait(&w->cond, &w->lock);
+  w->closing = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+
+  if (w->fp) {
+    if (w->line.l) writer_index1(w, w->line.s); /* a last row without '\n' */
+    if (bgzf_flush(w->fp) < 0) wzfatal("Cannot write to %s.\n", w->fname);
+    tbx_t *tbx = w->tbx;
+    if (!tbx->idx) tbx->idx = hts_idx_init(0, HTS_FMT_TBI, w->last_off, 14, 5);
+    hts_idx_finish(tbx->idx, bgzf_tell(w->fp));
+    tbx_set_meta(tbx);
+    if (bgzf_close(w->fp) < 0) wzfatal("Cannot write to %s.\n", w->fname);
+    if (hts_idx_save(tbx->idx, w->fname, HTS_FMT_TBI) < 0)
+      wzfatal("Cannot write the index of %s.\n", w->fname);
+    tbx_destroy(tbx);
+  } else if (w->fd != STDOUT_FILENO && close(w->fd)) {
+    wzfatal("Cannot write to %s.\n", w->fname);
+  }
+  free(w->blk[0]); free(w->blk[1]);
+  free(w->line.s); free(w->fname);
+  free(w);
+  return 0;
+}
+
+/* fname NULL for stdout. With bgzf, fname.tbi is written on fclose and
+   the first line_skip lines are not indexed. */
+FILE *tbk_writer_open(const char *fname, int bgzf, int line_skip) {
+  tbk_writer_t *w = calloc(1, sizeof(tbk_writer_t));
+  w->fname = strdup(fname ? fname : "stdout");
+  w->pending = -1;
+  w->line_skip = line_skip;
+  w->blk[0] = malloc(WRITER_BLOCK);
+  w->blk[1] = malloc(WRITER_BLOCK);
+  if (bgzf) {
+    if (!fname) wzfatal("Bgzipped output needs a file name.\n");
+    if (!(w->fp = bgzf_open(fname, "w"))) wzfatal("Cannot open %s to write.\n", fname);
+    w->tbx = calloc(1, sizeof(tbx_t));
+    w->tbx->conf = tbx_conf_bed;
+    w->tbx->conf.line_skip = line_skip;
+    w->tbx->dict = kh_init(s2i);
+  } else if (fname) {
+    if ((w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      wzfatal("Cannot open %s to write.\n", fname);
+  } else w->fd = STDOUT_FILENO;
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, writer_thread, w))
+    wzfatal("Cannot start the writer thread.\n");
+
+#ifdef __APPLE__
+  FILE *fh = funopen(w, NULL, (int (*)(void*, const char*, int)) writer_write, NULL, writer_close);
+#else
+  cookie_io_functions_t io = { NULL, writer_write, NULL, writer_close };
+  FILE *fh = fopencookie(w, "w", io);
+#endif
+  if (!fh) wzfatal("Cannot open %s to write.\n", w->fname);
+  setvbuf(fh, NULL, _IOFBF, 1<<16);
+
+  static int atexit_set = 0;
+  if (!atexit_set) { atexit(writer_atexit); atexit_set = 1; }
+  w->fh = fh;
+  w->next = writers_open;
+  writers_open = w;
+  return fh;
+}
@@ -74,8 +74,10 @@ static inline void free_bed1(bed1_t *b, free_data_f free_data) {
 
 typedef struct bed_file_t {
   char *file_path;
-  gzFile fh;
-  char *line;
+  wzreader_t *fh;
+  char *line;                   /* points into fh, does not own */
+  char **fields;                /* fields of line, split in place */
+  int m_fields;
   char *seqname;
   /* target_v *targets; */
   targets_t *targets;
@@ -84,7 +86,7 @@ typedef struct bed_file_t {
 static inline bed_file_t *init_bed_file(char *file_path) {
   bed_file_t *bed = calloc(1, sizeof(bed_file_t));
   bed->file_path = strdup(file_path);
-  bed->fh = wzopen(bed->file_path);
+  bed->fh = wzreader_open(bed->file_path);
   bed->targets = 0;
   bed->line = NULL;
   bed->seqname = NULL;
@@ -92,21 +94,32 @@ static inline bed_file_t *init_bed_file(char *file_path) {
 }
 
 static inline void free_bed_file(bed_file_t *bed) {
-  wzclose(bed->fh);
+  wzreader_close(bed->fh);
   /* destroy_target_v(bed->targets); */
   if (bed->targets) destroy_targets(bed->targets);
   free(bed->file_path);
-  free(bed->line);
   free(bed->seqname);
+  free(bed->fields);
   free(bed);
 }
 
 static inline int bed_read1(bed_file_t *bed, bed1_t *b, parse_data_f parse_data) {
   if (bed->fh == NULL) return 0;
-  if (gzFile_read_line(bed->fh, &bed->line) == 0) return 0;
-
-  char **fields; int nfields;
-  line_get_fields(bed->line, "\t", &fields, &nfields);
+  size_t len;
+  if (!(bed->line = wzreader_line(bed->fh, &len))) return 0;
+
+  int nfields = 0;
+  char *p = bed->line, **fields;
+  while (1) {
+    if (nfields == bed->m_fields) {
+      bed->m_fields = bed->m_fields ? bed->m_fields<<1 : 16;
+      bed->fields = realloc(bed->fields, bed->m_fields * sizeof(char*));
+    }
+    bed->fields[nfields++] = p;
+    if (!(p = memchr(p, '\t', len - (p - bed->line)))) break;
+    *p++ = '\0';
+  }
+  fields = bed->fields;
   if (nfields < 3)
     wzfatal("[%s:%d] Bed file has fewer than 3 columns.\n", __func__, __LINE__);
 
@@ -125,7 +138,6 @@ static inline int bed_read1(bed_file_t *bed, bed1_t *b, parse_data_f parse_data)
 
   if (parse_data != NULL) parse_data(b, fields, nfields);
   else b->data = NULL;
-  free_fields(fields, nfields);
 
   return 1;
 }
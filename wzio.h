@@ -77,6 +77,81 @@ static inline int gzFile_read_line(gzFile fh, char **s) {
   return 0;                     /* should not come here */
 }
 
+/***************************
+ ** Buffered line reading **
+ ***************************
+
+ * Usage:
+ * wzreader_t *r = wzreader_open(path);
+ * char *line; size_t len;
+ * while ((line = wzreader_line(r, &len))) { ... }
+ * wzreader_close(r);
+ *
+ * The input is decompressed a block at a time and lines are
+ * returned in place, with '\n' replaced by '\0'. A line stays
+ * valid until the next call. A last line without '\n' is
+ * returned too. */
+#define WZREADER_BLOCK (1<<20)
+typedef struct wzreader_t {
+  gzFile fh;
+  char *buf;
+  size_t m, beg, end;           /* unread bytes are buf[beg, end) */
+  int eof;
+} wzreader_t;
+
+static inline wzreader_t *wzreader_open(char *path) {
+  wzreader_t *r = calloc(1, sizeof(wzreader_t));
+  r->fh = wzopen(path);
+  gzbuffer(r->fh, 1<<17);
+  r->m = WZREADER_BLOCK;
+  r->buf = malloc(r->m + 1);
+  return r;
+}
+
+static inline void wzreader_close(wzreader_t *r) {
+  gzclose(r->fh);
+  free(r->buf);
+  free(r);
+}
+
+static inline char *wzreader_line(wzreader_t *r, size_t *len) {
+  size_t scanned = 0;           /* bytes after beg known to have no '\n' */
+  while (1) {
+    char *s = r->buf + r->beg;
+    char *nl = memchr(s + scanned, '\n', r->end - r->beg - scanned);
+    if (nl) {
+      *nl = '\0';
+      *len = nl - s;
+      r->beg += *len + 1;
+      return s;
+    }
+    scanned = r->end - r->beg;
+    if (r->eof) {
+      if (!scanned) return NULL;
+      s[scanned] = '\0';       /* buf has room for it */
+      *len = scanned;
+      r->beg = r->end;
+      return s;
+    }
+
+    /* move the partial line to the front, grow if it fills the buffer */
+    if (r->beg) {
+      memmove(r->buf, s, scanned);
+      r->beg = 0; r->end = scanned;
+    }
+    if (r->end == r->m) {
+      r->m <<= 1;
+      r->buf = realloc(r->buf, r->m + 1);
+    }
+    size_t want = r->m - r->end;
+    int n = gzread(r->fh, r->buf + r->end, want > (1u<<30) ? (1u<<30) : want);
+    if (n < 0) wzfatal("[%s] Cannot read input.\n", __func__);
+    if (n == 0) r->eof = 1;
+    r->end += n;
+  }
+  return NULL;                  /* should not come here */
+}
+
 static inline int gzFile_count_lines(gzFile fh) {
 
   int n = 0;
@@ -163,13 +238,13 @@ static inline void line_get_fields2(
 
   *aux = realloc(*aux, (strlen(line) + 1) * sizeof(char));
   strcpy(*aux, line);
-  char *tok; int i;
+  char *tok, *saveptr; int i;
 
-  tok = strtok(*aux, sep);
+  tok = strtok_r(*aux, sep, &saveptr); /* reentrant, view -@ splits in workers */
   for (i=0; tok != NULL; ++i) {
     (*fields)[i] = realloc((*fields)[i], strlen(tok)+1);
     strcpy((*fields)[i], tok);
-    tok = strtok(NULL, sep);
+    tok = strtok_r(NULL, sep, &saveptr);
   }
 }
 
@@ -84,6 +84,21 @@ static inline int strcount_char(char *s, char c) {
   return n;
 }
 
+/* parse size with optional K/M/G suffix, e.g., 4G, return -1 if malformed */
+static inline long long parse_size(const char *s) {
+  char *end;
+  double v = strtod(s, &end);
+  if (end == s || v < 0) return -1;
+  switch (toupper((unsigned char) *end)) {
+  case '\0': break;
+  case 'K': v *= 1LL<<10; break;
+  case 'M': v *= 1LL<<20; break;
+  case 'G': v *= 1LL<<30; break;
+  default: return -1;
+  }
+  return (long long) v;
+}
+
 /***************
  * min and max *
  ***************/
@@ -0,0 +1,198 @@
+/* Zone maps, per-block summaries of a tbk
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* Zone map file layout, <tbk>.tbz, little-endian:
+ *
+ *   4 bytes   "tbz\0"
+ *   4 bytes   version
+ *   8 bytes   size of the tbk
+ *   8 bytes   mtime of the tbk, seconds
+ *   8 bytes   mtime of the tbk, nanoseconds
+ *   8 bytes   nmax
+ *   4 bytes   rows per block, as a shift
+ *   4 bytes   the value packed for "." (float)
+ *   4 bytes   crc32 of the blocks
+ *   4 bytes   reserved
+ *   24 bytes x n_blocks   zone_block_t of each block of 1024 rows
+ *
+ * Values are as view reads them (tbk_data_float of the decoded unit), so
+ * a bound on a block holds for every row in it. A row is NA if its value
+ * is NAN or the value packed for ".". The size and mtime (to the
+ * nanosecond) tie the zone map to the tbk, it is ignored once the tbk
+ * changes. tbmate update, which keeps the size, removes the zone map.
+ * Zone maps are written by pack --zonemap for single-sample tbks. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tbmate.h"
+
+#define ZONE_VERSION 2
+#define ZONE_HDR_BYTES 56
+
+struct tbk_zone_writer_t {
+  uint64_t dtype;
+  float na;
+  tbk_data_t d;                 /* one decoded unit */
+  int64_t n;                    /* rows added */
+  zone_block_t cur;
+  zone_block_t *blocks;
+  int64_t n_blocks, m_blocks;
+};
+
+static void zone_block_init(zone_block_t *b) {
+  b->min = b->min2 = INFINITY;
+  b->max = b->max2 = -INFINITY;
+  b->n_na = b->n = 0;
+}
+
+/* the value and second value of a row as view reads them, without any
+   -d, -s or -t */
+static float zone_value(tbk_zone_writer_t *zw, beddata_t *bd, conf_pack_t *conf, float *v2) {
+  static view_conf_t vconf = {.min_coverage = -1, .max_pval = -1};
+  uint8_t buf[8];
+  float cov;
+  *v2 = NAN;
+  if (tbk_encode1(bd, zw->dtype, buf, conf) < 0) return atoi(bd->s[0]); /* int1, int2 */
+  tbk_decode_n(buf, 1, &zw->d);
+  *v2 = tbk_data_second(&zw->d, 0);
+  return tbk_data_float(&zw->d, 0, &vconf, &cov);
+}
+
+tbk_zone_writer_t *tbk_zone_writer_init(uint64_t dtype, conf_pack_t *conf) {
+  if (!dtype_is_numeric(dtype)) wzfatal("Zone maps need a numeric data type.\n");
+  tbk_zone_writer_t *zw = calloc(1, sizeof(tbk_zone_writer_t));
+  zw->dtype = dtype;
+  zw->d.dtype = dtype; zw->d.n = 1;
+  beddata_t bd = {{".", "."}, 2};
+  float v2;
+  zw->na = (DATA_TYPE(dtype) == DT_INT1 || DATA_TYPE(dtype) == DT_INT2) ? NAN : zone_value(zw, &bd, conf, &v2);
+  zone_block_init(&zw->cur);
+  return zw;
+}
+
+static void zone_flush(tbk_zone_writer_t *zw) {
+  if (zw->n_blocks == zw->m_blocks) {
+    zw->m_blocks = zw->m_blocks ? zw->m_blocks * 2 : 1024;
+    zw->blocks = realloc(zw->blocks, sizeof(zone_block_t) * zw->m_blocks);
+  }
+  zw->blocks[zw->n_blocks++] = zw->cur;
+  zone_block_init(&zw->cur);
+}
+
+void tbk_zone_add(tbk_zone_writer_t *zw, beddata_t *bd, conf_pack_t *conf) {
+  float v2, v = zone_value(zw, bd, conf, &v2);
+  zone_block_t *b = &zw->cur;
+  if (v != v || v == zw->na) b->n_na++;
+  else {
+    if (v < b->min) b->min = v;
+    if (v > b->max) b->max = v;
+    if (v2 < b->min2) b->min2 = v2;
+    if (v2 > b->max2) b->max2 = v2;
+  }
+  b->n++;
+  if (!(++zw->n & ((1<<ZONE_BLOCK_SHIFT) - 1))) zone_flush(zw);
+}
+
+/* write <tbk_fname>.tbz, to be called after the tbk is closed. Frees zw. */
+void tbk_zone_writer_end(tbk_zone_writer_t *zw, const char *tbk_fname) {
+  if (zw->cur.n) zone_flush(zw);
+  struct stat s;
+  if (stat(tbk_fname, &s)) wzfatal("Cannot stat %s.\n", tbk_fname);
+  char *fname = malloc(strlen(tbk_fname) + 5);
+  sprintf(fname, "%s.tbz", tbk_fname);
+  FILE *fh = fopen(fname, "wb");
+  if (!fh) wzfatal("Cannot open %s to write.\n", fname);
+  int32_t version = ZONE_VERSION, shift = ZONE_BLOCK_SHIFT, pad = 0;
+  int64_t size = s.st_size, mtime = s.st_mtime, mtime_ns = s.st_mtim.tv_nsec;
+  uint32_t crc = crc32(0L, (const Bytef*) zw->blocks, sizeof(zone_block_t) * zw->n_blocks);
+  fwrite("tbz\0", 4, 1, fh);
+  fwrite(&version, 4, 1, fh);
+  fwrite(&size, 8, 1, fh);
+  fwrite(&mtime, 8, 1, fh);
+  fwrite(&mtime_ns, 8, 1, fh);
+  fwrite(&zw->n, 8, 1, fh);
+  fwrite(&shift, 4, 1, fh);
+  fwrite(&zw->na, 4, 1, fh);
+  fwrite(&crc, 4, 1, fh);
+  fwrite(&pad, 4, 1, fh);
+  fwrite(zw->blocks, sizeof(zone_block_t), zw->n_blocks, fh);
+  if (fclose(fh)) wzfatal("Cannot write to %s.\n", fname);
+  free(fname); free(zw->d.data); free(zw->blocks); free(zw);
+}
+
+/* NULL if the tbk has no zone map or it is out of date */
+tbk_zone_t *tbk_zone_open(tbk_t *tbk) {
+  if (tbk->offset_sample_beg != 0 || tbk->version >= 100) return NULL; /* bundled */
+  char *fname = malloc(strlen(tbk->tbf->fname) + 5);
+  sprintf(fname, "%s.tbz", tbk->tbf->fname);
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) { free(fname); return NULL; }
+
+  struct stat s, st;
+  char hdr[ZONE_HDR_BYTES];
+  int64_t size, mtime, mtime_ns, nmax;
+  int32_t version, shift;
+  uint32_t crc;
+  int64_t n_blocks = (tbk->nmax + (1<<ZONE_BLOCK_SHIFT) - 1) >> ZONE_BLOCK_SHIFT;
+  if (fstat(fd, &s) || stat(tbk->tbf->fname, &st) ||
+      pread(fd, hdr, ZONE_HDR_BYTES, 0) != ZONE_HDR_BYTES) goto stale;
+  memcpy(&version, hdr + 4, 4);
+  memcpy(&size, hdr + 8, 8);
+  memcpy(&mtime, hdr + 16, 8);
+  memcpy(&mtime_ns, hdr + 24, 8);
+  memcpy(&nmax, hdr + 32, 8);
+  memcpy(&shift, hdr + 40, 4);
+  memcpy(&crc, hdr + 48, 4);
+  if (memcmp(hdr, "tbz\0", 4) || version != ZONE_VERSION || shift != ZONE_BLOCK_SHIFT ||
+      size != st.st_size || mtime != st.st_mtime || mtime_ns != st.st_mtim.tv_nsec || nmax != tbk->nmax ||
+      s.st_size != (off_t) (ZONE_HDR_BYTES + n_blocks * sizeof(zone_block_t))) goto stale;
+
+  tbk_zone_t *z = calloc(1, sizeof(tbk_zone_t));
+  memcpy(&z->na, hdr + 44, 4);
+  z->n_blocks = n_blocks;
+  z->map_size = s.st_size;
+  z->map = mmap(NULL, z->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (z->map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", fname);
+  z->blocks = (const zone_block_t*) ((char*) z->map + ZONE_HDR_BYTES);
+  if (crc32(0L, (const Bytef*) z->blocks, sizeof(zone_block_t) * n_blocks) != crc) {
+    munmap(z->map, z->map_size); free(z);
+    fprintf(stderr, "[%s] %s is corrupt, not used.\n", __func__, fname);
+    free(fname);
+    return NULL;
+  }
+  free(fname);
+  return z;
+
+stale:
+  fprintf(stderr, "[%s] %s is out of date, not used.\n", __func__, fname);
+  close(fd); free(fname);
+  return NULL;
+}
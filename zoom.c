@@ -0,0 +1,569 @@
+/* Zoom levels of tbks for wide-window views
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2021 Wanding.Zhou@pennmedicine.upenn.edu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+**/
+
+
+/* Zoom file layout, <tbk>.tbr, little-endian:
+ *
+ *   4 bytes   "tbr\0"
+ *   4 bytes   version
+ *   8 bytes   size of the tbk
+ *   8 bytes   mtime of the tbk, seconds
+ *   8 bytes   mtime of the tbk, nanoseconds
+ *   8 bytes   size of idx.gz
+ *   8 bytes   mtime of idx.gz, seconds
+ *   8 bytes   mtime of idx.gz, nanoseconds
+ *   4 bytes   number of sequences in the tabix index
+ *   4 bytes   number of levels
+ *   4 bytes   crc32 of the rest of the file
+ *   4 bytes   reserved
+ *   24 bytes x n_levels   bin size (int32), padding (int32), number of
+ *             bins (int64) and byte offset (int64) of each level
+ *
+ * A level, 8-byte aligned, is the first bin of each tid (int64, n_seqs+1)
+ * followed by the zoom_bin_t of its bins. A row goes to bin beg/bin_size
+ * of its sequence, beg being column 2 of the index, and only bins holding
+ * rows are stored. Values are summarized as in view --summarize, i.e.,
+ * negative values are NA. Bins depend on the index only, so the zoom
+ * files of tbks on the same index line up bin by bin. The sizes and
+ * mtimes (to the nanosecond) tie a zoom file to its tbk and index, it is
+ * ignored once either changes. tbmate update removes the zoom file. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tbmate.h"
+#include "wzmisc.h"
+#include "wzio.h"
+#include "htslib/htslib/kstring.h"
+#include "htslib/htslib/ksort.h"
+
+#define ZOOM_VERSION 2
+#define ZOOM_HDR_BYTES 72
+#define ZOOM_LEVEL_BYTES 24
+/* rows gathered at a time, a row is kept in the low 16 bits of a key */
+#define ZOOM_CHUNK (1<<16)
+/* offsets closer than this are read in one sequential run */
+#define ZOOM_MAX_GAP 4096
+
+KSORT_INIT_GENERIC(uint64_t)
+
+typedef struct zoom_conf_t {
+  int32_t *sizes;               /* bin sizes, increasing */
+  int n_levels;
+  int n_threads;
+  int n_chunk_data;
+} zoom_conf_t;
+
+/* the bins of each level, shared by all the tbks of one index */
+typedef struct zoom_plan_t {
+  tbk_cache_t *cache;
+  int64_t idx_stamp[3];
+  int64_t *n_bins;              /* per level */
+  int64_t **seq_bin;            /* per level, n_seqs+1 */
+} zoom_plan_t;
+
+static int usage(zoom_conf_t *conf) {
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: tbmate zoom [options] [.tbk [...]]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "    -i        index, a tabix-ed bed file. If not given search for idx.gz\n");
+  fprintf(stderr, "              in the folder containing the first tbk file.\n");
+  fprintf(stderr, "    -l        provide tbk file names in the list.\n");
+  fprintf(stderr, "    -z        bin sizes in bp, comma separated [");
+  int i;
+  for (i=0; i<conf->n_levels; ++i) fprintf(stderr, i ? ",%d" : "%d", conf->sizes[i]);
+  fprintf(stderr, "]\n");
+  fprintf(stderr, "    -n        chunk size for data [%d].\n", conf->n_chunk_data);
+  fprintf(stderr, "    -@        number of threads [%d].\n", conf->n_threads);
+  fprintf(stderr, "    -h        This help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Note, writes <tbk>.tbr holding the mean, min, max and count of each bin,\n");
+  fprintf(stderr, "used by view --resolution. Builds <idx>.tbc if missing.\n");
+  fprintf(stderr, "\n");
+
+  return 1;
+}
+
+/* size, mtime seconds and nanoseconds */
+static int file_stamp(const char *fname, int64_t stamp[3]) {
+  struct stat s;
+  if (stat(fname, &s)) return -1;
+  stamp[0] = s.st_size; stamp[1] = s.st_mtime; stamp[2] = s.st_mtim.tv_nsec;
+  return 0;
+}
+
+static void zoom_fwrite(const void *p, size_t size, FILE *fh, uLong *crc) {
+  fwrite(p, 1, size, fh);
+  *crc = crc32(*crc, p, size);
+}
+
+static int64_t level_bytes(int32_t n_seqs, int64_t n_bins) {
+  int64_t b = sizeof(int64_t) * (n_seqs + 1) + sizeof(zoom_bin_t) * n_bins;
+  return (b + 7) & ~7LL;
+}
+
+static void zoom_plan_init(zoom_plan_t *zp, zoom_conf_t *conf) {
+  tbk_cache_t *c = zp->cache;
+  zp->n_bins = calloc(conf->n_levels, sizeof(int64_t));
+  zp->seq_bin = calloc(conf->n_levels, sizeof(int64_t*));
+  int l, t; int64_t i;
+  for (l=0; l<conf->n_levels; ++l) {
+    int32_t size = conf->sizes[l];
+    int64_t *sb = zp->seq_bin[l] = malloc(sizeof(int64_t) * (c->n_seqs + 1));
+    int64_t n = 0;
+    for (t=0; t<c->n_seqs; ++t) {
+      sb[t] = n;
+      int32_t last = -1;
+      for (i=c->seq_beg[t]; i<c->seq_beg[t+1]; ++i) {
+        int32_t b = c->beg[i] / size;
+        if (b != last) { ++n; last = b; }
+      }
+    }
+    sb[c->n_seqs] = n;
+    zp->n_bins[l] = n;
+  }
+}
+
+static void zoom_plan_free(zoom_plan_t *zp, zoom_conf_t *conf) {
+  int l;
+  for (l=0; l<conf->n_levels; ++l) free(zp->seq_bin[l]);
+  free(zp->seq_bin); free(zp->n_bins);
+}
+
+typedef struct zoom_aux_t {
+  tbk_data_t data;
+  uint64_t *keys;
+} zoom_aux_t;
+
+/* values of n rows at any offsets (-1 for unaddressed), read in sorted
+   runs so each run is one chunked read */
+static void zoom_gather(tbk_t *tbk, const int64_t *off, int n, view_conf_t *vconf,
+                        int n_chunk_data, zoom_aux_t *aux, float *v) {
+  int i, j, k = 0, sorted = 1;
+  float cov;
+  for (i=0; i<n; ++i) {
+    if (off[i] < 0) { v[i] = NAN; continue; }
+    if (off[i] >= tbk->nmax)
+      wzfatal("Error: query %"PRId64" out of range. Wrong idx file?", off[i]);
+    aux->keys[k] = (uint64_t) off[i] << 16 | i;
+    if (k && aux->keys[k] < aux->keys[k-1]) sorted = 0;
+    ++k;
+  }
+  if (!sorted) ks_introsort(uint64_t, k, aux->keys);
+
+  for (i=0; i<k; ) {
+    int64_t run_beg = aux->keys[i] >> 16;
+    for (j=i+1; j<k &&
+           (int64_t) (aux->keys[j] >> 16) - run_beg < n_chunk_data &&
+           (aux->keys[j] >> 16) - (aux->keys[j-1] >> 16) <= ZOOM_MAX_GAP; ++j);
+    tbk_query_n(tbk, run_beg, (aux->keys[j-1] >> 16) - run_beg + 1, &aux->data);
+    for (; i<j; ++i)
+      v[aux->keys[i] & 0xffff] = tbk_data_float(&aux->data, (aux->keys[i] >> 16) - run_beg, vconf, &cov);
+  }
+}
+
+typedef struct zoom_acc_t {
+  int32_t bin;
+  int32_t n;
+  double sum;
+  float min, max;
+} zoom_acc_t;
+
+static void zoom_acc_flush(zoom_acc_t *a, zoom_bin_t *b) {
+  b->bin = a->bin;
+  b->n = a->n;
+  b->mean = a->n ? a->sum / a->n : NAN;
+  b->min = a->n ? a->min : NAN;
+  b->max = a->n ? a->max : NAN;
+}
+
+static void zoom_write(tbk_t *tbk, zoom_plan_t *zp, zoom_conf_t *conf, zoom_bin_t **bins) {
+  tbk_cache_t *c = zp->cache;
+  char *fname = malloc(strlen(tbk->tbf->fname) + 5);
+  sprintf(fname, "%s.tbr", tbk->tbf->fname);
+  FILE *fh = fopen(fname, "wb");
+  if (!fh) wzfatal("Cannot open %s to write.\n", fname);
+
+  char hdr[ZOOM_HDR_BYTES] = "tbr";
+  int32_t version = ZOOM_VERSION, n_seqs = c->n_seqs, n_levels = conf->n_levels;
+  int64_t stamp[3];
+  uLong crc = crc32(0L, Z_NULL, 0);
+  if (file_stamp(tbk->tbf->fname, stamp)) wzfatal("Cannot stat %s.\n", tbk->tbf->fname);
+  memcpy(hdr + 4, &version, 4);
+  memcpy(hdr + 8, stamp, 24);
+  memcpy(hdr + 32, zp->idx_stamp, 24);
+  memcpy(hdr + 56, &n_seqs, 4);
+  memcpy(hdr + 60, &n_levels, 4);
+  fwrite(hdr, 1, ZOOM_HDR_BYTES, fh);
+
+  int l;
+  int64_t offset = ZOOM_HDR_BYTES + ZOOM_LEVEL_BYTES * n_levels;
+  offset = (offset + 7) & ~7LL;
+  for (l=0; l<n_levels; ++l) {
+    char ent[ZOOM_LEVEL_BYTES] = {0};
+    memcpy(ent, &conf->sizes[l], 4);
+    memcpy(ent + 8, &zp->n_bins[l], 8);
+    memcpy(ent + 16, &offset, 8);
+    zoom_fwrite(ent, ZOOM_LEVEL_BYTES, fh, &crc);
+    offset += level_bytes(n_seqs, zp->n_bins[l]);
+  }
+  static const char pad[8] = {0};
+  int64_t pos = ZOOM_HDR_BYTES + ZOOM_LEVEL_BYTES * n_levels;
+  zoom_fwrite(pad, ((pos + 7) & ~7LL) - pos, fh, &crc);
+  for (l=0; l<n_levels; ++l) {
+    int64_t b = sizeof(int64_t) * (n_seqs + 1) + sizeof(zoom_bin_t) * zp->n_bins[l];
+    zoom_fwrite(zp->seq_bin[l], sizeof(int64_t) * (n_seqs + 1), fh, &crc);
+    zoom_fwrite(bins[l], sizeof(zoom_bin_t) * zp->n_bins[l], fh, &crc);
+    zoom_fwrite(pad, ((b + 7) & ~7LL) - b, fh, &crc);
+  }
+  uint32_t crc32v = crc;
+  if (fseek(fh, 64, SEEK_SET)) wzfatal("Cannot seek in %s.\n", fname);
+  fwrite(&crc32v, 4, 1, fh);
+  if (fclose(fh)) wzfatal("Cannot write to %s.\n", fname);
+  free(fname);
+}
+
+/* one pass over the index rows, all levels at once */
+static void zoom_sample(tbk_t *tbk0, zoom_plan_t *zp, zoom_conf_t *conf) {
+
+  tbf_t tbf; tbk_t tbk;
+  tbk_open_private(tbk0, &tbk, &tbf);
+
+  static view_conf_t vconf = {.min_coverage = -1, .max_pval = -1, .na_for_negative = 1};
+  tbk_cache_t *c = zp->cache;
+  int n_levels = conf->n_levels, l, t;
+  zoom_bin_t **bins = malloc(sizeof(zoom_bin_t*) * n_levels);
+  zoom_acc_t *acc = malloc(sizeof(zoom_acc_t) * n_levels);
+  int64_t *n_bins = calloc(n_levels, sizeof(int64_t));
+  for (l=0; l<n_levels; ++l) bins[l] = malloc(sizeof(zoom_bin_t) * max(1, zp->n_bins[l]));
+
+  zoom_aux_t aux = {0};
+  aux.keys = malloc(sizeof(uint64_t) * ZOOM_CHUNK);
+  float *v = malloc(sizeof(float) * ZOOM_CHUNK);
+  for (t=0; t<c->n_seqs; ++t) {
+    int64_t row_beg, i;
+    for (l=0; l<n_levels; ++l) acc[l].bin = -1;
+    for (row_beg = c->seq_beg[t]; row_beg < c->seq_beg[t+1]; row_beg += ZOOM_CHUNK) {
+      int n = min(ZOOM_CHUNK, c->seq_beg[t+1] - row_beg);
+      zoom_gather(&tbk, c->off + row_beg, n, &vconf, conf->n_chunk_data, &aux, v);
+      for (l=0; l<n_levels; ++l) {
+        zoom_acc_t *a = &acc[l];
+        int32_t size = conf->sizes[l];
+        for (i=0; i<n; ++i) {
+          int32_t b = c->beg[row_beg + i] / size;
+          if (b != a->bin) {
+            if (a->bin >= 0) zoom_acc_flush(a, &bins[l][n_bins[l]++]);
+            a->bin = b; a->n = 0; a->sum = 0;
+            a->min = INFINITY; a->max = -INFINITY;
+          }
+          float x = v[i];
+          if (x != x) continue;
+          a->n++; a->sum += x;
+          if (x < a->min) a->min = x;
+          if (x > a->max) a->max = x;
+        }
+      }
+    }
+    for (l=0; l<n_levels; ++l)
+      if (acc[l].bin >= 0) zoom_acc_flush(&acc[l], &bins[l][n_bins[l]++]);
+  }
+  for (l=0; l<n_levels; ++l)
+    if (n_bins[l] != zp->n_bins[l]) wzfatal("[%s] Bin count mismatch.\n", __func__);
+
+  zoom_write(tbk0, zp, conf, bins);
+
+  for (l=0; l<n_levels; ++l) free(bins[l]);
+  free(bins); free(acc); free(n_bins);
+  free(aux.keys); free(aux.data.data); free(v);
+  tbf_close(&tbf);
+}
+
+typedef struct zoom_worker_t {
+  tbk_t *tbks;
+  int n_tbks;
+  zoom_plan_t *zp;
+  zoom_conf_t *conf;
+  int *next;                    /* next sample to process */
+} zoom_worker_t;
+
+static void *zoom_worker(void *arg) {
+  zoom_worker_t *w = (zoom_worker_t*) arg;
+  int k;
+  while ((k = __sync_fetch_and_add(w->next, 1)) < w->n_tbks)
+    zoom_sample(&w->tbks[k], w->zp, w->conf);
+  return NULL;
+}
+
+static int parse_sizes(char *s, int32_t **sizes) {
+  char **fields; int nfields, i;
+  line_get_fields(s, ",", &fields, &nfields);
+  *sizes = realloc(*sizes, sizeof(int32_t) * nfields);
+  for (i=0; i<nfields; ++i) {
+    (*sizes)[i] = atoi(fields[i]);
+    if ((*sizes)[i] <= 0 || (i && (*sizes)[i] <= (*sizes)[i-1]))
+      wzfatal("Bin sizes must be positive and increasing: %s.\n", s);
+  }
+  free_fields(fields, nfields);
+  return nfields;
+}
+
+/* NULL if tbk has no zoom file, or one not matching tbk and idx_fname */
+tbk_zoom_t *tbk_zoom_open(tbk_t *tbk, const char *idx_fname) {
+  if (tbk->offset_sample_beg != 0 || tbk->version >= 100) return NULL; /* bundled */
+  char *fname = malloc(strlen(tbk->tbf->fname) + 5);
+  sprintf(fname, "%s.tbr", tbk->tbf->fname);
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) { free(fname); return NULL; }
+
+  struct stat s;
+  char hdr[ZOOM_HDR_BYTES];
+  int64_t stamp[6];
+  int32_t version, n_seqs, n_levels;
+  uint32_t crc;
+  if (fstat(fd, &s) || file_stamp(tbk->tbf->fname, stamp) ||
+      file_stamp(idx_fname, stamp + 3) ||
+      pread(fd, hdr, ZOOM_HDR_BYTES, 0) != ZOOM_HDR_BYTES) goto stale;
+  memcpy(&version, hdr + 4, 4);
+  memcpy(&n_seqs, hdr + 56, 4);
+  memcpy(&n_levels, hdr + 60, 4);
+  memcpy(&crc, hdr + 64, 4);
+  if (memcmp(hdr, "tbr\0", 4) || version != ZOOM_VERSION || memcmp(hdr + 8, stamp, 48) ||
+      n_levels <= 0 || s.st_size < ZOOM_HDR_BYTES + ZOOM_LEVEL_BYTES * n_levels) goto stale;
+
+  tbk_zoom_t *z = calloc(1, sizeof(tbk_zoom_t));
+  z->n_seqs = n_seqs;
+  z->n_levels = n_levels;
+  z->map_size = s.st_size;
+  z->map = mmap(NULL, z->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (z->map == MAP_FAILED) wzfatal("Cannot mmap %s.\n", fname);
+  if (crc32(0L, (const Bytef*) z->map + ZOOM_HDR_BYTES, z->map_size - ZOOM_HDR_BYTES) != crc) {
+    munmap(z->map, z->map_size); free(z);
+    fprintf(stderr, "[%s] %s is corrupt, not used.\n", __func__, fname);
+    free(fname);
+    return NULL;
+  }
+  z->levels = calloc(n_levels, sizeof(zoom_level_t));
+  int l;
+  for (l=0; l<n_levels; ++l) {
+    const char *ent = (char*) z->map + ZOOM_HDR_BYTES + ZOOM_LEVEL_BYTES * l;
+    int64_t offset;
+    zoom_level_t *zl = &z->levels[l];
+    memcpy(&zl->bin_size, ent, 4);
+    memcpy(&zl->n_bins, ent + 8, 8);
+    memcpy(&offset, ent + 16, 8);
+    if (offset + level_bytes(n_seqs, zl->n_bins) > (int64_t) z->map_size)
+      wzfatal("%s is truncated.\n", fname);
+    zl->seq_bin = (const int64_t*) ((char*) z->map + offset);
+    zl->bins = (const zoom_bin_t*) (zl->seq_bin + n_seqs + 1);
+  }
+  free(fname);
+  return z;
+
+stale:
+  fprintf(stderr, "[%s] %s is out of date, not used.\n", __func__, fname);
+  close(fd); free(fname);
+  return NULL;
+}
+
+void tbk_zoom_close(tbk_zoom_t *z) {
+  if (!z) return;
+  munmap(z->map, z->map_size);
+  free(z->levels);
+  free(z);
+}
+
+static zoom_level_t *zoom_find_level(tbk_zoom_t *z, int bin_size) {
+  int l;
+  for (l=0; l<z->n_levels; ++l)
+    if (z->levels[l].bin_size == bin_size) return &z->levels[l];
+  return NULL;
+}
+
+/* bin size of the coarsest level at most resolution bp that every tbk
+   has, 0 if there is none */
+int zoom_pick_level(tbk_t *tbks, int n_tbks, int resolution) {
+  int k, l, bin_size = 0;
+  if (!n_tbks || !tbks[0].zoom) return 0;
+  tbk_zoom_t *z0 = tbks[0].zoom;
+  for (l=0; l<z0->n_levels; ++l)
+    if (z0->levels[l].bin_size <= resolution && z0->levels[l].bin_size > bin_size)
+      bin_size = z0->levels[l].bin_size;
+  if (!bin_size) return 0;
+  zoom_level_t *l0 = zoom_find_level(z0, bin_size);
+  for (k=1; k<n_tbks; ++k) {
+    zoom_level_t *lk = tbks[k].zoom ? zoom_find_level(tbks[k].zoom, bin_size) : NULL;
+    if (!lk || tbks[k].zoom->n_seqs != z0->n_seqs || lk->n_bins != l0->n_bins ||
+        memcmp(lk->seq_bin, l0->seq_bin, sizeof(int64_t) * (z0->n_seqs + 1))) return 0;
+  }
+  return bin_size;
+}
+
+static void zoom_print_bin(kstring_t *ks, const char *seqname, int64_t j, int bin_size,
+                           zoom_level_t **lv, int n_tbks, view_conf_t *conf) {
+  int64_t beg = (int64_t) lv[0]->bins[j].bin * bin_size;
+  int k;
+  ksprintf(ks, "%s\t%"PRId64"\t%"PRId64, seqname, beg, beg + bin_size);
+  for (k=0; k<n_tbks; ++k) {
+    const zoom_bin_t *b = &lv[k]->bins[j];
+    if (!b->n) {
+      kputc('\t', ks); kputs(conf->na_token, ks);
+      if (conf->print_all_units) {
+        kputc('\t', ks); kputs(conf->na_token, ks);
+        kputc('\t', ks); kputs(conf->na_token, ks);
+        kputs("\t0", ks);
+      }
+    } else {
+      ksprintf(ks, "\t%f", b->mean);
+      if (conf->print_all_units) ksprintf(ks, "\t%f\t%f\t%d", b->min, b->max, b->n);
+    }
+  }
+  kputc('\n', ks);
+}
+
+/* one row per bin of the level of bin_size overlapping the regions, the
+   regions planned by plan_regions */
+int zoom_query_regions(tbx_t *tbx, tbk_region_t *regs, int nregs, tbk_t *tbks, int n_tbks,
+                       int bin_size, view_conf_t *conf, FILE *out_fh) {
+
+  int k, i, n_seqs;
+  const char **seqnames = tbx_seqnames(tbx, &n_seqs);
+  zoom_level_t **lv = malloc(sizeof(zoom_level_t*) * n_tbks);
+  for (k=0; k<n_tbks; ++k) lv[k] = zoom_find_level(tbks[k].zoom, bin_size);
+  if (tbks[0].zoom->n_seqs != n_seqs) wzfatal("[%s] Zoom levels do not match the index.\n", __func__);
+
+  kstring_t ks = {0};
+  if (conf->column_name) {
+    kputs("seqname\tstart\tend", &ks);
+    for (k=0; k<n_tbks; ++k) {
+      ksprintf(&ks, "\t%s", tbks[k].sname);
+      if (conf->print_all_units)
+        ksprintf(&ks, "\t%s_min\t%s_max\t%s_n", tbks[k].sname, tbks[k].sname, tbks[k].sname);
+    }
+    kputc('\n', &ks);
+  }
+
+  int64_t last = -1, j;
+  for (i=0; i<nregs; ++i) {
+    tbk_region_t *r = &regs[i];
+    int t0, t1;
+    if (r->tid == HTS_IDX_START) { t0 = 0; t1 = n_seqs; }
+    else if (r->tid >= 0 && r->tid < n_seqs) { t0 = r->tid; t1 = t0 + 1; }
+    else continue;
+    int t;
+    for (t=t0; t<t1; ++t) {
+      int64_t a = lv[0]->seq_bin[t], b = lv[0]->seq_bin[t+1], mid;
+      int64_t bin_beg = 0, bin_end = INT64_MAX;
+      if (r->tid != HTS_IDX_START) {
+        bin_beg = r->beg / bin_size;
+        bin_end = ((int64_t) r->end + bin_size - 1) / bin_size;
+      }
+      while (a < b) {           /* first bin >= bin_beg */
+        mid = a + (b - a) / 2;
+        if (lv[0]->bins[mid].bin < bin_beg) a = mid + 1; else b = mid;
+      }
+      for (j = a; j < lv[0]->seq_bin[t+1] && lv[0]->bins[j].bin < bin_end; ++j) {
+        if (!conf->keep_order && j <= last) continue; /* shared by merged regions */
+        zoom_print_bin(&ks, seqnames[t], j, bin_size, lv, n_tbks, conf);
+        last = j;
+      }
+      if (ks.l >= (1<<20)) { fwrite(ks.s, 1, ks.l, out_fh); ks.l = 0; }
+    }
+  }
+  fwrite(ks.s, 1, ks.l, out_fh);
+  free(ks.s); free(lv); free(seqnames);
+  return 0;
+}
+
+int main_zoom(int argc, char *argv[]) {
+
+  zoom_conf_t conf = {0};
+  conf.sizes = malloc(sizeof(int32_t) * 3);
+  conf.sizes[0] = 10000; conf.sizes[1] = 100000; conf.sizes[2] = 1000000;
+  conf.n_levels = 3;
+  conf.n_threads = 1;
+  conf.n_chunk_data = 1000000;
+
+  int c;
+  if (argc<2) return usage(&conf);
+
+  char *idx_fname = NULL;
+  char *tbk_fname_list = NULL;
+  while ((c = getopt(argc, argv, "i:l:z:n:@:h"))>=0) {
+    switch (c) {
+    case 'i': idx_fname = strdup(optarg); break;
+    case 'l': tbk_fname_list = strdup(optarg); break;
+    case 'z': conf.n_levels = parse_sizes(optarg, &conf.sizes); break;
+    case 'n': conf.n_chunk_data = atoi(optarg); break;
+    case '@': conf.n_threads = atoi(optarg); break;
+    case 'h': return usage(&conf); break;
+    default: usage(&conf); wzfatal("Unrecognized option: %c.\n", c);
+    }
+  }
+
+  int n_tbks = 0; tbk_t *tbks = NULL;
+  int n_tbfs = 0; tbf_t *tbfs = NULL;
+  parse_tbf_from_argument(argc, argv, optind, &tbfs, &n_tbfs);
+  parse_tbf_fname_list(tbk_fname_list, &tbfs, &n_tbfs);
+  int i;
+  for (i=0; i<n_tbfs; ++i) parse_tbk_from_tbf(&tbfs[i], &tbks, &n_tbks);
+  if (!n_tbks) { usage(&conf); wzfatal("Please supply tbk file.\n"); }
+  for (i=0; i<n_tbks; ++i) {
+    if (!dtype_is_numeric(tbks[i].dtype))
+      wzfatal("%s: data type %d cannot be zoomed.\n", tbks[i].sname, DATA_TYPE(tbks[i].dtype));
+    if (tbks[i].offset_sample_beg != 0 || tbks[i].version >= 100)
+      wzfatal("%s: zoom levels are not supported for bundled tbks.\n", tbks[i].sname);
+  }
+  infer_idx(tbks, n_tbks, &idx_fname);
+
+  zoom_plan_t zp = {0};
+  tbx_t *tbx = tbx_index_load(idx_fname);
+  if (!tbx) wzfatal("Could not load .tbi/.csi index of %s\n", idx_fname);
+  if (file_stamp(idx_fname, zp.idx_stamp)) wzfatal("Cannot stat %s.\n", idx_fname);
+  if (!(zp.cache = tbk_cache_open(idx_fname, tbx, 1)))
+    wzfatal("Cannot build the cache of %s.\n", idx_fname);
+  zoom_plan_init(&zp, &conf);
+
+  int next = 0;
+  int n_threads = max(1, min(conf.n_threads, n_tbks));
+  zoom_worker_t w = {tbks, n_tbks, &zp, &conf, &next};
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  for (i=0; i<n_threads; ++i) pthread_create(&threads[i], NULL, zoom_worker, &w);
+  for (i=0; i<n_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+
+  zoom_plan_free(&zp, &conf);
+  tbk_cache_close(zp.cache);
+  tbx_destroy(tbx);
+  if (n_tbfs > 0) {for (i=0; i<n_tbfs; ++i) tbf_close(&tbfs[i]); free(tbfs);}
+  if (n_tbks > 0) {for (i=0; i<n_tbks; ++i) free(tbks[i].sname); free(tbks);}
+  free(idx_fname); free(tbk_fname_list); free(conf.sizes);
+  return 0;
+}